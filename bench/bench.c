@@ -0,0 +1,327 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/* Throughput benchmark: starts the stand-in server, runs ncdm headless
+ * over each scenario and appends one JSON line per run to the output. */
+
+typedef struct Scenario {
+    const char *name;
+    int nb_files;
+    int nb_hosts;
+    uint64_t size;
+    int resume;
+    const char *args;
+} Scenario;
+
+typedef struct Result {
+    uint64_t bytes;
+    double wall;
+    double user;
+    double sys;
+    long maxrss;
+    int ok;
+} Result;
+
+#define KB (1024ULL)
+#define MB (1024ULL * KB)
+#define MAX_ARGS 64
+#define VERIFY_SIZE (1024 * 1024)
+
+static const Scenario scenarios[] = {
+    { "huge",   1,     1,  1024 * MB, 0, "" },
+    { "tiny",   10000, 1,  1 * KB,    0, "-M 16" },
+    { "hosts",  1024,  64, 256 * KB,  0, "-M 64 -H 2" },
+    { "resume", 1,     1,  256 * MB,  1, "" },
+};
+
+static const Scenario quick_scenarios[] = {
+    { "huge",   1,     1,  64 * MB,   0, "" },
+    { "tiny",   1000,  1,  1 * KB,    0, "-M 16" },
+    { "hosts",  128,   16, 256 * KB,  0, "-M 64 -H 2" },
+    { "resume", 1,     1,  32 * MB,   1, "" },
+};
+
+#define NB_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+const char *ncdm = "./ncdm";
+const char *server = "./bench/server";
+const char *label = "";
+char server_args[256] = "";
+unsigned char *pattern = NULL;
+
+static int split_args(char *string, char **argv, int argc)
+{
+    char *token;
+
+    for (token = strtok(string, " "); token && argc < MAX_ARGS - 1; token = strtok(NULL, " "))
+        argv[argc++] = token;
+    argv[argc] = NULL;
+
+    return argc;
+}
+
+static pid_t start_server(const Scenario *s, int *port)
+{
+    char args[sizeof(server_args)], hosts[16];
+    char *argv[MAX_ARGS] = { (char *)server, "-p", "0", "-H", hosts };
+    int fds[2];
+    FILE *out;
+    pid_t pid;
+
+    snprintf(hosts, sizeof(hosts), "%d", s->nb_hosts);
+    snprintf(args, sizeof(args), "%s", server_args);
+    split_args(args, argv, 5);
+
+    if (pipe(fds))
+        return -1;
+
+    pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv(server, argv);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    out = fdopen(fds[0], "r");
+    if (!out || fscanf(out, "%d", port) != 1) {
+        if (out)
+            fclose(out);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    fclose(out);
+
+    return pid;
+}
+
+static int write_pattern(const char *name, uint64_t size)
+{
+    FILE *file = fopen(name, "wb");
+    uint64_t offset;
+
+    if (!file)
+        return -1;
+
+    for (offset = 0; offset < size; offset += VERIFY_SIZE) {
+        size_t n = size - offset < VERIFY_SIZE ? size - offset : VERIFY_SIZE;
+
+        fwrite(pattern + offset % PATTERN_PERIOD, 1, n, file);
+    }
+
+    return fclose(file);
+}
+
+static int verify_pattern(const char *name, uint64_t size)
+{
+    unsigned char *buf = malloc(VERIFY_SIZE);
+    FILE *file = fopen(name, "rb");
+    uint64_t offset = 0;
+    size_t n = 0;
+
+    if (!buf || !file) {
+        free(buf);
+        if (file)
+            fclose(file);
+        return 0;
+    }
+
+    while ((n = fread(buf, 1, VERIFY_SIZE, file)) > 0) {
+        if (offset + n > size || memcmp(buf, pattern + offset % PATTERN_PERIOD, n))
+            break;
+        offset += n;
+    }
+    fclose(file);
+    free(buf);
+
+    return n == 0 && offset == size;
+}
+
+static int run_scenario(const Scenario *s, Result *r)
+{
+    char dir[] = "/tmp/ncdm-bench-XXXXXX";
+    char args[256], name[64];
+    char *argv[MAX_ARGS] = { (char *)ncdm, "-b", "1" };
+    struct timespec start, end;
+    struct rusage ru;
+    FILE *urls;
+    int argc, port, status, i;
+    pid_t spid, pid;
+
+    memset(r, 0, sizeof(*r));
+
+    if (!mkdtemp(dir) || chdir(dir)) {
+        fprintf(stderr, "Failed to create work directory: %s\n", strerror(errno));
+        return -1;
+    }
+
+    spid = start_server(s, &port);
+    if (spid < 0) {
+        fprintf(stderr, "Failed to start %s\n", server);
+        return -1;
+    }
+
+    urls = fopen("urls.txt", "w");
+    for (i = 0; urls && i < s->nb_files; i++) {
+        fprintf(urls, "http://127.0.0.%d:%d/%" PRIu64 "/f%d.bin\n",
+                1 + i % s->nb_hosts, port, s->size, i);
+        if (s->resume) {
+            snprintf(name, sizeof(name), "f%d.bin", i);
+            write_pattern(name, s->size / 2);
+        }
+    }
+    if (urls)
+        fclose(urls);
+
+    snprintf(args, sizeof(args), "%s", s->args);
+    argc = split_args(args, argv, 3);
+    argv[argc++] = "-i";
+    argv[argc++] = "urls.txt";
+    argv[argc] = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid = fork();
+    if (pid == 0) {
+        struct rlimit rl;
+        int null = open("/dev/null", O_RDWR);
+
+        /* ncdm keeps an open file per item */
+        if (!getrlimit(RLIMIT_NOFILE, &rl)) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv(ncdm, argv);
+        _exit(127);
+    }
+    wait4(pid, &status, 0, &ru);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    kill(spid, SIGTERM);
+    waitpid(spid, NULL, 0);
+
+    r->wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    r->user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    r->sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    r->maxrss = ru.ru_maxrss;
+    r->ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    r->bytes = (s->size - (s->resume ? s->size / 2 : 0)) * s->nb_files;
+
+    for (i = 0; i < s->nb_files; i++) {
+        snprintf(name, sizeof(name), "f%d.bin", i);
+        if (r->ok && !verify_pattern(name, s->size))
+            r->ok = 0;
+        unlink(name);
+    }
+    unlink("urls.txt");
+    if (chdir("/") || rmdir(dir))
+        fprintf(stderr, "Failed to remove %s\n", dir);
+
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n ncdm] [-s server] [-o output] [-c label] [-q]\n"
+                    "       [-l latency_ms] [-r bytes_per_s] [-e error_percent] [scenario...]\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const Scenario *set = scenarios;
+    const char *output = "bench_output.txt";
+    FILE *out;
+    int opt, failed = 0;
+    size_t i;
+
+    while ((opt = getopt(argc, argv, "n:s:o:c:ql:r:e:")) != -1) {
+        size_t len = strlen(server_args);
+
+        switch (opt) {
+        case 'n': ncdm = optarg; break;
+        case 's': server = optarg; break;
+        case 'o': output = optarg; break;
+        case 'c': label = optarg; break;
+        case 'q': set = quick_scenarios; break;
+        case 'l':
+        case 'r':
+        case 'e':
+            snprintf(server_args + len, sizeof(server_args) - len, " -%c %s", opt, optarg);
+            break;
+        default: usage(argv[0]);
+        }
+    }
+
+    /* scenarios run in their own directories */
+    if (!(ncdm = realpath(ncdm, NULL)) || !(server = realpath(server, NULL))) {
+        fprintf(stderr, "Failed to find ncdm or bench server.\n");
+        return 1;
+    }
+
+    out = fopen(output, "a");
+    pattern = malloc(VERIFY_SIZE + PATTERN_PERIOD);
+    if (!out || !pattern) {
+        fprintf(stderr, "Failed to open %s.\n", output);
+        return 1;
+    }
+    for (i = 0; i < VERIFY_SIZE + PATTERN_PERIOD; i++)
+        pattern[i] = pattern_byte(i);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < NB_SCENARIOS; i++) {
+        const Scenario *s = &set[i];
+        Result r;
+        int j;
+
+        for (j = optind; j < argc; j++) {
+            if (!strcmp(argv[j], s->name))
+                break;
+        }
+        if (optind < argc && j == argc)
+            continue;
+
+        if (run_scenario(s, &r) < 0)
+            return 1;
+
+        fprintf(out, "{\"label\":\"%s\",\"scenario\":\"%s\",\"files\":%d,\"bytes\":%" PRIu64 ","
+                     "\"wall_s\":%.3f,\"mb_s\":%.2f,\"files_s\":%.1f,\"cpu_user_s\":%.3f,"
+                     "\"cpu_sys_s\":%.3f,\"peak_rss_kb\":%ld,\"ok\":%s}\n",
+                label, s->name, s->nb_files, r.bytes, r.wall, r.bytes / r.wall / MB,
+                s->nb_files / r.wall, r.user, r.sys, r.maxrss, r.ok ? "true" : "false");
+        fflush(out);
+
+        printf("%-8s %8.2f MB/s %10.1f files/s  cpu %.2fs+%.2fs  rss %ld KB  %s\n",
+               s->name, r.bytes / r.wall / MB, s->nb_files / r.wall,
+               r.user, r.sys, r.maxrss, r.ok ? "ok" : "FAILED");
+        failed |= !r.ok;
+    }
+
+    fclose(out);
+    free(pattern);
+
+    return failed;
+}
@@ -0,0 +1,15 @@
+#ifndef NCDM_BENCH_H
+#define NCDM_BENCH_H
+
+#include <stdint.h>
+
+/* Synthetic files served by the bench server are a repeating pattern, so
+ * any byte can be generated and verified from its offset alone. */
+#define PATTERN_PERIOD 251
+
+static inline unsigned char pattern_byte(uint64_t offset)
+{
+    return offset % PATTERN_PERIOD;
+}
+
+#endif
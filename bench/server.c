@@ -0,0 +1,324 @@
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/* Local stand-in HTTP server for benchmarking ncdm.
+ *
+ * GET or HEAD /<size>/<name> returns <size> bytes of the pattern from
+ * bench.h. The body can be delayed, rate limited and made to fail.
+ * If-None-Match and If-Range are honoured, the ETag changes with -g. */
+
+typedef struct Transfer {
+    struct evhttp_request *req;
+    struct evhttp_connection *evcon;
+    struct event *timer;
+    uint64_t start;
+    uint64_t offset;
+    uint64_t end;
+    int code;
+    struct timeval started;
+} Transfer;
+
+#define CHUNK_SIZE (64 * 1024)
+#define MAX_HOSTS  250
+#define LAST_MODIFIED "Thu, 01 Jan 2026 00:00:00 GMT"
+
+struct event_base *base = NULL;
+unsigned char *pattern = NULL;
+long latency = 0;
+long rate = 0;
+int error_rate = 0;
+int ranges = 1;
+int generation = 0;
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static void free_transfer(Transfer *t)
+{
+    if (t->evcon)
+        evhttp_connection_set_closecb(t->evcon, NULL, NULL);
+    event_free(t->timer);
+    free(t);
+}
+
+static void close_cb(struct evhttp_connection *evcon, void *arg)
+{
+    (void)evcon;
+
+    free_transfer(arg);
+}
+
+static void send_chunk(Transfer *t);
+
+static void chunk_cb(struct evhttp_connection *evcon, void *arg)
+{
+    Transfer *t = arg;
+    (void)evcon;
+
+    /* finishing the reply may close the connection, detach first */
+    if (t->offset >= t->end) {
+        struct evhttp_request *req = t->req;
+
+        free_transfer(t);
+        evhttp_send_reply_end(req);
+    } else if (rate > 0) {
+        struct timeval now, due, tv;
+        uint64_t sent = t->offset - t->start;
+
+        /* schedule against the start so timer slack does not add up */
+        due.tv_sec = sent / rate;
+        due.tv_usec = (sent % rate) * 1000000 / rate;
+        evutil_timeradd(&t->started, &due, &due);
+        event_base_gettimeofday_cached(base, &now);
+        if (evutil_timercmp(&due, &now, >)) {
+            evutil_timersub(&due, &now, &tv);
+            evtimer_add(t->timer, &tv);
+        } else {
+            send_chunk(t);
+        }
+    } else {
+        send_chunk(t);
+    }
+}
+
+static void send_chunk(Transfer *t)
+{
+    struct evbuffer *buf = evbuffer_new();
+    size_t size = MIN(t->end - t->offset, CHUNK_SIZE);
+
+    /* shape in 10 ms slices */
+    if (rate > 0)
+        size = MIN(size, (size_t)rate / 100 + 1);
+
+    evbuffer_add(buf, pattern + t->offset % PATTERN_PERIOD, size);
+    t->offset += size;
+    evhttp_send_reply_chunk_with_cb(t->req, buf, chunk_cb, t);
+    evbuffer_free(buf);
+}
+
+static void rate_cb(evutil_socket_t fd, short kind, void *arg)
+{
+    (void)fd;
+    (void)kind;
+
+    send_chunk(arg);
+}
+
+static void start_cb(evutil_socket_t fd, short kind, void *arg)
+{
+    Transfer *t = arg;
+    (void)fd;
+    (void)kind;
+
+    if (evhttp_request_get_command(t->req) == EVHTTP_REQ_HEAD) {
+        struct evhttp_request *req = t->req;
+        int code = t->code;
+
+        free_transfer(t);
+        evhttp_send_reply(req, code, NULL, NULL);
+        return;
+    }
+
+    event_free(t->timer);
+    t->timer = evtimer_new(base, rate_cb, t);
+    event_base_gettimeofday_cached(base, &t->started);
+    evhttp_send_reply_start(t->req, t->code, NULL);
+    send_chunk(t);
+}
+
+static int parse_range(const char *range, uint64_t size, uint64_t *start, uint64_t *end)
+{
+    char *endptr;
+
+    if (!range || strncmp(range, "bytes=", 6) || strchr(range, ','))
+        return 0;
+
+    range += 6;
+    if (*range == '-') {
+        uint64_t suffix = strtoull(range + 1, &endptr, 10);
+
+        *start = suffix < size ? size - suffix : 0;
+        *end = size;
+        return 1;
+    }
+
+    *start = strtoull(range, &endptr, 10);
+    if (*endptr != '-')
+        return 0;
+    if (endptr[1])
+        *end = MIN(strtoull(endptr + 1, NULL, 10) + 1, size);
+    else
+        *end = size;
+
+    return 1;
+}
+
+static void request_cb(struct evhttp_request *req, void *arg)
+{
+    struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
+    struct evkeyvalq *input = evhttp_request_get_input_headers(req);
+    const char *if_range = evhttp_find_header(input, "If-Range");
+    const char *match = evhttp_find_header(input, "If-None-Match");
+    const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+    uint64_t size, start = 0, end;
+    char value[128];
+    int changed;
+    Transfer *t;
+    (void)arg;
+
+    if (!path || path[0] != '/' || path[1] < '0' || path[1] > '9') {
+        evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+        return;
+    }
+
+    if (error_rate > 0 && rand() % 100 < error_rate) {
+        evhttp_send_error(req, HTTP_SERVUNAVAIL, NULL);
+        return;
+    }
+
+    size = strtoull(path + 1, NULL, 10);
+    end = size;
+
+    snprintf(value, sizeof(value), "\"%" PRIx64 "-%d\"", size, generation);
+    evhttp_add_header(headers, "ETag", value);
+    evhttp_add_header(headers, "Last-Modified", LAST_MODIFIED);
+    evhttp_add_header(headers, "Content-Type", "application/octet-stream");
+
+    if (match && !strcmp(match, value)) {
+        evhttp_send_reply(req, 304, "Not Modified", NULL);
+        return;
+    }
+    /* a changed file is sent whole, the date only matches generation 0 */
+    changed = if_range && strcmp(if_range, value) && (generation || strcmp(if_range, LAST_MODIFIED));
+
+    t = calloc(1, sizeof(*t));
+    t->req = req;
+    t->code = HTTP_OK;
+
+    if (ranges) {
+        evhttp_add_header(headers, "Accept-Ranges", "bytes");
+        if (!changed && parse_range(evhttp_find_header(input, "Range"),
+                                    size, &start, &end)) {
+            if (start >= size || start >= end) {
+                snprintf(value, sizeof(value), "bytes */%" PRIu64, size);
+                evhttp_add_header(headers, "Content-Range", value);
+                evhttp_send_reply(req, 416, "Range Not Satisfiable", NULL);
+                free(t);
+                return;
+            }
+            snprintf(value, sizeof(value), "bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64,
+                     start, end - 1, size);
+            evhttp_add_header(headers, "Content-Range", value);
+            t->code = 206;
+        }
+    }
+
+    snprintf(value, sizeof(value), "%" PRIu64, end - start);
+    evhttp_add_header(headers, "Content-Length", value);
+
+    t->start = t->offset = start;
+    t->end = end;
+    t->evcon = evhttp_request_get_connection(req);
+    t->timer = evtimer_new(base, start_cb, t);
+    evhttp_connection_set_closecb(t->evcon, close_cb, t);
+
+    if (latency > 0) {
+        struct timeval tv = { latency / 1000, (latency % 1000) * 1000 };
+
+        evtimer_add(t->timer, &tv);
+    } else {
+        start_cb(-1, 0, t);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-p port] [-H hosts] [-l latency_ms] [-r bytes_per_s]\n"
+                    "       [-e error_percent] [-R] [-s seed] [-g generation]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct evhttp_bound_socket *bound;
+    struct evhttp *http;
+    int port = 0, nb_hosts = 1;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "p:H:l:r:e:Rs:g:")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'H': nb_hosts = MIN(MAX_HOSTS, atoi(optarg)); break;
+        case 'l': latency = atol(optarg); break;
+        case 'r': rate = atol(optarg); break;
+        case 'e': error_rate = atoi(optarg); break;
+        case 'R': ranges = 0; break;
+        case 's': srand(atoi(optarg)); break;
+        case 'g': generation = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    pattern = malloc(CHUNK_SIZE + PATTERN_PERIOD);
+    if (!pattern) {
+        fprintf(stderr, "Failed to allocate pattern.\n");
+        return 1;
+    }
+    for (i = 0; i < CHUNK_SIZE + PATTERN_PERIOD; i++)
+        pattern[i] = pattern_byte(i);
+
+    base = event_base_new();
+    http = base ? evhttp_new(base) : NULL;
+    if (!http) {
+        fprintf(stderr, "Failed to create HTTP server.\n");
+        return 1;
+    }
+
+    evhttp_set_allowed_methods(http, EVHTTP_REQ_GET | EVHTTP_REQ_HEAD);
+    evhttp_set_gencb(http, request_cb, NULL);
+
+    /* every 127.0.0.x is local on Linux, so hosts need no setup there */
+    for (i = 1; i <= nb_hosts; i++) {
+        char address[32];
+
+        snprintf(address, sizeof(address), "127.0.0.%d", i);
+        bound = evhttp_bind_socket_with_handle(http, address, port);
+        if (!bound) {
+            fprintf(stderr, "Failed to bind %s:%d.\n", address, port);
+            return 1;
+        }
+
+        if (!port) {
+            struct sockaddr_storage ss;
+            socklen_t len = sizeof(ss);
+
+            getsockname(evhttp_bound_socket_get_fd(bound), (struct sockaddr *)&ss, &len);
+            port = ntohs(((struct sockaddr_in *)&ss)->sin_port);
+        }
+    }
+
+    printf("%d\n", port);
+    fflush(stdout);
+
+    event_base_dispatch(base);
+
+    evhttp_free(http);
+    event_base_free(base);
+    free(pattern);
+
+    return 0;
+}
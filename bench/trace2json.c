@@ -0,0 +1,166 @@
+/* Converts a trace written by ncdm -t into Chrome trace event JSON, which
+ * chrome://tracing and ui.perfetto.dev open directly.
+ *
+ * The record layout and event types are those of main.c, so it is
+ * compiled in directly. */
+
+#define main ncdm_main
+#include "../main.c"
+#undef main
+
+#include <inttypes.h>
+
+static const char *thread_kind(int64_t kind)
+{
+    switch (kind) {
+    case TRACE_MAIN_THREAD:     return "main";
+    case TRACE_UI_THREAD:       return "ui";
+    case TRACE_TRANSFER_THREAD: return "transfer";
+    case TRACE_WRITER_THREAD:   return "writer";
+    }
+    return "thread";
+}
+
+static const char *mode_name(int64_t mode)
+{
+    switch (mode) {
+    case MODE_INACTIVE: return "inactive";
+    case MODE_PAUSED:   return "paused";
+    case MODE_ACTIVE:   return "active";
+    case MODE_FINISHED: return "finished";
+    }
+    return "unknown";
+}
+
+static const char *poll_name(int64_t what)
+{
+    switch (what) {
+    case CURL_POLL_NONE:   return "none";
+    case CURL_POLL_IN:     return "in";
+    case CURL_POLL_OUT:    return "out";
+    case CURL_POLL_INOUT:  return "inout";
+    case CURL_POLL_REMOVE: return "remove";
+    }
+    return "unknown";
+}
+
+static void convert(const TraceEvent *ev, uint64_t base, FILE *out)
+{
+    double ts = (ev->time - base) / 1000.;
+    double dur = ev->duration / 1000.;
+
+    fprintf(out, "{\"pid\":1,\"tid\":%u,\"ts\":%.3f,", ev->thread, ts);
+
+    switch (ev->type) {
+    case TRACE_THREAD:
+        fprintf(out, "\"ph\":\"M\",\"name\":\"thread_name\",\"args\":{\"name\":\"%s %u\"}}",
+                thread_kind(ev->arg), ev->id);
+        break;
+    case TRACE_ADD:
+        fprintf(out, "\"ph\":\"b\",\"cat\":\"item\",\"name\":\"item %u\",\"id\":%u,"
+                     "\"args\":{\"from\":%" PRId64 "}}", ev->id, ev->id, ev->arg);
+        break;
+    case TRACE_START:
+        fprintf(out, "\"ph\":\"n\",\"cat\":\"item\",\"name\":\"start\",\"id\":%u,"
+                     "\"args\":{\"transfer\":%" PRId64 "}}", ev->id, ev->arg);
+        break;
+    case TRACE_REMOVE:
+        fprintf(out, "\"ph\":\"e\",\"cat\":\"item\",\"name\":\"item %u\",\"id\":%u,"
+                     "\"args\":{\"done\":%" PRId64 "}}", ev->id, ev->id, ev->arg);
+        break;
+    case TRACE_STATE:
+        fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"args\":{\"item\":%u}}",
+                mode_name(ev->arg), ev->id);
+        break;
+    case TRACE_SOCKET:
+        fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"socket %s\",\"args\":{\"fd\":%u}}",
+                poll_name(ev->arg), ev->id);
+        break;
+    case TRACE_SOCKET_EVENT:
+        fprintf(out, "\"ph\":\"X\",\"dur\":%.3f,\"name\":\"socket event\","
+                     "\"args\":{\"fd\":%u,\"action\":%" PRId64 "}}", dur, ev->id, ev->arg);
+        break;
+    case TRACE_TIMER:
+        fprintf(out, "\"ph\":\"X\",\"dur\":%.3f,\"name\":\"timer\","
+                     "\"args\":{\"running\":%" PRId64 "}}", dur, ev->arg);
+        break;
+    case TRACE_WRITE:
+        fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"write\","
+                     "\"args\":{\"item\":%u,\"bytes\":%" PRId64 "}}", ev->id, ev->arg);
+        break;
+    case TRACE_DISK_WRITE:
+        fprintf(out, "\"ph\":\"X\",\"dur\":%.3f,\"name\":\"disk write\","
+                     "\"args\":{\"item\":%u,\"bytes\":%" PRId64 "}}", dur, ev->id, ev->arg);
+        break;
+    case TRACE_FRAME:
+        fprintf(out, "\"ph\":\"X\",\"dur\":%.3f,\"name\":\"frame\","
+                     "\"args\":{\"items\":%" PRId64 "}}", dur, ev->arg);
+        break;
+    case TRACE_DROPPED:
+        fprintf(out, "\"ph\":\"C\",\"name\":\"dropped events\",\"args\":{\"dropped\":%" PRId64 "}}",
+                ev->arg);
+        break;
+    default:
+        fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"event %u\"}", ev->type);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    TraceEvent *events = NULL;
+    size_t nb = 0, size = 0, i;
+    uint64_t base = UINT64_MAX;
+    char magic[8];
+    FILE *in, *out;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s trace [output.json]\n", argv[0]);
+        return 1;
+    }
+
+    in = fopen(argv[1], "rb");
+    if (!in || fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+        memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+        fprintf(stderr, "%s is not an ncdm trace.\n", argv[1]);
+        return 1;
+    }
+
+    /* rings are flushed one after another, so events are not in time
+     * order and the earliest one is only known at the end */
+    for (;;) {
+        if (nb == size) {
+            TraceEvent *grown = realloc(events, (size ? size * 2 : 4096) * sizeof(*events));
+
+            if (!grown) {
+                fprintf(stderr, "Failed to allocate events.\n");
+                return 1;
+            }
+            events = grown;
+            size = size ? size * 2 : 4096;
+        }
+        if (fread(&events[nb], sizeof(*events), 1, in) != 1)
+            break;
+        base = MIN(base, events[nb].time);
+        nb++;
+    }
+    fclose(in);
+
+    out = argc > 2 ? fopen(argv[2], "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Failed to open %s.\n", argv[2]);
+        return 1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (i = 0; i < nb; i++) {
+        convert(&events[i], base, out);
+        fprintf(out, i + 1 < nb ? ",\n" : "\n");
+    }
+    fprintf(out, "]}\n");
+
+    if (out != stdout)
+        fclose(out);
+    free(events);
+
+    return 0;
+}
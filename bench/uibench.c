@@ -0,0 +1,206 @@
+/* UI render microbenchmark: renders synthetic download lists of growing
+ * size into an off-screen terminal and reports the cost of each frame and
+ * of each navigation key followed by a frame.
+ *
+ * The UI code is static in main.c, so it is compiled in directly. */
+
+#define main ncdm_main
+#include "../main.c"
+#undef main
+
+#ifdef __GLIBC__
+/* count every allocation, including the ones made inside ncurses */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long nb_allocs = 0;
+
+void *malloc(size_t size)
+{
+    nb_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    nb_allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    nb_allocs++;
+    return __libc_realloc(ptr, size);
+}
+#define ALLOCS_SUPPORTED 1
+#else
+static unsigned long nb_allocs = 0;
+#define ALLOCS_SUPPORTED 0
+#endif
+
+#define NB_FRAMES 50
+
+static const int keys[] = {
+    KEY_DOWN, KEY_DOWN, KEY_DOWN, KEY_NPAGE, KEY_NPAGE, KEY_UP, KEY_PPAGE,
+    KEY_END, KEY_UP, KEY_HOME, '4', KEY_DOWN, KEY_END, '2', KEY_NPAGE,
+    '5', KEY_END, KEY_HOME, '1', 'n', 'N', 'i', KEY_DOWN, 'i', '?', '?',
+    /* every sort order once, ending unsorted */
+    'o', 'o', KEY_NPAGE, KEY_END, '4', KEY_DOWN, 'o', 'O', KEY_HOME, KEY_NPAGE,
+    '1', 'o', 'o', 'o', 'o', 'O',
+};
+
+#define NB_KEYS (sizeof(keys) / sizeof(keys[0]))
+
+static double now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void add_item(int i)
+{
+    DownloadItem *item = new_item();
+    char name[64];
+    int len;
+
+    if (!item) {
+        fprintf(stderr, "Failed to allocate DownloadItem.\n");
+        exit(1);
+    }
+
+    len = snprintf(name, sizeof(name), "http://host%d.example.com/pub/file%07d.bin", i % 97, i);
+    item->url = item_string(item, name, len);
+    len = snprintf(name, sizeof(name), "file%07d.bin", i);
+    item->outputfilename = item_string(item, name, len);
+    item->hot->mode = 1 + rand() % (NB_MODES - 1);
+    item->hot->progress = rand() % 10001 / 100.;
+    item->hot->speed = rand() % (10 * 1024 * 1024);
+    item->hot->eta = rand() % 3600;
+    item->max_speed = 0;
+    item->priority = DEFAULT_PRIORITY;
+
+    if (item->hot->mode == MODE_INACTIVE)
+        inactive_downloads++;
+    else if (item->hot->mode == MODE_PAUSED)
+        paused_downloads++;
+    else if (item->hot->mode == MODE_ACTIVE)
+        active_downloads++;
+    else if (item->hot->mode == MODE_FINISHED)
+        finished_downloads++;
+
+    item->prev = items_tail;
+    if (items_tail)
+        items_tail->next = item;
+    else
+        items = item;
+    items_tail = item;
+    nb_ditems++;
+    index_item(item);
+}
+
+static void run(int nb_items, FILE *out, const char *label)
+{
+    unsigned long allocs;
+    double start, frame_ns, key_ns;
+    int overwritefile = 0;
+    size_t k;
+    int i;
+
+    srand(nb_items);
+    for (i = 0; i < nb_items; i++)
+        add_item(i);
+
+    current_mode = MODE_ALL;
+    sitem[current_mode] = items;
+    free(last_search);
+    last_search = clonestring("file00001", 9);
+
+    render_frame();
+
+    allocs = nb_allocs;
+    start = now_ns();
+    for (i = 0; i < NB_FRAMES; i++)
+        render_frame();
+    frame_ns = (now_ns() - start) / NB_FRAMES;
+    allocs = nb_allocs - allocs;
+
+    start = now_ns();
+    for (k = 0; k < NB_KEYS; k++) {
+        handle_key(keys[k], &overwritefile);
+        render_frame();
+    }
+    key_ns = (now_ns() - start) / NB_KEYS;
+
+    fprintf(out, "{\"label\":\"%s\",\"scenario\":\"ui-%d\",\"items\":%d,\"frame_ns\":%.0f,"
+                 "\"key_frame_ns\":%.0f,\"allocs_per_frame\":",
+            label, nb_items, nb_items, frame_ns, key_ns);
+    if (ALLOCS_SUPPORTED)
+        fprintf(out, "%.1f}\n", (double)allocs / NB_FRAMES);
+    else
+        fprintf(out, "null}\n");
+
+    printf("ui-%-7d %12.0f ns/frame %12.0f ns/key+frame %8.1f allocs/frame\n",
+           nb_items, frame_ns, key_ns, (double)allocs / NB_FRAMES);
+
+    current_mode = MODE_ALL;
+    for (i = 0; i < NB_MODES; i++)
+        sitem[i] = NULL;
+    info_active = help_active = log_active = 0;
+    while (items_tail)
+        delete_ditem(items_tail);
+}
+
+int main(int argc, char *argv[])
+{
+    static const int sizes[] = { 1000, 10000, 100000 };
+    const char *output = "bench_output.txt";
+    const char *label = "";
+    FILE *out;
+    int opt;
+    size_t i;
+
+    while ((opt = getopt(argc, argv, "o:c:")) != -1) {
+        switch (opt) {
+        case 'o': output = optarg; break;
+        case 'c': label = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-o output] [-c label]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    out = fopen(output, "a");
+    nullout = fopen("/dev/null", "w");
+    nullin = fopen("/dev/null", "r");
+    if (!out || !nullout || !nullin) {
+        fprintf(stderr, "Failed to open %s.\n", output);
+        return 1;
+    }
+
+    /* a typical large terminal, unless given by the environment */
+    setenv("LINES", "50", 0);
+    setenv("COLUMNS", "160", 0);
+    screen = newterm("vt100", nullout, nullin);
+    if (!screen) {
+        fprintf(stderr, "Failed to create off-screen terminal.\n");
+        return 1;
+    }
+    if (has_colors()) {
+        start_color();
+        for (i = 1; i <= 7; i++)
+            init_pair(i, i % 8, COLOR_BLACK);
+    }
+    init_windows();
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        run(sizes[i], out, label);
+
+    endwin();
+    fclose(out);
+
+    return 0;
+}
@@ -1,18 +1,130 @@
 #include <assert.h>
 #include <curl/curl.h>
+#include <ctype.h>
 #include <curses.h>
+#include <dirent.h>
+#include <errno.h>
 #include <event.h>
+#include <event2/dns.h>
+#include <fcntl.h>
+#include <float.h>
+#include <fnmatch.h>
+#include <locale.h>
+#include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#include <lzma.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#define TIMING_NAMELOOKUP    0
+#define TIMING_CONNECT       1
+#define TIMING_APPCONNECT    2
+#define TIMING_PRETRANSFER   3
+#define TIMING_STARTTRANSFER 4
+#define TIMING_TOTAL         5
+#define NB_TIMINGS           6
+
+/* bucket b counts phases of [2^(b-1), 2^b) microseconds, the last one
+ * everything longer */
+#define NB_LATENCY_BUCKETS   28
+
+/* seconds of throughput kept, and averaged for the ETA */
+#define HISTORY_SIZE         60
+#define RATE_WINDOW          10
+
+typedef struct HostStats {
+    unsigned nb_transfers;
+    unsigned long redirects;
+    curl_off_t sum[NB_TIMINGS];
+    curl_off_t max[NB_TIMINGS];
+    unsigned buckets[NB_TIMINGS][NB_LATENCY_BUCKETS];
+} HostStats;
+
+typedef struct HostEntry {
+    char *name;
+    long port;
+    int state;
+    time_t resolve_time;
+    struct curl_slist *resolve;
+    struct curl_slist *stale;
+    int users;
+    struct HostEntry *prefetch_next;
+    HostStats *stats;
+    struct HostEntry *next;
+} HostEntry;
+
+typedef struct Uplink {
+    char *name;
+    int running;
+    curl_off_t bytes;
+    curl_off_t rate;
+} Uplink;
+
+/* Strings are carved from chunks and only freed all at once, with the
+ * item or at exit for the shared ones. */
+typedef struct StringChunk {
+    struct StringChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} StringChunk;
+
+/* Fixed size objects are handed out from slabs and recycled through a
+ * free list linked in the objects themselves. */
+typedef struct Pool {
+    size_t size;
+    void *free;
+    void *slabs;
+} Pool;
+
+/* per second throughput, oldest sample at pos once full */
+typedef struct History {
+    curl_off_t rate[HISTORY_SIZE];
+    unsigned pos;
+    unsigned nb;
+} History;
+
+/* fields read for every item on each frame and written by the transfer
+ * threads, kept apart from the rest so a scan over them stays in cache */
+typedef struct ItemHot {
+    int mode;
+    long int speed;
+    long eta;
+    double progress;
+    curl_off_t done;
+    curl_off_t total_size;
+    long int downloaded;
+} ItemHot;
+
+/* what a pre-flight HEAD request found out before an item started */
+typedef struct Probe {
+    curl_off_t size;
+    int ranges;
+    int changed;
+    char *etag;
+    char *last_modified;
+    char *location;
+} Probe;
 
 typedef struct DownloadItem {
-    int mode;
+    unsigned id;
+    ItemHot *hot;
+    unsigned slot;
+    unsigned order;
+    int overwrite;
+    StringChunk *strings;
     char *url;
     char *escape_url;
     char *effective_url;
@@ -24,29 +136,290 @@ typedef struct DownloadItem {
     curl_off_t download_size;
     FILE *outputfile;
     char *outputfilename;
+    int stream;
+    int decode;
+    int decode_owned;
+    struct Decoder *decoder;
+    int map_state;
+    char *map;
+    size_t map_len;
+    curl_off_t map_start;
+    curl_off_t map_pos;
+    curl_off_t map_synced;
+    curl_off_t map_size;
+    curl_off_t write_pos;
+    int pending_writes;
+    int write_error;
+    int write_paused;
+    struct DownloadItem *paused_next;
+    struct Shard *shard;
+    int queued;
+    int in_multi;
+    int detaching;
+    struct DownloadItem *detach_next;
+    struct DownloadItem *queue_next;
+    struct DownloadItem *queue_prev;
     char *contenttype;
-    double progress;
+    char *referer;
+    char *etag;
+    char *last_modified;
+    int validate;
+    struct curl_slist *validators;
+    struct Delta *delta;
+    int no_delta;
+    History *history;
+    int sampling;
+    struct DownloadItem *sample_prev;
+    struct DownloadItem *sample_next;
+    curl_off_t sampled;
+    int sort_dirty;
+    struct DownloadItem *sort_next;
+    int probe_state;
+    Probe *probe;
+    struct DownloadItem *probe_next;
+    int probe_queued;
+    struct DownloadItem *probe_qprev;
+    struct DownloadItem *probe_qnext;
+    time_t saved_time;
     double uprogress;
-    long int speed;
-    long eta;
     curl_off_t max_speed;
-    long int downloaded;
+    int priority;
+    long http_version;
+    curl_off_t conn_id;
+    curl_off_t timing[NB_TIMINGS];
+    long redirects;
     long int start_time;
     long int end_time;
     CURL *handle;
+    HostEntry *host;
+    int prefetched;
+    int uplink;
+    int listing;
+    char *pattern;
+    char *link_buf;
+    size_t link_len;
+    unsigned nb_entries;
+    unsigned search_seq;
+    struct DownloadItem *url_next;
     struct DownloadItem *next;
     struct DownloadItem *prev;
 } DownloadItem;
 
+#define HOT_CHUNK_BITS 12
+#define HOT_CHUNK_SIZE (1 << HOT_CHUNK_BITS)
+#define NO_SLOT UINT_MAX
+
+/* node of the order statistic treap of a sorted view, indexed by slot,
+ * with the value it is sorted by when it was placed */
+typedef struct SortNode {
+    unsigned left;
+    unsigned right;
+    unsigned parent;
+    unsigned size;
+    unsigned priority;
+    int in_tree;
+    double key;
+} SortNode;
+
+/* hot records never move once handed out, transfer threads keep writing
+ * through item->hot while the table grows */
+typedef struct HotChunk {
+    ItemHot hot[HOT_CHUNK_SIZE];
+    DownloadItem *item[HOT_CHUNK_SIZE];
+} HotChunk;
+
+typedef struct SearchEntry {
+    uint32_t trigram;
+    unsigned nb;
+    unsigned size;
+    unsigned *seqs;
+    struct SearchEntry *next;
+} SearchEntry;
+
+/* A delta update: the block sums of the new file come from its zsync
+ * control file, blocks found in the old copy are copied into a new file
+ * next to it and only the rest is fetched with multi-range requests. */
+typedef struct Delta {
+    int state;
+    int stop;
+    int error;
+    char *control;
+    size_t control_len;
+    curl_off_t length;
+    unsigned block_size;
+    unsigned nb_blocks;
+    int seq_matches;
+    int rsum_bytes;
+    int checksum_bytes;
+    const unsigned char *sums;
+    unsigned char sha1[20];
+    int has_sha1;
+    uint32_t *rsums;
+    unsigned *heads;
+    unsigned *chain;
+    unsigned char *filter;
+    int table_bits;
+    int filter_bits;
+    unsigned char *found;
+    curl_off_t *ranges;
+    unsigned nb_ranges;
+    unsigned next_range;
+    curl_off_t found_bytes;
+    curl_off_t fetched;
+    char *tmpname;
+    int fd;
+    long rcode;
+    int full;
+    int multipart;
+    int in_part;
+    int part_seen;
+    curl_off_t part_pos;
+    curl_off_t part_end;
+    char line[256];
+    size_t line_len;
+    struct Shard *shard;
+    pthread_t thread;
+    int thread_started;
+    struct DownloadItem *ready_next;
+} Delta;
+
+typedef struct Decoder {
+    int format;
+    z_stream z;
+    ZSTD_DStream *zstd;
+    lzma_stream lzma;
+    int fd;
+    char *name;
+    unsigned char *out;
+    curl_off_t size;
+    unsigned long crc;
+    int error;
+    int ended;
+    curl_off_t catch_up;
+} Decoder;
+
+typedef struct DeltaMatch {
+    unsigned block;
+    curl_off_t pos;
+} DeltaMatch;
+
+typedef struct DeltaScan {
+    Delta *delta;
+    int fd;
+    curl_off_t start;
+    curl_off_t end;
+    DeltaMatch *matches;
+    size_t nb_matches;
+    size_t size_matches;
+    int error;
+    pthread_t thread;
+} DeltaScan;
+
+typedef struct Sha1 {
+    uint32_t h[5];
+    uint64_t len;
+    unsigned char buf[64];
+    size_t n;
+} Sha1;
+
+typedef struct ListedUrl {
+    char *url;
+    char *referer;
+    curl_off_t speed;
+    int priority;
+    int manifest;
+    struct ListedUrl *next;
+} ListedUrl;
+
+/* a manifest file, or directory of them, given with -N; while missing
+ * it is waited for in the directory it is in */
+typedef struct Watch {
+    const char *path;
+    const char *name;
+    int wd;
+    int parent_wd;
+    int dir;
+    off_t offset;
+} Watch;
+
 typedef struct SockInfo {
     curl_socket_t sockfd;
     CURL *easy;
-    struct event *ev;
+    struct event ev;
     long timeout;
     int action;
     int evset;
 } SockInfo;
 
+typedef struct Shard {
+    CURLM *multi;
+    struct event_base *base;
+    struct event *timer;
+    struct event *wake;
+    int pipe[2];
+    pthread_t thread;
+    int started;
+    int stop;
+    int still_running;
+    int running;
+    int nb_queued;
+    unsigned long nb_stolen;
+    DownloadItem *queue;
+    DownloadItem *queue_tail;
+    DownloadItem *write_paused;
+    DownloadItem *delta_ready;
+    DownloadItem *detach_queue;
+    int left;
+    curl_off_t *uplink_bytes;
+    curl_off_t *uplink_seen;
+    int write_wakeup;
+    int steal_wakeup;
+    SockInfo **sock_table;
+    Pool sock_pool;
+    int sock_table_size;
+    int nb_socks;
+    unsigned long sock_updates;
+    unsigned long sock_updates_avoided;
+    int nb_socks_seen;
+    unsigned long sock_updates_seen;
+    unsigned long sock_updates_avoided_seen;
+} Shard;
+
+typedef struct TraceEvent {
+    uint64_t time;
+    uint64_t duration;
+    int64_t arg;
+    uint32_t id;
+    uint16_t type;
+    uint16_t thread;
+} TraceEvent;
+
+typedef struct TraceRing {
+    pthread_mutex_t lock;
+    unsigned head;
+    unsigned tail;
+    unsigned long dropped;
+    unsigned long reported;
+    unsigned samples;
+    uint16_t thread;
+    TraceEvent events[];
+} TraceRing;
+
+typedef struct WriteBuffer {
+    DownloadItem *item;
+    curl_off_t offset;
+    size_t len;
+    struct WriteBuffer *next;
+    char data[];
+} WriteBuffer;
+
+typedef struct Writer {
+    pthread_t thread;
+    pthread_cond_t cond;
+    WriteBuffer *head;
+    WriteBuffer *tail;
+} Writer;
+
 #define MODE_ALL         0
 #define MODE_INACTIVE    1
 #define MODE_PAUSED      2
@@ -56,6 +429,15 @@ typedef struct SockInfo {
 
 int current_mode = MODE_ALL;
 
+#define SORT_NONE        0
+#define SORT_SPEED       1
+#define SORT_ETA         2
+#define SORT_PROGRESS    3
+#define SORT_SIZE        4
+#define SORT_HOST        5
+#define SORT_NAME        6
+#define NB_SORTS         7
+
 #define ENTERING_URL     1
 #define ENTERING_REFERER 2
 #define ENTERING_SEARCH  3
@@ -69,25 +451,225 @@ int current_mode = MODE_ALL;
 #define PARAM_MAXHCONN   7
 #define PARAM_AUTOSTART  8
 #define PARAM_AUTOEXIT   9
+#define PARAM_PREFETCH   10
+#define PARAM_HTTPVER    11
+#define PARAM_MAXSTREAMS 12
+#define PARAM_PRIORITY   13
+#define PARAM_SESSION    14
+#define PARAM_MAPOUTPUT  15
+#define PARAM_WRITERS    16
+#define PARAM_MAXFPS     17
+#define PARAM_SHARDS     18
+#define PARAM_BALANCE    19
+#define PARAM_LATENCY    20
+#define PARAM_TRACE      21
+#define PARAM_DELTA      22
+#define PARAM_DECODE     23
+#define PARAM_INTERFACES 24
+#define PARAM_WATCH      25
+#define PARAM_PREFLIGHT  26
+#define PARAM_HEADLESS   27
+
+#define HOST_UNRESOLVED  0
+#define HOST_RESOLVING   1
+#define HOST_RESOLVED    2
+#define HOST_FAILED      3
+#define HOST_NUMERIC     4
+#define HOST_QUEUED      5
+
+#define DNS_PREFETCH_TTL 60
+
+#define MIN_PRIORITY     1
+#define DEFAULT_PRIORITY 16
+#define MAX_PRIORITY     256
+
+#define SESSION_MAGIC    "NCDMSES1"
+#define SESSION_ITEM     1
+#define SESSION_PROGRESS 2
+#define SESSION_DELETE   3
+#define SESSION_HEADER   9
+
+#define LISTING_NONE     0
+#define LISTING_FTP      1
+#define LISTING_INDEX    2
+
+#define MAX_LINK_LEN     4096
+
+#define VALIDATE_NONE    0
+#define VALIDATE_FULL    1
+#define VALIDATE_RANGE   2
+
+#define PROBE_NONE       0
+#define PROBE_RUNNING    1
+#define PROBE_DONE       2
+
+#define DELTA_CONTROL    1
+#define DELTA_SCAN       2
+#define DELTA_FETCH      3
+#define DELTA_VERIFY     4
+#define DELTA_DONE       5
+
+#define DELTA_MAX_CONTROL (256 << 20)
+#define DELTA_MAX_RANGES  32
+#define DELTA_READ_SIZE   (4 << 20)
+#define MAX_DELTA_THREADS 16
+
+#define STREAM_NONE      0
+#define STREAM_STDOUT    1
+#define STREAM_PIPE      2
+
+#define DECODE_NONE      0
+#define DECODE_GZIP      1
+#define DECODE_ZSTD      2
+#define DECODE_XZ        3
+
+#define DECODE_BUFFER_SIZE (256 * 1024)
+
+#define MAPPING_UNKNOWN  0
+#define MAPPING_ACTIVE   1
+#define MAPPING_FAILED   2
+
+#define MAP_WINDOW       (64 << 20)
+#define MAP_SYNC_SIZE    (8 << 20)
+
+#define WRITE_BUFFER_SIZE (64 * 1024)
+#define NB_WRITE_BUFFERS  256
+#define MAX_ITEM_BUFFERS  64
+#define MAX_WRITERS       16
+
+#define MAX_SHARDS        64
+
+#define MAX_UPLINKS       32
+
+#define MAX_WATCHES       32
+#define WATCH_EVENTS      (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF)
+
+#define ITEM_STRING_SIZE  128
+#define HOST_STRING_SIZE  4096
+#define POOL_SLAB_SIZE    (64 * 1024)
+
+#define TRACE_MAGIC        "NCDMTRC1"
+#define TRACE_RING_SIZE    (1 << 15)
+#define TRACE_FLUSH_MS     100
+#define TRACE_WRITE_SAMPLE 64
+#define MAX_TRACE_THREADS  128
+
+#define TRACE_THREAD       1
+#define TRACE_ADD          2
+#define TRACE_START        3
+#define TRACE_REMOVE       4
+#define TRACE_STATE        5
+#define TRACE_SOCKET       6
+#define TRACE_SOCKET_EVENT 7
+#define TRACE_TIMER        8
+#define TRACE_WRITE        9
+#define TRACE_DISK_WRITE   10
+#define TRACE_FRAME        11
+#define TRACE_DROPPED      12
+
+#define TRACE_MAIN_THREAD     0
+#define TRACE_UI_THREAD       1
+#define TRACE_TRANSFER_THREAD 2
+#define TRACE_WRITER_THREAD   3
 
 #define MAX_STRING_LEN 16384
+#define NB_HOST_BUCKETS 1024
+#define NB_SEARCH_BUCKETS 65536
 
 char *last_search = NULL;
 char *string = NULL;
-CURLM *mhandle = NULL;
-struct event_base *eventbase = NULL;
-struct event *timerevent = NULL;
+Shard *shards = NULL;
+int nb_shards = 1;
+int balance_load = 0;
+int shard_capacity = 0;
+int running_shards = 0;
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t shard_stopped = PTHREAD_COND_INITIALIZER;
+pthread_cond_t items_detached = PTHREAD_COND_INITIALIZER;
+struct evdns_base *dnsbase = NULL;
+HostEntry *hosts[NB_HOST_BUCKETS] = { NULL };
+HostEntry *prefetch_queue = NULL;
+HostEntry *prefetch_tail = NULL;
+int nb_resolving = 0;
+DownloadItem **url_table = NULL;
+unsigned url_table_size = 0;
+unsigned nb_urls = 0;
+SearchEntry *search_table[NB_SEARCH_BUCKETS] = { NULL };
+DownloadItem **search_items = NULL;
+unsigned search_items_size = 0;
+unsigned nb_search_seqs = 0;
+unsigned nb_search_stale = 0;
+DownloadItem *search_origin = NULL;
+/* the one item written to standard output, more would interleave */
+DownloadItem *stdout_item = NULL;
+int search_found = 1;
+unsigned next_item_id = 1;
+ListedUrl *listed_urls = NULL;
+ListedUrl *listed_tail = NULL;
+unsigned nb_listed = 0;
+pthread_mutex_t listing_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int session_fd = -1;
+int session_stop = 0;
+int session_failed = 0;
+char *session_buf = NULL;
+char *session_spare = NULL;
+size_t session_len = 0;
+size_t session_size = 0;
+size_t session_spare_size = 0;
+pthread_t session_thread;
+pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t session_cond = PTHREAD_COND_INITIALIZER;
+
+Writer writers[MAX_WRITERS];
+int nb_writers = 1;
+int writers_started = 0;
+int write_stop = 0;
+char *write_pool = NULL;
+WriteBuffer *free_buffers = NULL;
+unsigned nb_free_buffers = 0;
+pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t write_done = PTHREAD_COND_INITIALIZER;
 
 DownloadItem *items = NULL;
 DownloadItem *items_tail = NULL;
 DownloadItem *sitem[NB_MODES] = { NULL };
 
+Pool item_pool = { 0 };
+Pool history_pool = { 0 };
+History session_history;
+/* the items started since the last sample, kept by the list owner */
+DownloadItem *sampled_items = NULL;
+time_t history_time = 0;
+curl_off_t session_window = 0;
+curl_off_t session_rate = 0;
+long session_eta = -1;
+StringChunk *host_strings = NULL;
+
+HotChunk **hot_chunks = NULL;
+unsigned nb_hot_chunks = 0;
+unsigned nb_slots = 0;
+unsigned *free_slots = NULL;
+unsigned nb_free_slots = 0;
+unsigned *item_order = NULL;
+unsigned nb_order = 0;
+unsigned order_size = 0;
+unsigned nb_order_stale = 0;
+
+int sort_key = SORT_NONE;
+int sort_reverse = 0;
+SortNode *sort_nodes = NULL;
+unsigned sort_nodes_size = 0;
+unsigned sort_root = NO_SLOT;
+unsigned sort_seed = 2463534242u;
+DownloadItem *sort_dirty = NULL;
+unsigned view_offset = 0;
+
 long int start_time = INT_MIN;
 int nb_ditems = 0;
 int nb_logs = 0;
 int string_pos = 0;
 int current_page = 0;
-int still_running = 0;
 int help_active = 0;
 int info_active = 0;
 int log_active  = 0;
@@ -98,9 +680,53 @@ int active_downloads = 0;
 int finished_downloads = 0;
 int auto_start = 0;
 int auto_exit = 0;
+int headless = 0;
+int dns_prefetch = 8;
+long http_version = CURL_HTTP_VERSION_NONE;
+long max_streams = 0;
+int map_output = 0;
+int delta_mode = 0;
+Uplink uplinks[MAX_UPLINKS];
+int nb_uplinks = 0;
+time_t uplink_time = 0;
+Watch watches[MAX_WATCHES];
+int nb_watches = 0;
+/* the ones watched or waited for, which keep auto exit waiting */
+int running_watches = 0;
+int watch_fd = -1;
+struct event *watch_event = NULL;
+int preflight = 0;
+int nb_probing = 0;
+DownloadItem *probed_items = NULL;
+DownloadItem *probe_queue = NULL;
+DownloadItem *probe_queue_tail = NULL;
+int max_fps = 10;
+const char *latency_filename = NULL;
 
 pthread_t curses_thread;
-pthread_t curl_thread;
+int curses_started = 0;
+
+int ui_pipe[2] = { -1, -1 };
+int ui_pending = 0;
+int ui_dirty = 0;
+struct timespec last_frame;
+pthread_mutex_t ui_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t finish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *trace_filename = NULL;
+FILE *trace_file = NULL;
+TraceRing *trace_rings[MAX_TRACE_THREADS];
+int nb_trace_rings = 0;
+int trace_stop = 0;
+pthread_t trace_thread;
+pthread_key_t trace_key;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+
+SCREEN *screen = NULL;
+FILE *nullout = NULL;
+FILE *nullin = NULL;
 
 WINDOW *downloads = NULL;
 WINDOW *helpwin   = NULL;
@@ -124,11 +750,191 @@ static char *clonestring(const char *string, size_t string_len)
     return clone;
 }
 
+static char *chunk_alloc(StringChunk **chunks, size_t size, size_t chunk_size)
+{
+    StringChunk *chunk = *chunks;
+    char *data;
+
+    if (!chunk || chunk->size - chunk->used < size) {
+        chunk = malloc(sizeof(*chunk) + MAX(chunk_size, size));
+        if (!chunk)
+            return NULL;
+        chunk->size = MAX(chunk_size, size);
+        chunk->used = 0;
+        chunk->next = *chunks;
+        *chunks = chunk;
+    }
+
+    data = chunk->data + chunk->used;
+    chunk->used += size;
+
+    return data;
+}
+
+static char *chunk_string(StringChunk **chunks, const char *string, size_t string_len, size_t chunk_size)
+{
+    char *clone = chunk_alloc(chunks, string_len + 1, chunk_size);
+
+    if (clone) {
+        memcpy(clone, string, string_len);
+        clone[string_len] = '\0';
+    }
+
+    return clone;
+}
+
+static void free_chunks(StringChunk **chunks)
+{
+    while (*chunks) {
+        StringChunk *next = (*chunks)->next;
+
+        free(*chunks);
+        *chunks = next;
+    }
+}
+
+/* An item's strings live as long as the item. The URL comes first, and
+ * the escaped URL and output name that follow usually fit in one and a
+ * half times its length, so the first chunk is sized to hold them all. */
+static char *item_alloc(DownloadItem *item, size_t size)
+{
+    return chunk_alloc(&item->strings, size, MAX(ITEM_STRING_SIZE, 5 * size / 2));
+}
+
+static char *item_string(DownloadItem *item, const char *string, size_t string_len)
+{
+    return chunk_string(&item->strings, string, string_len, MAX(ITEM_STRING_SIZE, 5 * string_len / 2));
+}
+
+static int is_hex_escape(const char *s)
+{
+    return s[0] == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2]);
+}
+
+static int has_escapes(const char *s)
+{
+    for (; *s; s++) {
+        if (is_hex_escape(s))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* decodes %XX escapes in place, as curl_easy_unescape would */
+static char *unescape_string(char *s)
+{
+    char *out = s;
+
+    for (const char *in = s; *in; out++) {
+        if (is_hex_escape(in)) {
+            char hex[3] = { in[1], in[2], '\0' };
+
+            *out = strtol(hex, NULL, 16);
+            in += 3;
+        } else {
+            *out = *in++;
+        }
+    }
+    *out = '\0';
+
+    return s;
+}
+
+/* the last path component of a URL, where an escaped slash also ends
+ * a component once unescaped */
+static const char *last_component(const char *url)
+{
+    const char *s = url + strlen(url);
+
+    while (s > url && s[-1] != '/' &&
+           !(s - url >= 3 && s[-3] == '%' && s[-2] == '2' && (s[-1] == 'f' || s[-1] == 'F')))
+        s--;
+
+    return s;
+}
+
+static void init_pool(Pool *pool, size_t size)
+{
+    /* keep every object aligned like malloc would */
+    pool->size = (MAX(size, sizeof(void *)) + 15) & ~(size_t)15;
+    pool->free = pool->slabs = NULL;
+}
+
+static void *pool_alloc(Pool *pool)
+{
+    void *object;
+
+    if (!pool->free) {
+        char *slab = malloc(POOL_SLAB_SIZE);
+        size_t pos;
+
+        if (!slab)
+            return NULL;
+        /* the first object of a slab links the slabs */
+        *(void **)slab = pool->slabs;
+        pool->slabs = slab;
+        for (pos = (POOL_SLAB_SIZE / pool->size - 1) * pool->size; pos >= pool->size; pos -= pool->size) {
+            *(void **)(slab + pos) = pool->free;
+            pool->free = slab + pos;
+        }
+    }
+
+    object = pool->free;
+    pool->free = *(void **)object;
+    memset(object, 0, pool->size);
+
+    return object;
+}
+
+static void pool_free(Pool *pool, void *object)
+{
+    if (!object)
+        return;
+    *(void **)object = pool->free;
+    pool->free = object;
+}
+
+static void free_pool(Pool *pool)
+{
+    while (pool->slabs) {
+        void *next = *(void **)pool->slabs;
+
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->free = NULL;
+}
+
+/* The curl thread wakes the curses thread through ui_pipe when something
+ * visible changed, at most one pending byte at a time. */
+static void wakeup_ui()
+{
+    int wake;
+
+    pthread_mutex_lock(&ui_lock);
+    wake = ui_pipe[1] >= 0 && !ui_pending;
+    ui_pending = 1;
+    pthread_mutex_unlock(&ui_lock);
+
+    if (wake && write(ui_pipe[1], "", 1) < 0)
+        ui_pending = 0;
+}
+
+/* new work for a shard is picked up by its wakeup_cb() */
+static void wake_shard(Shard *shard)
+{
+    ssize_t n = shard->pipe[1] >= 0 ? write(shard->pipe[1], "", 1) : 0;
+
+    (void)n;
+}
+
 static void write_log(int color, const char *fmt, ...)
 {
     int y, y0, x;
     va_list vl;
 
+    pthread_mutex_lock(&log_lock);
     getyx(logwin, y0, x);
     wattrset(logwin, color);
 
@@ -139,6 +945,14 @@ static void write_log(int color, const char *fmt, ...)
     getyx(logwin, y, x);
     nb_logs += y - y0;
     (void)x;
+    pthread_mutex_unlock(&log_lock);
+    wakeup_ui();
+
+    if (headless) {
+        va_start(vl, fmt);
+        vfprintf(stderr, fmt, vl);
+        va_end(vl);
+    }
 }
 
 static void check_erc(const char *where, CURLcode code)
@@ -156,46 +970,3507 @@ static void check_mrc(const char *where, CURLMcode code)
     write_log(COLOR_PAIR(1), "%s returns %s\n", where, curl_multi_strerror(code));
 }
 
-static DownloadItem* delete_ditem(DownloadItem *ditem)
+/* With -t every thread records events into its own ring, which do_trace()
+ * appends to the trace file every TRACE_FLUSH_MS. A full ring drops new
+ * events and counts them instead of blocking. Spans are recorded once at
+ * their end, with the start time given by trace_now(). */
+static uint64_t trace_now()
 {
-    for (int i = 0; i < NB_MODES; i++) {
-        if (ditem == sitem[i]) {
-            sitem[i] = NULL;
-            nb_ditems--;
+    struct timespec ts;
+
+    if (!trace_file)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void trace_event(int type, unsigned id, int64_t arg, uint64_t start)
+{
+    TraceRing *ring = trace_file ? pthread_getspecific(trace_key) : NULL;
+    uint64_t now;
+    TraceEvent *ev;
+
+    if (!ring)
+        return;
+
+    now = trace_now();
+    pthread_mutex_lock(&ring->lock);
+    if (ring->head - ring->tail >= TRACE_RING_SIZE) {
+        ring->dropped++;
+        pthread_mutex_unlock(&ring->lock);
+        return;
+    }
+    ev = &ring->events[ring->head % TRACE_RING_SIZE];
+    ev->time = start ? start : now;
+    ev->duration = start ? now - start : 0;
+    ev->arg = arg;
+    ev->id = id;
+    ev->type = type;
+    ev->thread = ring->thread;
+    ring->head++;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* high rate events are only recorded once every TRACE_WRITE_SAMPLE */
+static int trace_sampled()
+{
+    TraceRing *ring = trace_file ? pthread_getspecific(trace_key) : NULL;
+
+    return ring && !(ring->samples++ % TRACE_WRITE_SAMPLE);
+}
+
+static void trace_register(int kind, int index)
+{
+    TraceRing *ring;
+
+    if (!trace_file)
+        return;
+
+    ring = calloc(1, sizeof(*ring) + TRACE_RING_SIZE * sizeof(TraceEvent));
+    if (!ring)
+        return;
+    pthread_mutex_init(&ring->lock, NULL);
+
+    pthread_mutex_lock(&trace_lock);
+    if (nb_trace_rings >= MAX_TRACE_THREADS) {
+        pthread_mutex_unlock(&trace_lock);
+        free(ring);
+        return;
+    }
+    ring->thread = nb_trace_rings;
+    trace_rings[nb_trace_rings++] = ring;
+    pthread_mutex_unlock(&trace_lock);
+
+    pthread_setspecific(trace_key, ring);
+    trace_event(TRACE_THREAD, index, kind, 0);
+}
+
+static void trace_flush()
+{
+    int nb;
+
+    pthread_mutex_lock(&trace_lock);
+    nb = nb_trace_rings;
+    pthread_mutex_unlock(&trace_lock);
+
+    for (int i = 0; i < nb; i++) {
+        TraceRing *ring = trace_rings[i];
+        unsigned head, tail, start, len;
+        unsigned long dropped;
+
+        pthread_mutex_lock(&ring->lock);
+        head = ring->head;
+        tail = ring->tail;
+        dropped = ring->dropped;
+        pthread_mutex_unlock(&ring->lock);
+
+        /* the owner only writes past head, so this needs no lock */
+        while (tail != head) {
+            start = tail % TRACE_RING_SIZE;
+            len = MIN(head - tail, TRACE_RING_SIZE - start);
+            fwrite(ring->events + start, sizeof(TraceEvent), len, trace_file);
+            tail += len;
+        }
+
+        if (dropped != ring->reported) {
+            TraceEvent ev = { trace_now(), 0, dropped, 0, TRACE_DROPPED, ring->thread };
+
+            fwrite(&ev, sizeof(ev), 1, trace_file);
+            ring->reported = dropped;
         }
+
+        pthread_mutex_lock(&ring->lock);
+        ring->tail = head;
+        pthread_mutex_unlock(&ring->lock);
     }
+    fflush(trace_file);
+}
 
-    if (ditem->handle) {
-        if (ditem->mode == MODE_ACTIVE) {
-            CURLMcode rc;
+static void *do_trace(void *unused)
+{
+    (void)unused;
+
+    pthread_mutex_lock(&trace_lock);
+    while (!trace_stop) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += TRACE_FLUSH_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&trace_cond, &trace_lock, &ts);
+
+        pthread_mutex_unlock(&trace_lock);
+        trace_flush();
+        pthread_mutex_lock(&trace_lock);
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    return NULL;
+}
+
+static void trace_open()
+{
+    if (!trace_filename)
+        return;
+
+    trace_file = fopen(trace_filename, "wb");
+    if (!trace_file || pthread_key_create(&trace_key, NULL) ||
+        fwrite(TRACE_MAGIC, 1, 8, trace_file) != 8) {
+        write_log(COLOR_PAIR(1), "Failed to open trace file %s.\n", trace_filename);
+        if (trace_file)
+            fclose(trace_file);
+        trace_file = NULL;
+        return;
+    }
+
+    if (pthread_create(&trace_thread, NULL, do_trace, NULL)) {
+        write_log(COLOR_PAIR(1), "Failed to start trace writer.\n");
+        fclose(trace_file);
+        trace_file = NULL;
+        return;
+    }
+
+    trace_register(TRACE_MAIN_THREAD, 0);
+}
+
+static void trace_close()
+{
+    if (!trace_file)
+        return;
+
+    pthread_mutex_lock(&trace_lock);
+    trace_stop = 1;
+    pthread_cond_signal(&trace_cond);
+    pthread_mutex_unlock(&trace_lock);
+    pthread_join(trace_thread, NULL);
+
+    trace_flush();
+    fclose(trace_file);
+    trace_file = NULL;
+    for (int i = 0; i < nb_trace_rings; i++) {
+        pthread_mutex_destroy(&trace_rings[i]->lock);
+        free(trace_rings[i]);
+    }
+    nb_trace_rings = 0;
+}
+
+static unsigned string_hash(const char *string)
+{
+    unsigned hash = 2166136261u;
+
+    for (; *string; string++)
+        hash = (hash ^ (unsigned char)*string) * 16777619u;
+
+    return hash;
+}
+
+static unsigned host_hash(const char *name, long port)
+{
+    unsigned hash = (string_hash(name) ^ (unsigned)port) * 16777619u;
+
+    return hash % NB_HOST_BUCKETS;
+}
+
+static DownloadItem *find_url(const char *url)
+{
+    DownloadItem *item;
+
+    if (!url_table)
+        return NULL;
+
+    item = url_table[string_hash(url) & (url_table_size - 1)];
+    for (; item; item = item->url_next) {
+        if (!strcmp(item->url, url))
+            return item;
+    }
 
-            rc = curl_multi_remove_handle(mhandle, ditem->handle);
-            check_mrc("delete:", rc);
+    return NULL;
+}
+
+static int reserve_urls(unsigned nb)
+{
+    unsigned size = url_table_size ? url_table_size : 1024;
+    DownloadItem **table;
+
+    while (size < nb)
+        size *= 2;
+    if (size == url_table_size)
+        return 0;
+
+    table = calloc(size, sizeof(*table));
+    if (!table)
+        return 1;
+
+    for (unsigned i = 0; i < url_table_size; i++) {
+        DownloadItem *next;
+
+        for (DownloadItem *old = url_table[i]; old; old = next) {
+            unsigned hash = string_hash(old->url) & (size - 1);
+
+            next = old->url_next;
+            old->url_next = table[hash];
+            table[hash] = old;
         }
-        curl_easy_cleanup(ditem->handle);
+    }
+    free(url_table);
+    url_table = table;
+    url_table_size = size;
+
+    return 0;
+}
+
+static int insert_url(DownloadItem *item)
+{
+    unsigned hash;
+
+    if (nb_urls >= url_table_size && reserve_urls(nb_urls + 1))
+        return 1;
+
+    hash = string_hash(item->url) & (url_table_size - 1);
+    item->url_next = url_table[hash];
+    url_table[hash] = item;
+    nb_urls++;
+
+    return 0;
+}
+
+static void remove_url(DownloadItem *item)
+{
+    DownloadItem **p;
+
+    if (!url_table || !item->url)
+        return;
+
+    p = &url_table[string_hash(item->url) & (url_table_size - 1)];
+    for (; *p; p = &(*p)->url_next) {
+        if (*p == item) {
+            *p = item->url_next;
+            nb_urls--;
+            break;
+        }
+    }
+}
+
+/* The search index maps every trigram of an item's file name and URL,
+ * which includes its host, to a list of sequence numbers. Items get
+ * increasing numbers as they are appended to the list, so these lists
+ * are sorted in list order. A deleted item only clears its slot in
+ * search_items; the next search rebuilds the index once most slots are
+ * stale. */
+static SearchEntry *lookup_trigram(uint32_t trigram, int create)
+{
+    unsigned hash = (trigram * 2654435761u) >> 16;
+    SearchEntry *entry;
+
+    for (entry = search_table[hash]; entry; entry = entry->next) {
+        if (entry->trigram == trigram)
+            return entry;
+    }
+
+    if (!create || !(entry = calloc(1, sizeof(*entry))))
+        return NULL;
+    entry->trigram = trigram;
+    entry->next = search_table[hash];
+    search_table[hash] = entry;
+
+    return entry;
+}
+
+static uint32_t get_trigram(const char *s)
+{
+    return (unsigned char)s[0] << 16 | (unsigned char)s[1] << 8 | (unsigned char)s[2];
+}
+
+static void index_string(const char *s, unsigned seq)
+{
+    size_t len = s ? strlen(s) : 0;
+
+    for (size_t i = 0; i + 3 <= len; i++) {
+        SearchEntry *entry = lookup_trigram(get_trigram(s + i), 1);
+
+        if (!entry || (entry->nb && entry->seqs[entry->nb - 1] == seq))
+            continue;
+        if (entry->nb == entry->size) {
+            unsigned size = entry->size ? entry->size * 2 : 4;
+            unsigned *seqs = realloc(entry->seqs, size * sizeof(*seqs));
+
+            if (!seqs)
+                continue;
+            entry->seqs = seqs;
+            entry->size = size;
+        }
+        entry->seqs[entry->nb++] = seq;
+    }
+}
+
+static void index_item(DownloadItem *item)
+{
+    if (nb_search_seqs + 1 >= search_items_size) {
+        unsigned size = MAX(1024, search_items_size * 2);
+        DownloadItem **table = realloc(search_items, size * sizeof(*table));
+
+        if (!table)
+            return;
+        search_items = table;
+        search_items_size = size;
+    }
+
+    item->search_seq = ++nb_search_seqs;
+    search_items[item->search_seq] = item;
+    index_string(item->outputfilename, item->search_seq);
+    index_string(item->url, item->search_seq);
+}
+
+static void free_search_index()
+{
+    for (int i = 0; i < NB_SEARCH_BUCKETS; i++) {
+        SearchEntry *entry = search_table[i];
+
+        while (entry) {
+            SearchEntry *next = entry->next;
+
+            free(entry->seqs);
+            free(entry);
+            entry = next;
+        }
+        search_table[i] = NULL;
+    }
+    free(search_items);
+    search_items = NULL;
+    search_items_size = nb_search_seqs = nb_search_stale = 0;
+}
+
+static void build_search_index()
+{
+    free_search_index();
+    for (DownloadItem *item = items; item; item = item->next)
+        index_item(item);
+}
+
+static int item_matches(DownloadItem *item, const char *s)
+{
+    if (current_mode && item->hot->mode != current_mode)
+        return 0;
+
+    return (item->outputfilename && strstr(item->outputfilename, s)) ||
+           (item->url && strstr(item->url, s));
+}
+
+/* Returns the first item matching s at or after from, or at or before it
+ * going backward. Only candidates from the rarest trigram of s need to be
+ * checked, shorter strings fall back to walking the list. */
+static DownloadItem *search_from(const char *s, DownloadItem *from, int backward)
+{
+    SearchEntry *rarest = NULL;
+    size_t len = strlen(s);
+    unsigned lo, hi;
+
+    if (len < 3) {
+        for (; from; from = backward ? from->prev : from->next) {
+            if (item_matches(from, s))
+                return from;
+        }
+        return NULL;
+    }
+
+    if (!from)
+        return NULL;
+
+    if (nb_search_stale > 4096 && nb_search_stale > nb_search_seqs / 2)
+        build_search_index();
+
+    for (size_t i = 0; i + 3 <= len; i++) {
+        SearchEntry *entry = lookup_trigram(get_trigram(s + i), 0);
+
+        if (!entry)
+            return NULL;
+        if (!rarest || entry->nb < rarest->nb)
+            rarest = entry;
     }
 
-    if (ditem->url)
-        free(ditem->url);
+    lo = 0;
+    hi = rarest->nb;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
 
-    if (ditem->escape_url)
-        free(ditem->escape_url);
+        if (rarest->seqs[mid] < from->search_seq)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (!backward) {
+        for (; lo < rarest->nb; lo++) {
+            DownloadItem *item = search_items[rarest->seqs[lo]];
 
-    if (ditem->outputfile)
-        fclose(ditem->outputfile);
+            if (item && item_matches(item, s))
+                return item;
+        }
+    } else {
+        if (lo < rarest->nb && rarest->seqs[lo] == from->search_seq)
+            lo++;
+        while (lo-- > 0) {
+            DownloadItem *item = search_items[rarest->seqs[lo]];
 
-    if (ditem->outputfilename)
-        free(ditem->outputfilename);
+            if (item && item_matches(item, s))
+                return item;
+        }
+    }
+
+    return NULL;
+}
+
+static void unindex_item(DownloadItem *item)
+{
+    if (!item->search_seq)
+        return;
+
+    search_items[item->search_seq] = NULL;
+    item->search_seq = 0;
+    nb_search_stale++;
+}
+
+static HostEntry *lookup_host(const char *name, long port)
+{
+    unsigned hash = host_hash(name, port);
+    HostEntry *host;
+
+    for (host = hosts[hash]; host; host = host->next) {
+        if (host->port == port && !strcmp(host->name, name))
+            return host;
+    }
+
+    host = calloc(1, sizeof(*host));
+    if (!host)
+        return NULL;
+
+    host->name = chunk_string(&host_strings, name, strlen(name), HOST_STRING_SIZE);
+    if (!host->name) {
+        free(host);
+        return NULL;
+    }
+    host->port = port;
+
+    if (name[0] == '[' || evutil_inet_pton(AF_INET, name, &(struct in_addr){ 0 }) == 1)
+        host->state = HOST_NUMERIC;
+
+    host->next = hosts[hash];
+    hosts[hash] = host;
+
+    return host;
+}
+
+/* Takes host and port out of the plain URLs most lists are made of,
+ * without allocating. Anything else is left to libcurl. */
+static HostEntry *find_host(const char *url)
+{
+    static const struct { const char *scheme; long port; } schemes[] = {
+        { "http://", 80 }, { "https://", 443 }, { "ftp://", 21 }, { "ftps://", 990 },
+    };
+    const char *start = NULL, *end, *at, *p;
+    char name[256];
+    long port = 0;
+
+    for (size_t i = 0; i < sizeof(schemes) / sizeof(schemes[0]); i++) {
+        if (!strncasecmp(url, schemes[i].scheme, strlen(schemes[i].scheme))) {
+            start = url + strlen(schemes[i].scheme);
+            port = schemes[i].port;
+            break;
+        }
+    }
+    if (!start)
+        return NULL;
+
+    end = start + strcspn(start, "/?#");
+    at = memchr(start, '@', end - start);
+    if (at)
+        return NULL;
+
+    for (p = start; p < end && *p != ':'; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '-' && *p != '.')
+            return NULL;
+    }
+    if (p == start || p - start >= (long)sizeof(name))
+        return NULL;
+    if (p < end) {
+        char *digits_end;
+
+        port = strtol(p + 1, &digits_end, 10);
+        if (digits_end != end || p + 1 == end || port <= 0 || port > 65535)
+            return NULL;
+    }
+
+    memcpy(name, start, p - start);
+    name[p - start] = '\0';
+
+    return lookup_host(name, port);
+}
+
+static HostEntry *get_host(const char *url)
+{
+    HostEntry *host = find_host(url);
+    char *name = NULL, *port = NULL;
+    CURLU *u;
+
+    if (host)
+        return host;
+
+    u = curl_url();
+    if (!u)
+        return NULL;
+
+    if (!curl_url_set(u, CURLUPART_URL, url, CURLU_GUESS_SCHEME | CURLU_NON_SUPPORT_SCHEME) &&
+        !curl_url_get(u, CURLUPART_HOST, &name, 0) &&
+        !curl_url_get(u, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT))
+        host = lookup_host(name, atol(port));
+
+    curl_free(name);
+    curl_free(port);
+    curl_url_cleanup(u);
+
+    return host;
+}
+
+static void free_hosts()
+{
+    for (int i = 0; i < NB_HOST_BUCKETS; i++) {
+        HostEntry *host = hosts[i];
+
+        while (host) {
+            HostEntry *next = host->next;
+
+            curl_slist_free_all(host->resolve);
+            curl_slist_free_all(host->stale);
+            free(host->stats);
+            free(host);
+            host = next;
+        }
+        hosts[i] = NULL;
+    }
+    free_chunks(&host_strings);
+}
+
+static void free_socks(Shard *shard)
+{
+    for (int i = 0; i < shard->sock_table_size; i++) {
+        if (shard->sock_table[i] && shard->sock_table[i]->evset)
+            event_del(&shard->sock_table[i]->ev);
+    }
+    free_pool(&shard->sock_pool);
+    free(shard->sock_table);
+    shard->sock_table = NULL;
+    shard->sock_table_size = shard->nb_socks = 0;
+}
+
+static void dns_cb(int result, struct evutil_addrinfo *res, void *arg)
+{
+    HostEntry *host = arg;
+    struct evutil_addrinfo *ai;
+    struct curl_slist *resolve;
+    char entry[MAX_STRING_LEN];
+    int pos, nb_addrs = 0, more;
+
+    if (result) {
+        pthread_mutex_lock(&queue_lock);
+        host->state = HOST_FAILED;
+        nb_resolving--;
+        more = prefetch_queue != NULL;
+        pthread_mutex_unlock(&queue_lock);
+        write_log(COLOR_PAIR(1), "DNS prefetch of %s failed: %s\n", host->name, evutil_gai_strerror(result));
+        if (more)
+            wake_shard(&shards[0]);
+        return;
+    }
+
+#if LIBCURL_VERSION_NUM >= 0x074b00
+    pos = snprintf(entry, sizeof(entry), "+%s:%ld:", host->name, host->port);
+#else
+    pos = snprintf(entry, sizeof(entry), "%s:%ld:", host->name, host->port);
+#endif
+    for (ai = res; ai; ai = ai->ai_next) {
+        char addr[64];
+        const void *src;
+
+        if (ai->ai_family == AF_INET)
+            src = &((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+        else if (ai->ai_family == AF_INET6)
+            src = &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr;
+        else
+            continue;
+
+        if (!evutil_inet_ntop(ai->ai_family, src, addr, sizeof(addr)) ||
+            pos + strlen(addr) + 4 >= sizeof(entry))
+            continue;
+
+        pos += snprintf(entry + pos, sizeof(entry) - pos, ai->ai_family == AF_INET6 ? "%s[%s]" : "%s%s",
+                        nb_addrs++ ? "," : "", addr);
+    }
+    evutil_freeaddrinfo(res);
+
+    resolve = nb_addrs ? curl_slist_append(NULL, entry) : NULL;
+
+    pthread_mutex_lock(&queue_lock);
+    nb_resolving--;
+    if (!resolve) {
+        host->state = HOST_FAILED;
+    } else {
+        /* handles started earlier may still point at the previous list,
+         * it goes once none of them is left */
+        if (host->resolve && host->users) {
+            host->resolve->next = host->stale;
+            host->stale = host->resolve;
+        } else {
+            curl_slist_free_all(host->resolve);
+        }
+        host->resolve = resolve;
+        host->resolve_time = time(NULL);
+        host->state = HOST_RESOLVED;
+    }
+    more = prefetch_queue != NULL;
+    pthread_mutex_unlock(&queue_lock);
+    /* for the next queued host */
+    if (more)
+        wake_shard(&shards[0]);
+}
+
+/* DNS prefetch: the thread owning the download list queues the hosts of
+ * items as they are added, and the hosts of started items whose address
+ * expired for those following them. The first shard owns the resolver and
+ * resolves up to dns_prefetch of them at once. The state, lists and users
+ * of hosts are guarded by queue_lock. */
+static void queue_prefetch(DownloadItem *item)
+{
+    HostEntry *host;
+
+    if (!dnsbase)
+        return;
+    if (!item->host)
+        item->host = get_host(item->url);
+    host = item->host;
+    if (!host)
+        return;
+
+    pthread_mutex_lock(&queue_lock);
+    if (host->state == HOST_RESOLVED && time(NULL) - host->resolve_time >= DNS_PREFETCH_TTL)
+        host->state = HOST_UNRESOLVED;
+    if (host->state != HOST_UNRESOLVED) {
+        pthread_mutex_unlock(&queue_lock);
+        return;
+    }
+    host->state = HOST_QUEUED;
+    host->prefetch_next = NULL;
+    if (prefetch_tail)
+        prefetch_tail->prefetch_next = host;
+    else
+        prefetch_queue = host;
+    prefetch_tail = host;
+    pthread_mutex_unlock(&queue_lock);
+
+    if (!pthread_equal(shards[0].thread, pthread_self()))
+        wake_shard(&shards[0]);
+}
+
+static void prefetch_dns()
+{
+    struct evutil_addrinfo hints = { 0 };
+
+    if (!dnsbase)
+        return;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
+
+    pthread_mutex_lock(&queue_lock);
+    while (prefetch_queue && nb_resolving < dns_prefetch) {
+        HostEntry *host = prefetch_queue;
+
+        prefetch_queue = host->prefetch_next;
+        if (!prefetch_queue)
+            prefetch_tail = NULL;
+        host->state = HOST_RESOLVING;
+        nb_resolving++;
+        /* the answer may come right away, dns_cb locks */
+        pthread_mutex_unlock(&queue_lock);
+        evdns_getaddrinfo(dnsbase, host->name, NULL, &hints, dns_cb, host);
+        pthread_mutex_lock(&queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/* called with queue_lock held, a started item stops using the lists of
+ * its host */
+static void release_prefetch(DownloadItem *item)
+{
+    HostEntry *host = item->host;
+
+    if (!item->prefetched)
+        return;
+    item->prefetched = 0;
+    if (!--host->users) {
+        curl_slist_free_all(host->stale);
+        host->stale = NULL;
+    }
+}
+
+/* hands the prefetched address of its host to an item being queued, or
+ * none, so its handle never keeps a list that may be freed; returns
+ * whether there was one */
+static int use_prefetch(DownloadItem *item)
+{
+    int fresh;
+
+    pthread_mutex_lock(&queue_lock);
+    fresh = item->host && item->host->state == HOST_RESOLVED &&
+            time(NULL) - item->host->resolve_time < DNS_PREFETCH_TTL;
+    if (fresh && !item->prefetched) {
+        item->host->users++;
+        item->prefetched = 1;
+    }
+    curl_easy_setopt(item->handle, CURLOPT_RESOLVE, fresh ? item->host->resolve : NULL);
+    pthread_mutex_unlock(&queue_lock);
+
+    return fresh;
+}
+
+static void get_timing(DownloadItem *item)
+{
+#if LIBCURL_VERSION_NUM >= 0x073d00
+    static const CURLINFO info[NB_TIMINGS] = {
+        CURLINFO_NAMELOOKUP_TIME_T, CURLINFO_CONNECT_TIME_T, CURLINFO_APPCONNECT_TIME_T,
+        CURLINFO_PRETRANSFER_TIME_T, CURLINFO_STARTTRANSFER_TIME_T, CURLINFO_TOTAL_TIME_T,
+    };
+
+    for (int i = 0; i < NB_TIMINGS; i++)
+        curl_easy_getinfo(item->handle, info[i], &item->timing[i]);
+#else
+    static const CURLINFO info[NB_TIMINGS] = {
+        CURLINFO_NAMELOOKUP_TIME, CURLINFO_CONNECT_TIME, CURLINFO_APPCONNECT_TIME,
+        CURLINFO_PRETRANSFER_TIME, CURLINFO_STARTTRANSFER_TIME, CURLINFO_TOTAL_TIME,
+    };
+
+    for (int i = 0; i < NB_TIMINGS; i++) {
+        double t = 0;
+
+        curl_easy_getinfo(item->handle, info[i], &t);
+        item->timing[i] = t * 1000000;
+    }
+#endif
+    curl_easy_getinfo(item->handle, CURLINFO_REDIRECT_COUNT, &item->redirects);
+}
+
+static char *clone_info(const char *string)
+{
+    return string ? clonestring(string, strlen(string)) : NULL;
+}
+
+/* Runs on the shard thread, at the end of the headers of each response
+ * and once the transfer is done. What the info window shows of the
+ * handle is read here and handed to the UI under ui_lock. */
+static void publish_info(DownloadItem *item)
+{
+    char *effective_url = NULL, *primary_ip = NULL, *contenttype = NULL, *protocol = NULL;
+    char *old[3];
+    curl_off_t contentlength = -1, conn_id = -1;
+    long rcode = 0, primary_port = 0, version = 0;
+
+    curl_easy_getinfo(item->handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+    curl_easy_getinfo(item->handle, CURLINFO_RESPONSE_CODE, &rcode);
+    curl_easy_getinfo(item->handle, CURLINFO_SCHEME, &protocol);
+    curl_easy_getinfo(item->handle, CURLINFO_CONTENT_TYPE, &contenttype);
+    curl_easy_getinfo(item->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &contentlength);
+    curl_easy_getinfo(item->handle, CURLINFO_PRIMARY_IP, &primary_ip);
+    curl_easy_getinfo(item->handle, CURLINFO_PRIMARY_PORT, &primary_port);
+    curl_easy_getinfo(item->handle, CURLINFO_HTTP_VERSION, &version);
+#if LIBCURL_VERSION_NUM >= 0x080200
+    curl_easy_getinfo(item->handle, CURLINFO_CONN_ID, &conn_id);
+#endif
+    effective_url = clone_info(effective_url);
+    contenttype = clone_info(contenttype);
+    primary_ip = clone_info(primary_ip);
+    get_timing(item);
+
+    /* the scheme is a static string of curl's, the others are copies */
+    pthread_mutex_lock(&ui_lock);
+    old[0] = item->effective_url;
+    old[1] = item->contenttype;
+    old[2] = item->primary_ip;
+    item->effective_url = effective_url;
+    item->contenttype = contenttype;
+    item->primary_ip = primary_ip;
+    item->protocol = protocol;
+    item->rcode = rcode;
+    item->contentlength = contentlength;
+    item->primary_port = primary_port;
+    item->http_version = version;
+    item->conn_id = conn_id;
+    pthread_mutex_unlock(&ui_lock);
+
+    for (int i = 0; i < 3; i++)
+        free(old[i]);
+}
+
+/* curl gives the time from the start to the end of each phase, a phase
+ * begins where the latest earlier one that happened ended */
+static curl_off_t phase_time(DownloadItem *item, int phase)
+{
+    curl_off_t start = 0;
+
+    if (phase == TIMING_TOTAL || !item->timing[phase])
+        return item->timing[phase];
+
+    for (int i = 0; i < phase; i++)
+        start = MAX(start, item->timing[i]);
+
+    return MAX(item->timing[phase] - start, 0);
+}
+
+static int latency_bucket(curl_off_t usec)
+{
+    int b = 0;
+
+    while (usec > 0 && b < NB_LATENCY_BUCKETS - 1) {
+        usec >>= 1;
+        b++;
+    }
+
+    return b;
+}
+
+/* called with queue_lock held, shards may finish items of one host */
+static void record_timing(DownloadItem *item)
+{
+    HostStats *stats;
+
+    if (!item->host)
+        return;
+    if (!item->host->stats)
+        item->host->stats = calloc(1, sizeof(HostStats));
+    stats = item->host->stats;
+    if (!stats)
+        return;
+
+    stats->nb_transfers++;
+    stats->redirects += item->redirects;
+    for (int i = 0; i < NB_TIMINGS; i++) {
+        curl_off_t t = phase_time(item, i);
+
+        stats->sum[i] += t;
+        stats->max[i] = MAX(stats->max[i], t);
+        stats->buckets[i][latency_bucket(t)]++;
+    }
+}
+
+/* one JSON line per host, all times in microseconds */
+static void write_latency()
+{
+    static const char *names[NB_TIMINGS] = {
+        "dns", "connect", "tls", "pretransfer", "first_byte", "total",
+    };
+    FILE *file;
+
+    if (!latency_filename)
+        return;
+
+    file = fopen(latency_filename, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to write latency histograms to %s.\n", latency_filename);
+        return;
+    }
+
+    for (int i = 0; i < NB_HOST_BUCKETS; i++) {
+        for (HostEntry *host = hosts[i]; host; host = host->next) {
+            HostStats *stats = host->stats;
+
+            if (!stats)
+                continue;
+
+            fprintf(file, "{\"host\":\"%s\",\"port\":%ld,\"transfers\":%u,\"redirects\":%lu",
+                    host->name, host->port, stats->nb_transfers, stats->redirects);
+            for (int t = 0; t < NB_TIMINGS; t++) {
+                fprintf(file, ",\"%s\":{\"sum_us\":%" CURL_FORMAT_CURL_OFF_T ",\"max_us\":%"
+                        CURL_FORMAT_CURL_OFF_T ",\"buckets\":[", names[t], stats->sum[t], stats->max[t]);
+                for (int b = 0; b < NB_LATENCY_BUCKETS; b++)
+                    fprintf(file, b ? ",%u" : "%u", stats->buckets[t][b]);
+                fprintf(file, "]}");
+            }
+            fprintf(file, "}\n");
+        }
+    }
+
+    fclose(file);
+}
+
+/* The session file is an append-only log of records:
+ *   u32 size, u8 type, u32 id, payload
+ * SESSION_ITEM carries the full item state, SESSION_PROGRESS only the
+ * fields changing while downloading. Records are collected in memory and
+ * written out by do_session() once a second. */
+static unsigned char *put_u16(unsigned char *p, uint16_t v)
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static unsigned char *put_u32(unsigned char *p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static unsigned char *put_i64(unsigned char *p, int64_t v)
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static unsigned char *put_string(unsigned char *p, const char *string)
+{
+    uint32_t len = string ? strlen(string) + 1 : 0;
+
+    p = put_u32(p, len);
+    if (len)
+        memcpy(p, string, len);
+
+    return p + len;
+}
+
+static size_t string_record_size(const char *string)
+{
+    return 4 + (string ? strlen(string) + 1 : 0);
+}
+
+/* called with session_lock held, nothing is kept once writing failed */
+static unsigned char *session_reserve(size_t size)
+{
+    unsigned char *p;
+
+    if (session_failed)
+        return NULL;
+    if (session_len + size > session_size) {
+        size_t new_size = MAX(session_size * 2, session_len + size + 4096);
+        char *buf = realloc(session_buf, new_size);
+
+        if (!buf)
+            return NULL;
+        session_buf = buf;
+        session_size = new_size;
+    }
+
+    p = (unsigned char *)session_buf + session_len;
+    session_len += size;
+
+    return p;
+}
+
+static unsigned char *put_item(unsigned char *p, DownloadItem *item, size_t size)
+{
+    p = put_u32(p, size);
+    *p++ = SESSION_ITEM;
+    p = put_u32(p, item->id);
+    *p++ = item->hot->mode;
+    *p++ = item->overwrite | item->decode << 1 | !!item->stream << 2 | item->decode_owned << 3;
+    p = put_u16(p, item->priority);
+    p = put_i64(p, item->max_speed);
+    p = put_i64(p, item->hot->done);
+    p = put_i64(p, item->hot->total_size);
+    p = put_string(p, item->url);
+    p = put_string(p, item->outputfilename);
+    p = put_string(p, item->referer);
+    p = put_string(p, item->etag);
+    p = put_string(p, item->last_modified);
+
+    return p;
+}
+
+static size_t item_record_size(DownloadItem *item)
+{
+    return SESSION_HEADER + 4 + 3 * 8 +
+           string_record_size(item->url) + string_record_size(item->outputfilename) +
+           string_record_size(item->referer) + string_record_size(item->etag) +
+           string_record_size(item->last_modified);
+}
+
+static void session_item(DownloadItem *item)
+{
+    size_t size;
+    unsigned char *p;
+
+    if (session_fd < 0)
+        return;
+
+    size = item_record_size(item);
+    pthread_mutex_lock(&session_lock);
+    p = session_reserve(size);
+    if (p)
+        put_item(p, item, size);
+    pthread_mutex_unlock(&session_lock);
+}
+
+static void session_progress(DownloadItem *item)
+{
+    size_t size = SESSION_HEADER + 3 + 3 * 8;
+    unsigned char *p;
+
+    if (session_fd < 0)
+        return;
+
+    item->saved_time = time(NULL);
+    pthread_mutex_lock(&session_lock);
+    p = session_reserve(size);
+    if (p) {
+        p = put_u32(p, size);
+        *p++ = SESSION_PROGRESS;
+        p = put_u32(p, item->id);
+        *p++ = item->hot->mode;
+        p = put_u16(p, item->priority);
+        p = put_i64(p, item->max_speed);
+        p = put_i64(p, item->hot->done);
+        put_i64(p, item->hot->total_size);
+    }
+    pthread_mutex_unlock(&session_lock);
+}
+
+static void session_delete(DownloadItem *item)
+{
+    unsigned char *p;
+
+    if (session_fd < 0)
+        return;
+
+    pthread_mutex_lock(&session_lock);
+    p = session_reserve(SESSION_HEADER);
+    if (p) {
+        p = put_u32(p, SESSION_HEADER);
+        *p++ = SESSION_DELETE;
+        put_u32(p, item->id);
+    }
+    pthread_mutex_unlock(&session_lock);
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = write(fd, buf, len);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -1;
+        buf += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static void *do_session(void *unused)
+{
+    (void)unused;
+
+    pthread_mutex_lock(&session_lock);
+    for (;;) {
+        struct timespec ts;
+        char *buf;
+        size_t len, size;
+        int stop = session_stop;
+
+        if (!stop) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&session_cond, &session_lock, &ts);
+            stop = session_stop;
+        }
+
+        buf = session_buf;
+        len = session_len;
+        size = session_size;
+        session_buf = session_spare;
+        session_size = session_spare_size;
+        session_len = 0;
+        session_spare = buf;
+        session_spare_size = size;
+
+        pthread_mutex_unlock(&session_lock);
+        if (len && write_all(session_fd, buf, len)) {
+            write_log(COLOR_PAIR(1), "Failed to write session file, no longer saving it: %s\n",
+                      strerror(errno));
+            pthread_mutex_lock(&session_lock);
+            session_failed = 1;
+            free(session_buf);
+            free(session_spare);
+            session_buf = session_spare = NULL;
+            session_len = session_size = session_spare_size = 0;
+            pthread_mutex_unlock(&session_lock);
+            break;
+        }
+        if (stop)
+            break;
+        pthread_mutex_lock(&session_lock);
+    }
+
+    return NULL;
+}
+
+static void session_close()
+{
+    int fd = session_fd;
+
+    if (fd < 0)
+        return;
+
+    pthread_mutex_lock(&session_lock);
+    session_stop = 1;
+    pthread_cond_signal(&session_cond);
+    pthread_mutex_unlock(&session_lock);
+    pthread_join(session_thread, NULL);
+
+    session_fd = -1;
+    fdatasync(fd);
+    close(fd);
+    free(session_buf);
+    free(session_spare);
+    session_buf = session_spare = NULL;
+    session_len = session_size = session_spare_size = 0;
+}
+
+/* Mapped output: once the size of a download is known the blocks of its
+ * file are reserved up to the final size and it is written through a
+ * window mapped at the current offset, bypassing stdio. Dirty pages are
+ * handed to writeback every MAP_SYNC_SIZE bytes. */
+static void sync_output(DownloadItem *item)
+{
+    curl_off_t start = MAX(item->map_synced, item->map_start);
+
+    start -= (start - item->map_start) % sysconf(_SC_PAGESIZE);
+    if (item->map && item->map_pos > start)
+        msync(item->map + (start - item->map_start), item->map_pos - start, MS_ASYNC);
+    item->map_synced = item->map_pos;
+}
+
+static int map_window(DownloadItem *item, curl_off_t offset)
+{
+    curl_off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+    size_t len = MIN(MAP_WINDOW, item->map_size - start);
+    char *map;
+
+    if (item->map) {
+        sync_output(item);
+        munmap(item->map, item->map_len);
+        item->map = NULL;
+    }
+
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(item->outputfile), start);
+    if (map == MAP_FAILED)
+        return 1;
+    posix_madvise(map, len, POSIX_MADV_SEQUENTIAL);
+
+    item->map = map;
+    item->map_len = len;
+    item->map_start = start;
+
+    return 0;
+}
+
+static void map_item(DownloadItem *item)
+{
+    int fd = fileno(item->outputfile);
+    curl_off_t length = -1;
+    struct stat st;
+
+    item->map_state = MAPPING_FAILED;
+    curl_easy_getinfo(item->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+    if (length <= 0 || fflush(item->outputfile) || fstat(fd, &st) || st.st_size != item->hot->downloaded)
+        return;
+
+    item->map_size = item->hot->downloaded + length;
+    item->map_pos = item->map_synced = item->hot->downloaded;
+    /* a full disk shows here instead of as SIGBUS on a mapped page */
+    if (posix_fallocate(fd, item->map_pos, length) || map_window(item, item->map_pos)) {
+        /* keep the file as stdio expects it */
+        if (ftruncate(fd, st.st_size))
+            write_log(COLOR_PAIR(1), "Failed to truncate %s\n", item->outputfilename);
+        return;
+    }
+
+    item->map_state = MAPPING_ACTIVE;
+}
+
+static void unmap_item(DownloadItem *item)
+{
+    if (item->map_state == MAPPING_ACTIVE) {
+        if (item->map) {
+            sync_output(item);
+            munmap(item->map, item->map_len);
+            item->map = NULL;
+        }
+        /* drop the unwritten tail, so resuming starts at the right offset */
+        if (item->map_pos < item->map_size &&
+            ftruncate(fileno(item->outputfile), item->map_pos))
+            write_log(COLOR_PAIR(1), "Failed to truncate %s\n", item->outputfilename);
+    }
+    item->map_state = MAPPING_UNKNOWN;
+}
+
+/* A window that can not be mapped mid-transfer leaves the download to the
+ * normal writes from pos on. */
+static void drop_mapping(DownloadItem *item, curl_off_t pos)
+{
+    write_log(COLOR_PAIR(3), "Mapping %s failed, writing it as usual.\n", item->outputfilename);
+    item->map_pos = pos;
+    unmap_item(item);
+    item->map_state = MAPPING_FAILED;
+    item->write_pos = pos;
+    if (fseeko(item->outputfile, pos, SEEK_SET))
+        write_log(COLOR_PAIR(1), "Failed to seek %s\n", item->outputfilename);
+}
+
+/* Transfers are spread over nb_shards threads, each running its own multi
+ * handle and event base. A started item waits in the queue of the shard
+ * picked for it until that shard has room, and shards running below
+ * capacity steal from the longest queue. queue_lock guards the queues,
+ * the running counts and which multi handle an item is in. */
+static void unlink_queued(Shard *shard, DownloadItem *item)
+{
+    if (item->queue_prev)
+        item->queue_prev->queue_next = item->queue_next;
+    else
+        shard->queue = item->queue_next;
+    if (item->queue_next)
+        item->queue_next->queue_prev = item->queue_prev;
+    else
+        shard->queue_tail = item->queue_prev;
+    item->queue_next = item->queue_prev = NULL;
+    item->queued = 0;
+    shard->nb_queued--;
+}
+
+static int shard_full(Shard *shard)
+{
+    return shard_capacity && shard->running >= shard_capacity;
+}
+
+static Shard *pick_shard(DownloadItem *item)
+{
+    Shard *best = &shards[0];
+
+    if (!balance_load && item->host)
+        return &shards[host_hash(item->host->name, item->host->port) % nb_shards];
+
+    for (int i = 1; i < nb_shards; i++) {
+        if (shards[i].running + shards[i].nb_queued < best->running + best->nb_queued)
+            best = &shards[i];
+    }
+
+    return best;
+}
+
+static void queue_item(DownloadItem *item)
+{
+    Shard *shard, *idle[MAX_SHARDS];
+    int nb_idle = 0;
+
+    pthread_mutex_lock(&queue_lock);
+    shard = pick_shard(item);
+    item->shard = shard;
+    item->queued = 1;
+    item->queue_next = NULL;
+    item->queue_prev = shard->queue_tail;
+    if (shard->queue_tail)
+        shard->queue_tail->queue_next = item;
+    else
+        shard->queue = item;
+    shard->queue_tail = item;
+    shard->nb_queued++;
+
+    /* an item that has to wait can be stolen by idle shards, wake
+     * those not already about to look */
+    for (int i = 0; shard_capacity && shard->running + shard->nb_queued > shard_capacity &&
+                    i < nb_shards; i++) {
+        if (&shards[i] != shard && !shard_full(&shards[i]) && !shards[i].nb_queued &&
+            !shards[i].steal_wakeup) {
+            shards[i].steal_wakeup = 1;
+            idle[nb_idle++] = &shards[i];
+        }
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    wake_shard(shard);
+    for (int i = 0; i < nb_idle; i++)
+        wake_shard(idle[i]);
+}
+
+/* Transfers are spread over the local interfaces given with -I. Each
+ * shard counts what its transfers received per interface and publishes
+ * the counts under queue_lock whenever it looks at its queue. Once a
+ * second the published sums turn into a smoothed rate. queue_lock is
+ * held. */
+static void update_uplinks()
+{
+    time_t now = time(NULL);
+
+    if (now == uplink_time)
+        return;
+
+    for (int i = 0; i < nb_uplinks; i++) {
+        curl_off_t total = 0;
+
+        for (int j = 0; j < nb_shards; j++)
+            total += shards[j].uplink_seen[i];
+        if (uplink_time)
+            uplinks[i].rate = (uplinks[i].rate + (total - uplinks[i].bytes) / (now - uplink_time)) / 2;
+        uplinks[i].bytes = total;
+    }
+    uplink_time = now;
+}
+
+/* an idle interface is tried first, else the one whose rate leaves the
+ * most to each of its transfers, counting the new one */
+static void pick_uplink(DownloadItem *item)
+{
+    int best = 0;
+
+    update_uplinks();
+    for (int i = 1; i < nb_uplinks; i++) {
+        Uplink *u = &uplinks[i], *b = &uplinks[best];
+
+        if (!b->running)
+            break;
+        if (!u->running || u->rate / (u->running + 1) > b->rate / (b->running + 1) ||
+            (u->rate / (u->running + 1) == b->rate / (b->running + 1) && u->running < b->running))
+            best = i;
+    }
+
+    item->uplink = best + 1;
+    uplinks[best].running++;
+    curl_easy_setopt(item->handle, CURLOPT_INTERFACE, uplinks[best].name);
+}
+
+/* runs on the shard thread, adds queued items while there is room */
+static void start_queued(Shard *shard)
+{
+    for (;;) {
+        Shard *victim = shard;
+        DownloadItem *item;
+        CURLMcode rc;
+
+        pthread_mutex_lock(&queue_lock);
+        shard->steal_wakeup = 0;
+        memcpy(shard->uplink_seen, shard->uplink_bytes, nb_uplinks * sizeof(*shard->uplink_seen));
+        shard->nb_socks_seen = shard->nb_socks;
+        shard->sock_updates_seen = shard->sock_updates;
+        shard->sock_updates_avoided_seen = shard->sock_updates_avoided;
+        /* without a limit every shard takes its own queue right away */
+        if (!shard->queue && shard_capacity) {
+            for (int i = 0; i < nb_shards; i++) {
+                if (shards[i].nb_queued > victim->nb_queued)
+                    victim = &shards[i];
+            }
+        }
+        item = victim == shard ? shard->queue : victim->queue_tail;
+        if (!item || shard_full(shard)) {
+            pthread_mutex_unlock(&queue_lock);
+            return;
+        }
+        unlink_queued(victim, item);
+        if (victim != shard)
+            shard->nb_stolen++;
+        item->shard = shard;
+        item->in_multi = 1;
+        shard->running++;
+        if (nb_uplinks)
+            pick_uplink(item);
+        rc = curl_multi_add_handle(shard->multi, item->handle);
+        pthread_mutex_unlock(&queue_lock);
+        check_mrc("add:", rc);
+        trace_event(TRACE_START, item->id, shard - shards, 0);
+    }
+}
+
+/* called with queue_lock held, on the thread of the item's shard or once
+ * that thread left its loop */
+static int remove_transfer(DownloadItem *item)
+{
+    Shard *shard = item->shard;
+    CURLMcode rc = curl_multi_remove_handle(shard->multi, item->handle);
+
+    check_mrc("remove:", rc);
+    item->in_multi = 0;
+    shard->running--;
+    if (item->uplink)
+        uplinks[item->uplink - 1].running--;
+    item->uplink = 0;
+
+    return shard_capacity && shard->nb_queued;
+}
+
+/* called with queue_lock held on the thread of the shard, removes the
+ * transfers other threads asked it to */
+static void detach_requested(Shard *shard)
+{
+    DownloadItem *item;
+
+    if (!shard->detach_queue)
+        return;
+    while ((item = shard->detach_queue)) {
+        shard->detach_queue = item->detach_next;
+        item->detach_next = NULL;
+        if (item->in_multi)
+            remove_transfer(item);
+        item->detaching = 0;
+    }
+    pthread_cond_broadcast(&items_detached);
+}
+
+/* take an item out of its shard, whether queued or transferring; a multi
+ * handle is only used by its shard, other threads ask it and wait */
+static void detach_item(DownloadItem *item)
+{
+    Shard *shard;
+    int freed = 0, state;
+
+    pthread_mutex_lock(&queue_lock);
+    shard = item->shard;
+    if (!shard) {
+        pthread_mutex_unlock(&queue_lock);
+        return;
+    }
+    release_prefetch(item);
+    if (item->queued) {
+        unlink_queued(shard, item);
+    } else if (item->in_multi && shard->started && !shard->left &&
+               !pthread_equal(shard->thread, pthread_self())) {
+        item->detaching = 1;
+        item->detach_next = shard->detach_queue;
+        shard->detach_queue = item;
+        wake_shard(shard);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+        while (item->detaching)
+            pthread_cond_wait(&items_detached, &queue_lock);
+        pthread_setcancelstate(state, NULL);
+    } else if (item->in_multi) {
+        freed = remove_transfer(item);
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    if (freed && !pthread_equal(shard->thread, pthread_self()))
+        wake_shard(shard);
+}
+
+/* Compressed downloads can be decoded while they arrive. The compressed
+ * file is kept as the output, so resuming, validation and ranges work as
+ * before, and the decoded copy next to it is produced from the same
+ * bytes as they reach the disk. A resumed download decodes what it has
+ * again first, as decoder state is not kept across restarts. */
+static int decode_format(const char *name)
+{
+    size_t len = strlen(name);
+
+    if (len > 3 && !strcmp(name + len - 3, ".gz"))
+        return DECODE_GZIP;
+    if (len > 4 && !strcmp(name + len - 4, ".zst"))
+        return DECODE_ZSTD;
+    if (len > 3 && !strcmp(name + len - 3, ".xz"))
+        return DECODE_XZ;
+
+    return DECODE_NONE;
+}
+
+static int init_decoder(Decoder *dec)
+{
+    dec->size = 0;
+    dec->crc = crc32(0, NULL, 0);
+    dec->error = 0;
+    dec->ended = 0;
+
+    if (dec->format == DECODE_GZIP) {
+        memset(&dec->z, 0, sizeof(dec->z));
+        /* 32 lets zlib take the gzip header */
+        return inflateInit2(&dec->z, 15 + 32) != Z_OK;
+    } else if (dec->format == DECODE_ZSTD) {
+        if (!dec->zstd)
+            dec->zstd = ZSTD_createDStream();
+        return !dec->zstd || ZSTD_isError(ZSTD_initDStream(dec->zstd));
+    } else {
+        lzma_stream init = LZMA_STREAM_INIT;
+
+        dec->lzma = init;
+        return lzma_stream_decoder(&dec->lzma, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK;
+    }
+}
+
+static void end_decoder(Decoder *dec)
+{
+    if (dec->format == DECODE_GZIP)
+        inflateEnd(&dec->z);
+    else if (dec->format == DECODE_XZ)
+        lzma_end(&dec->lzma);
+}
+
+static void free_decoder(DownloadItem *item)
+{
+    Decoder *dec = item->decoder;
+
+    if (!dec)
+        return;
+
+    end_decoder(dec);
+    if (dec->zstd)
+        ZSTD_freeDStream(dec->zstd);
+    if (dec->fd >= 0)
+        close(dec->fd);
+    free(dec->name);
+    free(dec->out);
+    free(dec);
+    item->decoder = NULL;
+}
+
+static int open_decoder(DownloadItem *item)
+{
+    int format = decode_format(item->outputfilename);
+    size_t len = strlen(item->outputfilename);
+    Decoder *dec;
+
+    if (!format) {
+        write_log(COLOR_PAIR(1), "Not decoding %s, it is not .gz, .zst or .xz.\n", item->outputfilename);
+        item->decode = 0;
+        return 0;
+    }
+
+    dec = item->decoder = calloc(1, sizeof(*dec));
+    if (!dec)
+        return -1;
+    dec->format = format;
+    dec->fd = -1;
+    dec->catch_up = -1;
+    dec->name = clonestring(item->outputfilename, len - (format == DECODE_ZSTD ? 4 : 3));
+    dec->out = malloc(DECODE_BUFFER_SIZE);
+    if (!dec->name || !dec->out || init_decoder(dec)) {
+        free_decoder(item);
+        return -1;
+    }
+    /* a decoded copy is only replaced by the item that made it, or
+     * with -O */
+    dec->fd = open(dec->name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (dec->fd < 0 && errno == EEXIST && item->decode_owned)
+        dec->fd = open(dec->name, O_WRONLY | O_TRUNC);
+    else if (dec->fd < 0 && errno == EEXIST) {
+        write_log(COLOR_PAIR(1), "Not decoding %s, %s exists already.\n", item->outputfilename, dec->name);
+        free_decoder(item);
+        item->decode = 0;
+        session_item(item);
+        return 0;
+    } else if (dec->fd >= 0 && !item->decode_owned) {
+        item->decode_owned = 1;
+        session_item(item);
+    }
+    if (dec->fd < 0) {
+        free_decoder(item);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int put_decoded(Decoder *dec, size_t len)
+{
+    if (write_all(dec->fd, (const char *)dec->out, len))
+        return -1;
+    dec->crc = crc32(dec->crc, dec->out, len);
+    dec->size += len;
+
+    return 0;
+}
+
+static void decode_bytes(DownloadItem *item, const char *buf, size_t len)
+{
+    Decoder *dec = item->decoder;
+    int err = 0;
+
+    if (!dec || dec->error || !len)
+        return;
+
+    if (dec->format == DECODE_GZIP) {
+        dec->z.next_in = (Bytef *)buf;
+        dec->z.avail_in = len;
+        while (!err && dec->z.avail_in) {
+            int ret;
+
+            dec->z.next_out = dec->out;
+            dec->z.avail_out = DECODE_BUFFER_SIZE;
+            ret = inflate(&dec->z, Z_NO_FLUSH);
+            err = (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+                  put_decoded(dec, DECODE_BUFFER_SIZE - dec->z.avail_out);
+            dec->ended = ret == Z_STREAM_END;
+            /* concatenated members are one file, as with gzip -d */
+            if (!err && dec->ended && dec->z.avail_in)
+                err = inflateReset(&dec->z) != Z_OK;
+        }
+    } else if (dec->format == DECODE_ZSTD) {
+        ZSTD_inBuffer in = { buf, len, 0 };
+
+        while (!err && in.pos < in.size) {
+            ZSTD_outBuffer out = { dec->out, DECODE_BUFFER_SIZE, 0 };
+            size_t ret = ZSTD_decompressStream(dec->zstd, &out, &in);
+
+            err = ZSTD_isError(ret) || put_decoded(dec, out.pos);
+            dec->ended = ret == 0;
+        }
+    } else {
+        dec->lzma.next_in = (const uint8_t *)buf;
+        dec->lzma.avail_in = len;
+        while (!err && dec->lzma.avail_in) {
+            lzma_ret ret;
+
+            dec->lzma.next_out = dec->out;
+            dec->lzma.avail_out = DECODE_BUFFER_SIZE;
+            ret = lzma_code(&dec->lzma, LZMA_RUN);
+            err = (ret != LZMA_OK && ret != LZMA_STREAM_END) ||
+                  put_decoded(dec, DECODE_BUFFER_SIZE - dec->lzma.avail_out);
+        }
+    }
+
+    if (err) {
+        dec->error = 1;
+        write_log(COLOR_PAIR(1), "Failed to decode %s\n", item->outputfilename);
+    }
+}
+
+/* start over on an empty decoded copy, then decode the first bytes of
+ * the compressed one */
+static void catch_up_decoder(DownloadItem *item)
+{
+    Decoder *dec = item->decoder;
+    int fd = fileno(item->outputfile);
+    curl_off_t len = dec->catch_up, offset = 0;
+
+    dec->catch_up = -1;
+    end_decoder(dec);
+    if (init_decoder(dec) || ftruncate(dec->fd, 0) || lseek(dec->fd, 0, SEEK_SET)) {
+        dec->error = 1;
+        return;
+    }
+
+    while (offset < len && !dec->error) {
+        char buf[WRITE_BUFFER_SIZE];
+        ssize_t n = pread(fd, buf, MIN(len - offset, (curl_off_t)sizeof(buf)), offset);
+
+        if (n <= 0)
+            break;
+        decode_bytes(item, buf, n);
+        offset += n;
+    }
+}
+
+/* runs wherever the compressed bytes are written, in their order, so
+ * what a resumed download has is decoded there before its new bytes */
+static void decode_data(DownloadItem *item, const char *buf, size_t len)
+{
+    if (item->decoder && item->decoder->catch_up >= 0)
+        catch_up_decoder(item);
+    decode_bytes(item, buf, len);
+}
+
+static size_t decode_written(DownloadItem *item, const char *buf, size_t len)
+{
+    decode_data(item, buf, len);
+
+    return len;
+}
+
+/* the decoded copy is made again from the first len bytes of the
+ * compressed one, by whoever decodes the bytes following them */
+static void decode_existing(DownloadItem *item, curl_off_t len)
+{
+    fflush(item->outputfile);
+    item->decoder->catch_up = len;
+}
+
+/* the compressed stream has to end where the download does, returns
+ * whether the decoded copy is broken */
+static int finish_decoder(DownloadItem *item)
+{
+    Decoder *dec = item->decoder;
+    int failed;
+
+    /* nothing new arrived to decode it before */
+    if (dec->catch_up >= 0)
+        catch_up_decoder(item);
+    if (dec->format == DECODE_XZ && !dec->error) {
+        lzma_ret ret;
+
+        dec->lzma.next_in = NULL;
+        dec->lzma.avail_in = 0;
+        do {
+            dec->lzma.next_out = dec->out;
+            dec->lzma.avail_out = DECODE_BUFFER_SIZE;
+            ret = lzma_code(&dec->lzma, LZMA_FINISH);
+            if ((ret != LZMA_OK && ret != LZMA_STREAM_END) ||
+                put_decoded(dec, DECODE_BUFFER_SIZE - dec->lzma.avail_out))
+                dec->error = 1;
+        } while (ret == LZMA_OK && !dec->error);
+        dec->ended = ret == LZMA_STREAM_END;
+    }
+
+    if (!dec->error && !dec->ended)
+        write_log(COLOR_PAIR(1), "%s ended before its compressed stream did.\n", item->outputfilename);
+    else if (!dec->error)
+        write_log(COLOR_PAIR(7), "Decoded %s, %" CURL_FORMAT_CURL_OFF_T " bytes, CRC-32 %08lx.\n",
+                  dec->name, dec->size, dec->crc);
+    failed = dec->error || !dec->ended;
+    free_decoder(item);
+
+    return failed;
+}
+
+/* Disk writes happen on writer threads, so a stalled disk does not stop
+ * the event loop. write_data() copies into buffers from a fixed pool and
+ * queues them to the writer owning the item, which keeps each file's
+ * writes in order. A transfer that runs short of buffers is paused and
+ * continued from write_cb() once its writer caught up. */
+static int pwrite_all(int fd, const char *buf, size_t len, curl_off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+
+        if (n < 0)
+            return -1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+static void *do_write(void *arg)
+{
+    Writer *writer = arg;
+
+    trace_register(TRACE_WRITER_THREAD, writer - writers);
+    pthread_mutex_lock(&write_lock);
+    for (;;) {
+        WriteBuffer *buf = writer->head;
+        DownloadItem *item;
+        uint64_t start;
+        int err;
+
+        if (!buf) {
+            if (write_stop)
+                break;
+            pthread_cond_wait(&writer->cond, &write_lock);
+            continue;
+        }
+        writer->head = buf->next;
+        if (!writer->head)
+            writer->tail = NULL;
+        item = buf->item;
+        pthread_mutex_unlock(&write_lock);
+
+        /* buffers of an item reach its writer in order, which is all
+         * a stream needs as it can not seek */
+        start = trace_now();
+        if (item->stream)
+            err = write_all(fileno(item->outputfile), buf->data, buf->len);
+        else
+            err = pwrite_all(fileno(item->outputfile), buf->data, buf->len, buf->offset);
+        if (!err)
+            decode_data(item, buf->data, buf->len);
+        trace_event(TRACE_DISK_WRITE, item->id, buf->len, start);
+
+        pthread_mutex_lock(&write_lock);
+        if (err)
+            item->write_error = 1;
+        buf->next = free_buffers;
+        free_buffers = buf;
+        nb_free_buffers++;
+        if (!--item->pending_writes)
+            pthread_cond_broadcast(&write_done);
+        for (int i = 0; i < nb_shards; i++) {
+            if (shards[i].write_paused && !shards[i].write_wakeup) {
+                shards[i].write_wakeup = 1;
+                wake_shard(&shards[i]);
+            }
+        }
+    }
+    pthread_mutex_unlock(&write_lock);
+
+    return NULL;
+}
+
+/* continue the transfers of a shard whose writers caught up */
+static void resume_writes(Shard *shard)
+{
+    DownloadItem *resume = NULL, *item, **p;
+
+    pthread_mutex_lock(&write_lock);
+    shard->write_wakeup = 0;
+    for (p = &shard->write_paused; (item = *p);) {
+        if (item->pending_writes <= MAX_ITEM_BUFFERS / 2 &&
+            nb_free_buffers >= NB_WRITE_BUFFERS / 4) {
+            *p = item->paused_next;
+            item->paused_next = resume;
+            item->write_paused = 0;
+            resume = item;
+        } else {
+            p = &item->paused_next;
+        }
+    }
+    pthread_mutex_unlock(&write_lock);
+
+    for (; resume; resume = item) {
+        item = resume->paused_next;
+        resume->paused_next = NULL;
+        curl_easy_pause(resume->handle, CURLPAUSE_CONT);
+    }
+}
+
+static size_t queue_write(DownloadItem *item, const char *ptr, size_t len)
+{
+    Writer *writer = &writers[item->id % nb_writers];
+    unsigned needed = (len + WRITE_BUFFER_SIZE - 1) / WRITE_BUFFER_SIZE;
+    WriteBuffer *first, *last = NULL, *buf;
+    size_t written = 0;
+
+    if (!len)
+        return 0;
+
+    /* the transfer stops, it is failed once it is done */
+    pthread_mutex_lock(&write_lock);
+    if (item->write_error) {
+        pthread_mutex_unlock(&write_lock);
+        return 0;
+    }
+    if (needed > nb_free_buffers || item->pending_writes + needed > MAX_ITEM_BUFFERS) {
+        if (!item->write_paused) {
+            item->write_paused = 1;
+            item->paused_next = item->shard->write_paused;
+            item->shard->write_paused = item;
+        }
+        pthread_mutex_unlock(&write_lock);
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    first = free_buffers;
+    for (unsigned i = 0; i < needed; i++) {
+        last = free_buffers;
+        free_buffers = last->next;
+    }
+    last->next = NULL;
+    nb_free_buffers -= needed;
+    item->pending_writes += needed;
+    pthread_mutex_unlock(&write_lock);
+
+    for (buf = first; buf; buf = buf->next) {
+        buf->item = item;
+        buf->offset = item->write_pos + written;
+        buf->len = MIN(len - written, WRITE_BUFFER_SIZE);
+        memcpy(buf->data, ptr + written, buf->len);
+        written += buf->len;
+    }
+    item->write_pos += written;
+
+    pthread_mutex_lock(&write_lock);
+    if (writer->tail)
+        writer->tail->next = first;
+    else
+        writer->head = first;
+    writer->tail = last;
+    pthread_cond_signal(&writer->cond);
+    pthread_mutex_unlock(&write_lock);
+
+    return written;
+}
+
+/* forget a write pause of a transfer that is being stopped */
+static void drop_write_pause(DownloadItem *item)
+{
+    DownloadItem **p;
+
+    pthread_mutex_lock(&write_lock);
+    if (item->write_paused) {
+        for (p = &item->shard->write_paused; *p != item; p = &(*p)->paused_next)
+            ;
+        *p = item->paused_next;
+        item->paused_next = NULL;
+        item->write_paused = 0;
+    }
+    pthread_mutex_unlock(&write_lock);
+}
+
+/* wait until the queued writes of an item reached its file, returns
+ * whether one of them failed since the last flush */
+static int flush_writes(DownloadItem *item)
+{
+    int state, error;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    pthread_mutex_lock(&write_lock);
+    while (item->pending_writes)
+        pthread_cond_wait(&write_done, &write_lock);
+    error = item->write_error;
+    item->write_error = 0;
+    pthread_mutex_unlock(&write_lock);
+    pthread_setcancelstate(state, NULL);
+    drop_write_pause(item);
+    /* written directly, what stdio still buffers */
+    if (!writers_started && item->outputfile && fflush(item->outputfile))
+        error = 1;
+
+    return error;
+}
+
+static void start_writers()
+{
+    size_t size = sizeof(WriteBuffer) + WRITE_BUFFER_SIZE;
+    int i;
+
+    if (nb_writers <= 0)
+        return;
+
+    write_pool = malloc(NB_WRITE_BUFFERS * size);
+    if (!write_pool) {
+        write_log(COLOR_PAIR(1), "Failed to set up disk writers, writing directly.\n");
+        return;
+    }
+
+    for (i = 0; i < NB_WRITE_BUFFERS; i++) {
+        WriteBuffer *buf = (WriteBuffer *)(write_pool + i * size);
+
+        buf->next = free_buffers;
+        free_buffers = buf;
+    }
+    nb_free_buffers = NB_WRITE_BUFFERS;
+
+    for (i = 0; i < nb_writers; i++) {
+        pthread_cond_init(&writers[i].cond, NULL);
+        if (pthread_create(&writers[i].thread, NULL, do_write, &writers[i]))
+            break;
+    }
+    nb_writers = writers_started = i;
+}
+
+static void stop_writers()
+{
+    int i;
+
+    pthread_mutex_lock(&write_lock);
+    write_stop = 1;
+    for (i = 0; i < writers_started; i++)
+        pthread_cond_signal(&writers[i].cond);
+    pthread_mutex_unlock(&write_lock);
+
+    for (i = 0; i < writers_started; i++) {
+        pthread_join(writers[i].thread, NULL);
+        pthread_cond_destroy(&writers[i].cond);
+    }
+    writers_started = 0;
+
+    free(write_pool);
+    write_pool = NULL;
+    free_buffers = NULL;
+}
+
+/* Delta updates read the zsync control file of the new version: a header
+ * followed by a weak rolling checksum and a truncated MD4 per block. The
+ * old copy is scanned for those blocks by several threads, each over its
+ * own part of the file, and what is found goes into a new file next to
+ * it. The rest is fetched with multi-range requests and the result is
+ * checked against the SHA-1 of the whole file before it replaces the old
+ * copy. */
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void md4_block(uint32_t h[4], const unsigned char *p)
+{
+    static const int s1[4] = { 3, 7, 11, 19 };
+    static const int s2[4] = { 3, 5, 9, 13 };
+    static const int s3[4] = { 3, 9, 11, 15 };
+    static const int o2[16] = { 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15 };
+    static const int o3[16] = { 0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15 };
+    uint32_t x[16], a = h[0], b = h[1], c = h[2], d = h[3], t;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        x[i] = p[4 * i] | p[4 * i + 1] << 8 | p[4 * i + 2] << 16 | (uint32_t)p[4 * i + 3] << 24;
+
+    /* each step works on the next variable, rotating them keeps a
+     * single form per round */
+    for (i = 0; i < 16; i++) {
+        t = a + ((b & c) | (~b & d)) + x[i];
+        a = d; d = c; c = b; b = ROL32(t, s1[i % 4]);
+    }
+    for (i = 0; i < 16; i++) {
+        t = a + ((b & c) | (b & d) | (c & d)) + x[o2[i]] + 0x5A827999;
+        a = d; d = c; c = b; b = ROL32(t, s2[i % 4]);
+    }
+    for (i = 0; i < 16; i++) {
+        t = a + (b ^ c ^ d) + x[o3[i]] + 0x6ED9EBA1;
+        a = d; d = c; c = b; b = ROL32(t, s3[i % 4]);
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+static void md4(const unsigned char *data, size_t len, unsigned char out[16])
+{
+    uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    unsigned char tail[128] = { 0 };
+    uint64_t bits = (uint64_t)len * 8;
+    size_t n = len % 64, size = n < 56 ? 64 : 128;
+
+    for (size_t i = 0; i + 64 <= len; i += 64)
+        md4_block(h, data + i);
+
+    memcpy(tail, data + len - n, n);
+    tail[n] = 0x80;
+    for (int i = 0; i < 8; i++)
+        tail[size - 8 + i] = bits >> (8 * i);
+    md4_block(h, tail);
+    if (size == 128)
+        md4_block(h, tail + 64);
+
+    for (int i = 0; i < 16; i++)
+        out[i] = h[i / 4] >> (8 * (i % 4));
+}
+
+static void sha1_block(uint32_t h[5], const unsigned char *p)
+{
+    uint32_t w[80], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f, k, t;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (; i < 80; i++) {
+        t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+        w[i] = ROL32(t, 1);
+    }
+
+    for (i = 0; i < 80; i++) {
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        t = ROL32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ROL32(b, 30);
+        b = a;
+        a = t;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+static void sha1_init(Sha1 *s)
+{
+    static const uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+    memcpy(s->h, h, sizeof(h));
+    s->len = 0;
+    s->n = 0;
+}
+
+static void sha1_update(Sha1 *s, const unsigned char *data, size_t len)
+{
+    s->len += len;
+    if (s->n) {
+        size_t n = MIN(len, 64 - s->n);
+
+        memcpy(s->buf + s->n, data, n);
+        s->n += n;
+        data += n;
+        len -= n;
+        if (s->n < 64)
+            return;
+        sha1_block(s->h, s->buf);
+        s->n = 0;
+    }
+    for (; len >= 64; data += 64, len -= 64)
+        sha1_block(s->h, data);
+    memcpy(s->buf, data, len);
+    s->n = len;
+}
+
+static void sha1_final(Sha1 *s, unsigned char out[20])
+{
+    uint64_t bits = s->len * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t n = s->n < 56 ? 56 - s->n : 120 - s->n;
+
+    for (int i = 0; i < 8; i++)
+        pad[n + i] = bits >> (56 - 8 * i);
+    sha1_update(s, pad, n + 8);
+
+    for (int i = 0; i < 20; i++)
+        out[i] = s->h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+static uint32_t delta_key(const Delta *delta, uint32_t a, uint32_t b)
+{
+    uint32_t key = (a & 0xffff) << 16 | (b & 0xffff);
+
+    return delta->rsum_bytes < 4 ? key & ((1u << (8 * delta->rsum_bytes)) - 1) : key;
+}
+
+static void delta_rsum(const unsigned char *p, unsigned len, uint32_t *a, uint32_t *b)
+{
+    uint32_t sa = 0, sb = 0;
+
+    for (unsigned i = 0; i < len; i++) {
+        sa += p[i];
+        sb += sa;
+    }
+    *a = sa;
+    *b = sb;
+}
+
+static unsigned delta_hash(uint32_t key, int bits)
+{
+    return (key * 2654435761u) >> (32 - bits);
+}
+
+static int delta_header_line(Delta *delta, const char *line, size_t len)
+{
+    char value[64];
+    const char *colon = memchr(line, ':', len);
+    size_t n;
+
+    if (!colon)
+        return 0;
+    n = MIN(len - (colon + 1 - line), sizeof(value) - 1);
+    memcpy(value, colon + 1, n);
+    value[n] = 0;
+
+    if (colon - line == 9 && !strncasecmp(line, "Blocksize", 9)) {
+        delta->block_size = strtoul(value, NULL, 10);
+    } else if (colon - line == 6 && !strncasecmp(line, "Length", 6)) {
+        delta->length = strtoll(value, NULL, 10);
+    } else if (colon - line == 12 && !strncasecmp(line, "Hash-Lengths", 12)) {
+        if (sscanf(value, "%d,%d,%d", &delta->seq_matches, &delta->rsum_bytes,
+                   &delta->checksum_bytes) != 3)
+            return -1;
+    } else if (colon - line == 5 && !strncasecmp(line, "SHA-1", 5)) {
+        const char *p = value;
+
+        while (*p == ' ')
+            p++;
+        for (int i = 0; i < 20; i++) {
+            unsigned byte;
+
+            if (sscanf(p + 2 * i, "%2x", &byte) != 1)
+                return -1;
+            delta->sha1[i] = byte;
+        }
+        delta->has_sha1 = 1;
+    }
+
+    return 0;
+}
+
+static int parse_control(Delta *delta)
+{
+    const char *p = delta->control, *end = p + delta->control_len;
+    unsigned entry_size;
+
+    delta->seq_matches = 1;
+    delta->rsum_bytes = 4;
+    delta->checksum_bytes = 16;
+    for (;;) {
+        const char *eol = memchr(p, '\n', end - p);
+        size_t len;
+
+        if (!eol)
+            return -1;
+        len = eol - p;
+        if (len && p[len - 1] == '\r')
+            len--;
+        if (!len) {
+            p = eol + 1;
+            break;
+        }
+        if (delta_header_line(delta, p, len))
+            return -1;
+        p = eol + 1;
+    }
+
+    if (delta->block_size < 64 || delta->block_size > (1u << 24) ||
+        (delta->block_size & (delta->block_size - 1)) || delta->length < 0 ||
+        delta->seq_matches < 1 || delta->seq_matches > 2 ||
+        delta->rsum_bytes < 1 || delta->rsum_bytes > 4 ||
+        delta->checksum_bytes < 3 || delta->checksum_bytes > 16)
+        return -1;
+
+    delta->nb_blocks = (delta->length + delta->block_size - 1) / delta->block_size;
+    entry_size = delta->rsum_bytes + delta->checksum_bytes;
+    if ((size_t)(end - p) < (size_t)delta->nb_blocks * entry_size)
+        return -1;
+    delta->sums = (const unsigned char *)p;
+
+    for (delta->table_bits = 4; delta->table_bits < 24 &&
+         (1u << delta->table_bits) < delta->nb_blocks; delta->table_bits++)
+        ;
+    delta->filter_bits = delta->table_bits + 3;
+    delta->rsums = malloc(MAX(delta->nb_blocks, 1) * sizeof(*delta->rsums));
+    delta->chain = malloc(MAX(delta->nb_blocks, 1) * sizeof(*delta->chain));
+    delta->heads = calloc(1u << delta->table_bits, sizeof(*delta->heads));
+    delta->filter = calloc(1u << (delta->filter_bits - 3), 1);
+    if (!delta->rsums || !delta->chain || !delta->heads || !delta->filter)
+        return -1;
+
+    /* blocks are chained by their key, newest first, with 0 ending a
+     * chain, and a bit per key hash rules out most positions before
+     * the table is looked at */
+    for (unsigned j = delta->nb_blocks; j-- > 0;) {
+        const unsigned char *sum = delta->sums + (size_t)j * entry_size;
+        uint32_t key = 0;
+        unsigned h, f;
+
+        for (int k = 0; k < delta->rsum_bytes; k++)
+            key = key << 8 | sum[k];
+        delta->rsums[j] = key;
+        h = delta_hash(key, delta->table_bits);
+        delta->chain[j] = delta->heads[h];
+        delta->heads[h] = j + 1;
+        f = delta_hash(key ^ 0x5bd1e995, delta->filter_bits);
+        delta->filter[f >> 3] |= 1 << (f & 7);
+    }
+
+    return 0;
+}
+
+static int delta_block_matches(const Delta *delta, unsigned j, const unsigned char *p,
+                               unsigned char *digest, int *have_digest)
+{
+    const unsigned char *sum = delta->sums + (size_t)j * (delta->rsum_bytes + delta->checksum_bytes);
+
+    if (!*have_digest) {
+        md4(p, delta->block_size, digest);
+        *have_digest = 1;
+    }
+
+    return !memcmp(digest, sum + delta->rsum_bytes, delta->checksum_bytes);
+}
+
+static int add_match(DeltaScan *scan, unsigned block, curl_off_t pos)
+{
+    if (scan->nb_matches == scan->size_matches) {
+        size_t size = scan->size_matches ? scan->size_matches * 2 : 1024;
+        DeltaMatch *matches = realloc(scan->matches, size * sizeof(*matches));
+
+        if (!matches)
+            return -1;
+        scan->matches = matches;
+        scan->size_matches = size;
+    }
+    scan->matches[scan->nb_matches].block = block;
+    scan->matches[scan->nb_matches].pos = pos;
+    scan->nb_matches++;
+
+    return 0;
+}
+
+/* Rolls the weak checksum over one part of the old copy. Past its end the
+ * file reads as zeros, as the last block is padded in the control file.
+ * After a match the scan jumps a block ahead, as rsync does. */
+static void *do_delta_scan(void *arg)
+{
+    DeltaScan *scan = arg;
+    const Delta *delta = scan->delta;
+    unsigned bs = delta->block_size, bshift = 0;
+    size_t cap = DELTA_READ_SIZE + 2 * (size_t)bs;
+    unsigned char *buf = malloc(cap);
+    curl_off_t base = -1, pos = scan->start;
+    uint32_t a = 0, b = 0;
+    int fresh = 1;
+
+    if (!buf) {
+        scan->error = 1;
+        return NULL;
+    }
+    while ((1u << bshift) < bs)
+        bshift++;
+
+    while (pos < scan->end && !delta->stop) {
+        unsigned char digest[16];
+        const unsigned char *p;
+        unsigned j, f;
+        int have_digest = 0, matched = 0;
+        uint32_t key;
+
+        /* the window always has the next block too, for seq_matches 2 */
+        if (base < 0 || pos + 2 * (curl_off_t)bs > base + (curl_off_t)cap) {
+            size_t len = 0;
+
+            base = pos;
+            while (len < cap) {
+                ssize_t n = pread(scan->fd, buf + len, cap - len, base + len);
+
+                if (n < 0) {
+                    scan->error = 1;
+                    goto end;
+                }
+                if (!n)
+                    break;
+                len += n;
+            }
+            memset(buf + len, 0, cap - len);
+        }
+        p = buf + (pos - base);
+        if (fresh) {
+            delta_rsum(p, bs, &a, &b);
+            fresh = 0;
+        }
+
+        key = delta_key(delta, a, b);
+        f = delta_hash(key ^ 0x5bd1e995, delta->filter_bits);
+        if (delta->filter[f >> 3] & (1 << (f & 7))) {
+            for (j = delta->heads[delta_hash(key, delta->table_bits)]; j; j = delta->chain[j - 1]) {
+                unsigned block = j - 1;
+
+                if (delta->rsums[block] != key || !delta_block_matches(delta, block, p, digest, &have_digest))
+                    continue;
+                /* short sums only count when the next block follows */
+                if (delta->seq_matches > 1 && block + 1 < delta->nb_blocks) {
+                    unsigned char next_digest[16];
+                    int have_next = 0;
+                    uint32_t na, nb;
+
+                    delta_rsum(p + bs, bs, &na, &nb);
+                    if (delta->rsums[block + 1] != delta_key(delta, na, nb) ||
+                        !delta_block_matches(delta, block + 1, p + bs, next_digest, &have_next))
+                        continue;
+                }
+                if (add_match(scan, block, pos)) {
+                    scan->error = 1;
+                    goto end;
+                }
+                matched = 1;
+            }
+        }
+
+        if (matched) {
+            pos += bs;
+            fresh = 1;
+        } else {
+            uint32_t old = p[0];
+
+            a += p[bs] - old;
+            b += a - (old << bshift);
+            pos++;
+        }
+    }
+
+end:
+    free(buf);
+
+    return NULL;
+}
+
+static int delta_scan(DownloadItem *item)
+{
+    Delta *delta = item->delta;
+    DeltaScan scans[MAX_DELTA_THREADS];
+    unsigned bs = delta->block_size;
+    long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned char *block = NULL;
+    struct stat st;
+    int fd, nb_scans, started = 0, ret = -1;
+
+    fd = open(item->outputfilename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    delta->fd = open(delta->tmpname, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    delta->found = calloc(MAX(delta->nb_blocks, 1), 1);
+    block = malloc(bs);
+    if (delta->fd < 0 || !delta->found || !block || ftruncate(delta->fd, delta->length))
+        goto end;
+
+    /* a part per thread, but none so small that threads cost more than
+     * they save */
+    nb_scans = MIN(MAX(nb_cpus, 1), MAX_DELTA_THREADS);
+    nb_scans = MIN(nb_scans, 1 + st.st_size / (8 << 20));
+    for (int i = 0; i < nb_scans; i++) {
+        memset(&scans[i], 0, sizeof(scans[i]));
+        scans[i].delta = delta;
+        scans[i].fd = fd;
+        scans[i].start = st.st_size * i / nb_scans;
+        scans[i].end = st.st_size * (i + 1) / nb_scans;
+    }
+    for (; started < nb_scans; started++) {
+        if (pthread_create(&scans[started].thread, NULL, do_delta_scan, &scans[started]))
+            break;
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(scans[i].thread, NULL);
+    if (started < nb_scans || delta->stop)
+        goto end;
+
+    /* copy each block once, from where it was first found */
+    for (int i = 0; i < nb_scans; i++) {
+        if (scans[i].error)
+            goto end;
+        for (size_t k = 0; k < scans[i].nb_matches; k++) {
+            DeltaMatch *m = &scans[i].matches[k];
+            curl_off_t offset = (curl_off_t)m->block * bs;
+            size_t len = MIN((curl_off_t)bs, delta->length - offset), n = 0;
+
+            if (delta->found[m->block])
+                continue;
+            while (n < len) {
+                ssize_t r = pread(fd, block + n, len - n, m->pos + n);
+
+                if (r < 0)
+                    goto end;
+                if (!r)
+                    break;
+                n += r;
+            }
+            memset(block + n, 0, len - n);
+            if (pwrite_all(delta->fd, (const char *)block, len, offset))
+                goto end;
+            delta->found[m->block] = 1;
+            delta->found_bytes += len;
+        }
+    }
+
+    delta->ranges = malloc(2 * MAX(delta->nb_blocks, 1) * sizeof(*delta->ranges));
+    if (!delta->ranges)
+        goto end;
+    for (unsigned j = 0; j < delta->nb_blocks;) {
+        unsigned k = j;
+
+        if (delta->found[j]) {
+            j++;
+            continue;
+        }
+        while (k < delta->nb_blocks && !delta->found[k])
+            k++;
+        delta->ranges[2 * delta->nb_ranges] = (curl_off_t)j * bs;
+        delta->ranges[2 * delta->nb_ranges + 1] = MIN((curl_off_t)k * bs, delta->length);
+        delta->nb_ranges++;
+        j = k;
+    }
+    ret = 0;
+
+end:
+    for (int i = 0; i < started; i++)
+        free(scans[i].matches);
+    free(block);
+    close(fd);
+
+    return ret;
+}
+
+/* without a SHA-1 in the control file each fetched block is checked
+ * against its MD4, the ones taken from the old copy matched it already */
+static int delta_check_blocks(Delta *delta)
+{
+    unsigned bs = delta->block_size;
+    unsigned char *block = malloc(bs);
+    unsigned char digest[16];
+    int ret = -1;
+
+    if (!block)
+        return -1;
+
+    for (unsigned j = 0; j < delta->nb_blocks; j++) {
+        curl_off_t offset = (curl_off_t)j * bs;
+        size_t len = MIN((curl_off_t)bs, delta->length - offset), n = 0;
+        int have_digest = 0;
+
+        if (delta->stop)
+            goto end;
+        if (delta->found[j] && !delta->full)
+            continue;
+        while (n < len) {
+            ssize_t r = pread(delta->fd, block + n, len - n, offset + n);
+
+            if (r <= 0)
+                goto end;
+            n += r;
+        }
+        memset(block + len, 0, bs - len);
+        if (!delta_block_matches(delta, j, block, digest, &have_digest))
+            goto end;
+    }
+    ret = 0;
+
+end:
+    free(block);
+
+    return ret;
+}
+
+static int delta_verify(Delta *delta)
+{
+    unsigned char *buf = malloc(DELTA_READ_SIZE);
+    unsigned char digest[20];
+    curl_off_t offset = 0;
+    Sha1 sha1;
+
+    if (!buf || ftruncate(delta->fd, delta->length)) {
+        free(buf);
+        return -1;
+    }
+    if (!delta->has_sha1) {
+        free(buf);
+        return delta_check_blocks(delta);
+    }
+
+    sha1_init(&sha1);
+    while (offset < delta->length && !delta->stop) {
+        ssize_t n = pread(delta->fd, buf, MIN(delta->length - offset, DELTA_READ_SIZE), offset);
+
+        if (n <= 0)
+            break;
+        sha1_update(&sha1, buf, n);
+        offset += n;
+    }
+    sha1_final(&sha1, digest);
+    free(buf);
+
+    return offset != delta->length || memcmp(digest, delta->sha1, 20);
+}
+
+/* scanning and checking the result run off the event loop, the shard
+ * that started them picks up the item again */
+static void *do_delta(void *arg)
+{
+    DownloadItem *item = arg;
+    Delta *delta = item->delta;
+
+    if (delta->state == DELTA_SCAN)
+        delta->error = delta_scan(item);
+    else
+        delta->error = delta_verify(delta);
+
+    pthread_mutex_lock(&queue_lock);
+    if (!delta->stop) {
+        delta->ready_next = delta->shard->delta_ready;
+        delta->shard->delta_ready = item;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    wake_shard(delta->shard);
+
+    return NULL;
+}
+
+static int start_delta_thread(DownloadItem *item, int state)
+{
+    Delta *delta = item->delta;
+
+    delta->state = state;
+    delta->shard = item->shard;
+    delta->error = 0;
+    if (pthread_create(&delta->thread, NULL, do_delta, item))
+        return -1;
+    delta->thread_started = 1;
+
+    return 0;
+}
+
+static void free_delta(DownloadItem *item)
+{
+    Delta *delta = item->delta;
+
+    if (!delta)
+        return;
+
+    pthread_mutex_lock(&queue_lock);
+    delta->stop = 1;
+    pthread_mutex_unlock(&queue_lock);
+    if (delta->thread_started)
+        pthread_join(delta->thread, NULL);
+
+    pthread_mutex_lock(&queue_lock);
+    for (DownloadItem **p = delta->shard ? &delta->shard->delta_ready : NULL; p && *p;
+         p = &(*p)->delta->ready_next) {
+        if (*p == item) {
+            *p = delta->ready_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    if (delta->fd >= 0)
+        close(delta->fd);
+    if (delta->tmpname)
+        unlink(delta->tmpname);
+    free(delta->tmpname);
+    free(delta->control);
+    free(delta->rsums);
+    free(delta->heads);
+    free(delta->chain);
+    free(delta->filter);
+    free(delta->found);
+    free(delta->ranges);
+    free(delta);
+    item->delta = NULL;
+}
+
+/* the transfer is pointed at the control file first */
+static int delta_start(DownloadItem *item)
+{
+    Delta *delta = calloc(1, sizeof(*delta));
+    size_t len = strlen(item->outputfilename);
+    char *url;
+
+    if (!delta)
+        return -1;
+    delta->fd = -1;
+    delta->tmpname = malloc(len + sizeof(".ncdm-delta"));
+    if (!delta->tmpname) {
+        free(delta);
+        return -1;
+    }
+    memcpy(delta->tmpname, item->outputfilename, len);
+    memcpy(delta->tmpname + len, ".ncdm-delta", sizeof(".ncdm-delta"));
+    url = malloc(strlen(item->escape_url) + sizeof(".zsync"));
+    if (!url) {
+        free(delta->tmpname);
+        free(delta);
+        return -1;
+    }
+    sprintf(url, "%s.zsync", item->escape_url);
+    curl_easy_setopt(item->handle, CURLOPT_URL, url);
+    curl_easy_setopt(item->handle, CURLOPT_RANGE, NULL);
+    curl_easy_setopt(item->handle, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)0);
+    curl_easy_setopt(item->handle, CURLOPT_HTTPHEADER, NULL);
+    free(url);
+    delta->state = DELTA_CONTROL;
+    item->delta = delta;
+    item->validate = VALIDATE_NONE;
+
+    return 0;
+}
+
+static void delta_part_header(Delta *delta, const char *line, size_t len)
+{
+    curl_off_t start, end;
+    char value[128];
+    size_t n;
+
+    if (len < 14 || strncasecmp(line, "Content-Range:", 14))
+        return;
+    n = MIN(len - 14, sizeof(value) - 1);
+    memcpy(value, line + 14, n);
+    value[n] = 0;
+    if (sscanf(value, " bytes %" CURL_FORMAT_CURL_OFF_T "-%" CURL_FORMAT_CURL_OFF_T, &start, &end) == 2 &&
+        start <= end && end < delta->length) {
+        delta->part_pos = start;
+        delta->part_end = end + 1;
+        delta->part_seen = 1;
+    }
+}
+
+static size_t delta_header(DownloadItem *item, const char *buffer, size_t len)
+{
+    Delta *delta = item->delta;
+
+    if (len > 5 && !strncmp(buffer, "HTTP/", 5)) {
+        const char *code = memchr(buffer, ' ', len);
+
+        delta->rcode = code ? atol(code + 1) : 0;
+        delta->multipart = delta->in_part = delta->part_seen = 0;
+        delta->part_pos = delta->part_end = 0;
+        delta->line_len = 0;
+    } else if (len > 13 && !strncasecmp(buffer, "Content-Type:", 13)) {
+        char value[64];
+        size_t n = MIN(len - 13, sizeof(value) - 1);
+
+        memcpy(value, buffer + 13, n);
+        value[n] = 0;
+        delta->multipart = !!strstr(value, "multipart/byteranges");
+    } else if (delta->state == DELTA_FETCH) {
+        delta_part_header(delta, buffer, len);
+        delta->in_part = delta->part_seen;
+    }
+
+    return len;
+}
+
+static size_t delta_write(DownloadItem *item, const char *ptr, size_t len)
+{
+    Delta *delta = item->delta;
+    size_t used = 0;
+
+    if (delta->rcode != 200 && delta->rcode != 206)
+        return len;
+
+    if (delta->state == DELTA_CONTROL) {
+        char *control;
+
+        if (delta->control_len + len > DELTA_MAX_CONTROL ||
+            !(control = realloc(delta->control, delta->control_len + len)))
+            return 0;
+        memcpy(control + delta->control_len, ptr, len);
+        delta->control = control;
+        delta->control_len += len;
+        return len;
+    }
+
+    /* a server ignoring the ranges sends it all */
+    if (delta->rcode == 200) {
+        delta->full = 1;
+        if (pwrite_all(delta->fd, ptr, len, delta->part_pos))
+            return 0;
+        delta->part_pos += len;
+        delta->fetched += len;
+        return len;
+    }
+
+    while (used < len) {
+        if (delta->in_part) {
+            size_t n = MIN((curl_off_t)(len - used), delta->part_end - delta->part_pos);
+
+            if (pwrite_all(delta->fd, ptr + used, n, delta->part_pos))
+                return 0;
+            delta->part_pos += n;
+            delta->fetched += n;
+            used += n;
+            if (delta->part_pos == delta->part_end)
+                delta->in_part = 0;
+        } else if (!delta->multipart) {
+            break;
+        } else {
+            /* between parts come a boundary line and part headers, the
+             * empty line after a Content-Range starts its data */
+            const char *eol = memchr(ptr + used, '\n', len - used);
+            size_t n = eol ? (size_t)(eol - (ptr + used)) + 1 : len - used;
+            size_t keep = MIN(n, sizeof(delta->line) - 1 - delta->line_len);
+
+            memcpy(delta->line + delta->line_len, ptr + used, keep);
+            delta->line_len += keep;
+            used += n;
+            if (!eol)
+                continue;
+            while (delta->line_len && (delta->line[delta->line_len - 1] == '\n' ||
+                                       delta->line[delta->line_len - 1] == '\r'))
+                delta->line_len--;
+            if (!delta->line_len && delta->part_seen) {
+                delta->in_part = 1;
+                delta->part_seen = 0;
+            } else {
+                delta_part_header(delta, delta->line, delta->line_len);
+            }
+            delta->line_len = 0;
+        }
+    }
+
+    return len;
+}
+
+/* the reader of a stream sees its end once it is closed, returns
+ * whether a write failed */
+static int close_output(DownloadItem *item)
+{
+    int error;
+
+    if (!item->outputfile)
+        return 0;
+
+    error = flush_writes(item);
+    if (item->stream == STREAM_PIPE) {
+        if (pclose(item->outputfile))
+            write_log(COLOR_PAIR(1), "Command %s failed.\n", item->outputfilename + 1);
+    } else {
+        fclose(item->outputfile);
+    }
+    item->outputfile = NULL;
+
+    return error;
+}
+
+static ItemHot *slot_hot(unsigned slot)
+{
+    return &hot_chunks[slot >> HOT_CHUNK_BITS]->hot[slot & (HOT_CHUNK_SIZE - 1)];
+}
+
+static DownloadItem *slot_item(unsigned slot)
+{
+    return hot_chunks[slot >> HOT_CHUNK_BITS]->item[slot & (HOT_CHUNK_SIZE - 1)];
+}
+
+static const char *sort_name(int key)
+{
+    static const char *const names[NB_SORTS] = { "none", "speed", "eta", "progress", "size", "host", "name" };
+
+    return names[key];
+}
+
+/* keys that transfers change while running */
+static int sort_dynamic(int key)
+{
+    return key == SORT_SPEED || key == SORT_ETA || key == SORT_PROGRESS || key == SORT_SIZE;
+}
+
+/* slowest, soonest done, furthest along and largest first */
+static double sort_value(unsigned slot)
+{
+    ItemHot *hot = slot_hot(slot);
+
+    switch (sort_key) {
+    case SORT_SPEED:    return hot->speed;
+    case SORT_ETA:      return hot->eta < 0 ? DBL_MAX : hot->eta;
+    case SORT_PROGRESS: return -hot->progress;
+    case SORT_SIZE:     return -(double)hot->total_size;
+    }
+    return 0;
+}
+
+static const char *url_host(const char *url)
+{
+    const char *host = strstr(url, "://");
+
+    return host ? host + 3 : url;
+}
+
+/* ties keep the order the items were added in */
+static int sort_cmp(unsigned a, unsigned b)
+{
+    DownloadItem *ia = slot_item(a), *ib = slot_item(b);
+    int c;
+
+    if (sort_key == SORT_HOST)
+        c = strcmp(url_host(ia->url), url_host(ib->url));
+    else if (sort_key == SORT_NAME)
+        c = strcmp(ia->outputfilename, ib->outputfilename);
+    else
+        c = (sort_nodes[a].key > sort_nodes[b].key) - (sort_nodes[a].key < sort_nodes[b].key);
+    if (sort_reverse)
+        c = -c;
+
+    return c ? c : (ia->order > ib->order) - (ia->order < ib->order);
+}
+
+static unsigned node_size(unsigned node)
+{
+    return node == NO_SLOT ? 0 : sort_nodes[node].size;
+}
+
+static void set_child(unsigned parent, unsigned old, unsigned node)
+{
+    if (parent == NO_SLOT)
+        sort_root = node;
+    else if (sort_nodes[parent].left == old)
+        sort_nodes[parent].left = node;
+    else
+        sort_nodes[parent].right = node;
+    if (node != NO_SLOT)
+        sort_nodes[node].parent = parent;
+}
+
+/* moves node above its parent, keeping the in-order sequence */
+static void rotate_up(unsigned node)
+{
+    SortNode *n = &sort_nodes[node];
+    unsigned parent = n->parent;
+    SortNode *p = &sort_nodes[parent];
+
+    set_child(p->parent, parent, node);
+    if (p->left == node) {
+        p->left = n->right;
+        if (n->right != NO_SLOT)
+            sort_nodes[n->right].parent = parent;
+        n->right = parent;
+    } else {
+        p->right = n->left;
+        if (n->left != NO_SLOT)
+            sort_nodes[n->left].parent = parent;
+        n->left = parent;
+    }
+    p->parent = node;
+    p->size = 1 + node_size(p->left) + node_size(p->right);
+    n->size = 1 + node_size(n->left) + node_size(n->right);
+}
+
+static int sort_insert(unsigned slot)
+{
+    unsigned parent = NO_SLOT, node = sort_root;
+    SortNode *n;
+    int c = 0;
+
+    if (slot >= sort_nodes_size) {
+        unsigned size = nb_hot_chunks * HOT_CHUNK_SIZE;
+        SortNode *nodes = realloc(sort_nodes, size * sizeof(*nodes));
+
+        if (!nodes)
+            return -1;
+        memset(nodes + sort_nodes_size, 0, (size - sort_nodes_size) * sizeof(*nodes));
+        sort_nodes = nodes;
+        sort_nodes_size = size;
+    }
+
+    n = &sort_nodes[slot];
+    n->key = sort_value(slot);
+    while (node != NO_SLOT) {
+        parent = node;
+        sort_nodes[node].size++;
+        c = sort_cmp(slot, node);
+        node = c < 0 ? sort_nodes[node].left : sort_nodes[node].right;
+    }
+
+    sort_seed ^= sort_seed << 13;
+    sort_seed ^= sort_seed >> 17;
+    sort_seed ^= sort_seed << 5;
+    n->priority = sort_seed;
+    n->left = n->right = NO_SLOT;
+    n->size = 1;
+    n->in_tree = 1;
+    n->parent = parent;
+    if (parent == NO_SLOT)
+        sort_root = slot;
+    else if (c < 0)
+        sort_nodes[parent].left = slot;
+    else
+        sort_nodes[parent].right = slot;
+
+    while (n->parent != NO_SLOT && sort_nodes[n->parent].priority < n->priority)
+        rotate_up(slot);
+
+    return 0;
+}
+
+static void sort_remove(unsigned slot)
+{
+    SortNode *n = &sort_nodes[slot];
+    unsigned parent;
+
+    /* rotated down until it is a leaf */
+    while (n->left != NO_SLOT || n->right != NO_SLOT) {
+        if (n->right == NO_SLOT ||
+            (n->left != NO_SLOT && sort_nodes[n->left].priority > sort_nodes[n->right].priority))
+            rotate_up(n->left);
+        else
+            rotate_up(n->right);
+    }
+
+    parent = n->parent;
+    set_child(parent, slot, NO_SLOT);
+    for (; parent != NO_SLOT; parent = sort_nodes[parent].parent)
+        sort_nodes[parent].size--;
+    n->in_tree = 0;
+}
+
+static unsigned sort_step(unsigned node, int backward)
+{
+    unsigned next = backward ? sort_nodes[node].left : sort_nodes[node].right;
+
+    if (next != NO_SLOT) {
+        for (node = next;; node = next) {
+            next = backward ? sort_nodes[node].right : sort_nodes[node].left;
+            if (next == NO_SLOT)
+                return node;
+        }
+    }
+
+    for (;;) {
+        unsigned parent = sort_nodes[node].parent;
+
+        if (parent == NO_SLOT)
+            return NO_SLOT;
+        if ((backward ? sort_nodes[parent].right : sort_nodes[parent].left) == node)
+            return parent;
+        node = parent;
+    }
+}
+
+static unsigned sort_edge(int last)
+{
+    unsigned node = sort_root;
+
+    while (node != NO_SLOT && (last ? sort_nodes[node].right : sort_nodes[node].left) != NO_SLOT)
+        node = last ? sort_nodes[node].right : sort_nodes[node].left;
+
+    return node;
+}
+
+static unsigned sort_rank(unsigned node)
+{
+    unsigned rank = node_size(sort_nodes[node].left);
+
+    for (unsigned parent = sort_nodes[node].parent; parent != NO_SLOT;
+         node = parent, parent = sort_nodes[node].parent) {
+        if (sort_nodes[parent].right == node)
+            rank += node_size(sort_nodes[parent].left) + 1;
+    }
+
+    return rank;
+}
+
+static unsigned sort_select(unsigned rank)
+{
+    unsigned node = sort_root;
+
+    while (node != NO_SLOT) {
+        unsigned left = node_size(sort_nodes[node].left);
+
+        if (rank == left)
+            break;
+        if (rank < left) {
+            node = sort_nodes[node].left;
+        } else {
+            rank -= left + 1;
+            node = sort_nodes[node].right;
+        }
+    }
+
+    return node;
+}
+
+/* Items whose place in a sorted view may have changed are queued for
+ * the UI thread, which moves them in the tree before drawing. */
+static void sort_mark(DownloadItem *item)
+{
+    pthread_mutex_lock(&ui_lock);
+    if (!item->sort_dirty) {
+        item->sort_dirty = 1;
+        item->sort_next = sort_dirty;
+        sort_dirty = item;
+    }
+    pthread_mutex_unlock(&ui_lock);
+}
+
+/* called by transfer threads when something shown of an item changed,
+ * queueing it and waking the UI under one lock */
+static void item_changed(DownloadItem *item)
+{
+    int wake;
+
+    pthread_mutex_lock(&ui_lock);
+    if (sort_dynamic(sort_key) && !item->sort_dirty) {
+        item->sort_dirty = 1;
+        item->sort_next = sort_dirty;
+        sort_dirty = item;
+    }
+    wake = ui_pipe[1] >= 0 && !ui_pending;
+    ui_pending = 1;
+    pthread_mutex_unlock(&ui_lock);
+
+    if (wake && write(ui_pipe[1], "", 1) < 0)
+        ui_pending = 0;
+}
+
+static int in_sort(DownloadItem *item)
+{
+    return item->slot < sort_nodes_size && sort_nodes[item->slot].in_tree;
+}
+
+static void update_sort()
+{
+    DownloadItem *item;
+
+    if (!sort_key || !sort_dirty)
+        return;
+
+    /* held throughout, as a transfer may queue an item again as soon as
+     * it is taken off the list */
+    pthread_mutex_lock(&ui_lock);
+    for (item = sort_dirty; item; item = item->sort_next) {
+        item->sort_dirty = 0;
+        if (in_sort(item))
+            sort_remove(item->slot);
+        sort_insert(item->slot);
+    }
+    sort_dirty = NULL;
+    pthread_mutex_unlock(&ui_lock);
+}
+
+static void sort_forget(DownloadItem *item)
+{
+    if (item->sort_dirty) {
+        pthread_mutex_lock(&ui_lock);
+        for (DownloadItem **p = &sort_dirty; *p; p = &(*p)->sort_next) {
+            if (*p == item) {
+                *p = item->sort_next;
+                break;
+            }
+        }
+        item->sort_dirty = 0;
+        pthread_mutex_unlock(&ui_lock);
+    }
+    if (sort_key && in_sort(item))
+        sort_remove(item->slot);
+}
+
+static void set_sort(int key, int reverse)
+{
+    pthread_mutex_lock(&ui_lock);
+    for (DownloadItem *i = sort_dirty; i; i = i->sort_next)
+        i->sort_dirty = 0;
+    sort_dirty = NULL;
+    sort_key = key;
+    sort_reverse = reverse;
+    pthread_mutex_unlock(&ui_lock);
+
+    for (unsigned i = 0; i < sort_nodes_size; i++)
+        sort_nodes[i].in_tree = 0;
+    sort_root = NO_SLOT;
+    if (!sort_key)
+        return;
+
+    for (unsigned i = 0; i < nb_order; i++) {
+        if (item_order[i] != NO_SLOT)
+            sort_insert(item_order[i]);
+    }
+}
+
+/* Drops the holes left by deleted items from the display order. */
+static void compact_order()
+{
+    unsigned i, n = 0;
+
+    for (i = 0; i < nb_order; i++) {
+        if (item_order[i] == NO_SLOT)
+            continue;
+        item_order[n] = item_order[i];
+        slot_item(item_order[n])->order = n;
+        n++;
+    }
+    nb_order = n;
+    nb_order_stale = 0;
+}
+
+/* Allocates an item with its hot record, placed last in display order as
+ * items are only ever appended to the list. */
+static DownloadItem *new_item()
+{
+    DownloadItem *item;
+    unsigned slot;
+
+    if (nb_order == order_size && nb_order_stale)
+        compact_order();
+    if (nb_order == order_size) {
+        unsigned size = MAX(1024, order_size * 2);
+        unsigned *order = realloc(item_order, size * sizeof(*order));
+
+        if (!order)
+            return NULL;
+        item_order = order;
+        order_size = size;
+    }
+
+    if (!nb_free_slots && nb_slots == nb_hot_chunks * HOT_CHUNK_SIZE) {
+        HotChunk **chunks = realloc(hot_chunks, (nb_hot_chunks + 1) * sizeof(*chunks));
+        unsigned *slots;
+
+        if (!chunks)
+            return NULL;
+        hot_chunks = chunks;
+        slots = realloc(free_slots, (nb_hot_chunks + 1) * HOT_CHUNK_SIZE * sizeof(*slots));
+        if (!slots)
+            return NULL;
+        free_slots = slots;
+        hot_chunks[nb_hot_chunks] = malloc(sizeof(HotChunk));
+        if (!hot_chunks[nb_hot_chunks])
+            return NULL;
+        nb_hot_chunks++;
+    }
+
+    if (!item_pool.size)
+        init_pool(&item_pool, sizeof(DownloadItem));
+    item = pool_alloc(&item_pool);
+    if (!item)
+        return NULL;
+
+    slot = nb_free_slots ? free_slots[--nb_free_slots] : nb_slots++;
+    item->slot = slot;
+    item->hot = slot_hot(slot);
+    memset(item->hot, 0, sizeof(*item->hot));
+    hot_chunks[slot >> HOT_CHUNK_BITS]->item[slot & (HOT_CHUNK_SIZE - 1)] = item;
+    item->order = nb_order;
+    item_order[nb_order++] = slot;
+
+    return item;
+}
+
+static void free_item(DownloadItem *item)
+{
+    sort_forget(item);
+    hot_chunks[item->slot >> HOT_CHUNK_BITS]->item[item->slot & (HOT_CHUNK_SIZE - 1)] = NULL;
+    free_slots[nb_free_slots++] = item->slot;
+    item_order[item->order] = NO_SLOT;
+    nb_order_stale++;
+    pool_free(&item_pool, item);
+
+    if (nb_order_stale > nb_order / 2)
+        compact_order();
+}
+
+static void free_hot()
+{
+    for (unsigned i = 0; i < nb_hot_chunks; i++)
+        free(hot_chunks[i]);
+    free(hot_chunks);
+    free(free_slots);
+    free(item_order);
+    free(sort_nodes);
+    free_pool(&item_pool);
+    hot_chunks = NULL;
+    sort_nodes = NULL;
+    sort_nodes_size = 0;
+    sort_root = NO_SLOT;
+    sort_dirty = NULL;
+    free_slots = item_order = NULL;
+    nb_hot_chunks = nb_slots = nb_free_slots = 0;
+    nb_order = order_size = nb_order_stale = 0;
+}
+
+/* Returns the next item after from in display order, or before it going
+ * backward, shown in the current mode. Without from the walk starts at
+ * the first or the last item. Only hot records are read on the way. */
+static DownloadItem *step_item(DownloadItem *from, int backward)
+{
+    unsigned i = from ? from->order : backward ? nb_order : NO_SLOT;
+
+    if (sort_key) {
+        unsigned slot = from && in_sort(from) ? sort_step(from->slot, backward) : sort_edge(backward);
+
+        while (slot != NO_SLOT && current_mode && slot_hot(slot)->mode != current_mode)
+            slot = sort_step(slot, backward);
+
+        return slot == NO_SLOT ? NULL : slot_item(slot);
+    }
+
+    for (;;) {
+        unsigned slot;
+
+        if (backward ? i-- == 0 : ++i >= nb_order)
+            return NULL;
+        slot = item_order[i];
+        if (slot != NO_SLOT && (!current_mode || slot_hot(slot)->mode == current_mode))
+            return slot_item(slot);
+    }
+}
+
+/* Returns the number of items shown before item. */
+static unsigned view_rank(DownloadItem *item)
+{
+    unsigned rank = 0;
+
+    if (sort_key && !current_mode && in_sort(item))
+        return sort_rank(item->slot);
+
+    if (sort_key) {
+        for (DownloadItem *i = step_item(NULL, 0); i && i != item; i = step_item(i, 0))
+            rank++;
+        return rank;
+    }
+
+    for (unsigned i = 0; i < item->order; i++) {
+        unsigned slot = item_order[i];
+
+        rank += slot != NO_SLOT && (!current_mode || slot_hot(slot)->mode == current_mode);
+    }
+
+    return rank;
+}
+
+/* Returns the item shown at rank, or NULL past the last one. */
+static DownloadItem *view_select(unsigned rank)
+{
+    DownloadItem *item;
+
+    if (sort_key && !current_mode) {
+        unsigned slot = sort_select(rank);
+
+        return slot == NO_SLOT ? NULL : slot_item(slot);
+    }
+
+    for (item = step_item(NULL, 0); item && rank; item = step_item(item, 0))
+        rank--;
+
+    return item;
+}
+
+/* Like search_from, in the order items are shown. The index only knows
+ * the order they were added in, so a sorted list is walked instead. */
+static DownloadItem *search_view(const char *s, DownloadItem *from, int backward)
+{
+    if (!sort_key)
+        return search_from(s, from, backward);
+
+    for (; from; from = step_item(from, backward)) {
+        if (item_matches(from, s))
+            return from;
+    }
+
+    return NULL;
+}
+
+static void unlink_sampled(DownloadItem *item)
+{
+    if (!item->sampling)
+        return;
+    if (item->sample_prev)
+        item->sample_prev->sample_next = item->sample_next;
+    else
+        sampled_items = item->sample_next;
+    if (item->sample_next)
+        item->sample_next->sample_prev = item->sample_prev;
+    item->sample_prev = item->sample_next = NULL;
+    item->sampling = 0;
+}
+
+static void free_probe(DownloadItem *item)
+{
+    if (!item->probe)
+        return;
+    free(item->probe->etag);
+    free(item->probe->last_modified);
+    free(item->probe->location);
+    free(item->probe);
+    item->probe = NULL;
+}
+
+static void unqueue_probe(DownloadItem *item)
+{
+    if (!item->probe_queued)
+        return;
+    if (item->probe_qprev)
+        item->probe_qprev->probe_qnext = item->probe_qnext;
+    else
+        probe_queue = item->probe_qnext;
+    if (item->probe_qnext)
+        item->probe_qnext->probe_qprev = item->probe_qprev;
+    else
+        probe_queue_tail = item->probe_qprev;
+    item->probe_qprev = item->probe_qnext = NULL;
+    item->probe_queued = 0;
+}
+
+/* Items wait for their probe in the order they were paused. What an
+ * earlier probe found may be stale by then, so it is done again. */
+static void queue_probe(DownloadItem *item)
+{
+    if (item->probe_queued || item->probe_state == PROBE_RUNNING)
+        return;
+    free_probe(item);
+    item->probe_state = PROBE_NONE;
+    item->probe_qprev = probe_queue_tail;
+    if (probe_queue_tail)
+        probe_queue_tail->probe_qnext = item;
+    else
+        probe_queue = item;
+    probe_queue_tail = item;
+    item->probe_queued = 1;
+}
+
+/* a probe taken out of its shard is dropped, also when it is done but
+ * not yet taken over */
+static void cancel_probe(DownloadItem *item)
+{
+    pthread_mutex_lock(&listing_lock);
+    for (DownloadItem **p = &probed_items; *p; p = &(*p)->probe_next) {
+        if (*p == item) {
+            *p = item->probe_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&listing_lock);
+
+    curl_easy_setopt(item->handle, CURLOPT_NOBODY, 0L);
+    curl_easy_setopt(item->handle, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(item->handle, CURLOPT_NOPROGRESS, 0L);
+    free_probe(item);
+    item->probe_state = PROBE_NONE;
+    nb_probing--;
+}
+
+/* The counts of items in each mode are changed by shards too, so they
+ * are only changed under queue_lock. MODE_ALL counts nothing. */
+static int *mode_count(int mode)
+{
+    static int none;
+
+    if (mode == MODE_INACTIVE)
+        return &inactive_downloads;
+    if (mode == MODE_PAUSED)
+        return &paused_downloads;
+    if (mode == MODE_ACTIVE)
+        return &active_downloads;
+    if (mode == MODE_FINISHED)
+        return &finished_downloads;
+
+    return &none;
+}
+
+static void set_mode(DownloadItem *item, int mode)
+{
+    pthread_mutex_lock(&queue_lock);
+    (*mode_count(item->hot->mode))--;
+    (*mode_count(mode))++;
+    item->hot->mode = mode;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static DownloadItem* delete_ditem(DownloadItem *ditem)
+{
+    for (int i = 0; i < NB_MODES; i++) {
+        if (ditem == sitem[i])
+            sitem[i] = NULL;
+    }
+    nb_ditems--;
 
-    if (ditem->mode == MODE_INACTIVE) {
-        inactive_downloads--;
-    } else if (ditem->mode == MODE_PAUSED) {
-        paused_downloads--;
-    } else if (ditem->mode == MODE_ACTIVE) {
-        active_downloads--;
-    } else if (ditem->mode == MODE_FINISHED) {
-        finished_downloads--;
+    if (ditem->handle) {
+        detach_item(ditem);
+        if (ditem->probe_state == PROBE_RUNNING)
+            cancel_probe(ditem);
+        drop_write_pause(ditem);
+        curl_easy_cleanup(ditem->handle);
     }
+    free_probe(ditem);
+    unqueue_probe(ditem);
+    free_delta(ditem);
+    unlink_sampled(ditem);
+    pool_free(&history_pool, ditem->history);
+    unmap_item(ditem);
+    flush_writes(ditem);
+    free_decoder(ditem);
+
+    session_delete(ditem);
+    remove_url(ditem);
+    unindex_item(ditem);
+    if (ditem == search_origin)
+        search_origin = NULL;
+    if (ditem == stdout_item)
+        stdout_item = NULL;
+
+    close_output(ditem);
+
+    free_chunks(&ditem->strings);
+    free(ditem->etag);
+    free(ditem->last_modified);
+    free(ditem->link_buf);
+    free(ditem->effective_url);
+    free(ditem->contenttype);
+    free(ditem->primary_ip);
+    curl_slist_free_all(ditem->validators);
+
+    pthread_mutex_lock(&queue_lock);
+    (*mode_count(ditem->hot->mode))--;
+    pthread_mutex_unlock(&queue_lock);
 
     if (ditem->prev && ditem->next) {
         DownloadItem *old = ditem;
@@ -205,25 +4480,13 @@ static DownloadItem* delete_ditem(DownloadItem *ditem)
         old->next->prev = ditem;
         ditem = ditem->next;
 
-        if (current_mode) {
-            DownloadItem *temp = ditem;
-
-            for (; ditem; ditem = ditem->next) {
-                if (ditem->mode == current_mode)
-                    break;
-            }
-
-            if (!ditem) {
-                ditem = temp;
-
-                for (; ditem; ditem = ditem->prev) {
-                    if (ditem->mode == current_mode)
-                        break;
-                }
-            }
+        if (current_mode || sort_key) {
+            ditem = step_item(old, 0);
+            if (!ditem)
+                ditem = step_item(old, 1);
         }
 
-        free(old);
+        free_item(old);
     } else if (ditem->next) {
         DownloadItem *old;
 
@@ -231,14 +4494,13 @@ static DownloadItem* delete_ditem(DownloadItem *ditem)
         items = ditem = ditem->next;
         ditem->prev = NULL;
 
-        if (current_mode) {
-            for (; ditem; ditem = ditem->next) {
-                if (ditem->mode == current_mode)
-                    break;
-            }
+        if (current_mode || sort_key) {
+            ditem = step_item(old, 0);
+            if (!ditem)
+                ditem = step_item(old, 1);
         }
 
-        free(old);
+        free_item(old);
     } else if (ditem->prev) {
         DownloadItem *old;
 
@@ -246,16 +4508,15 @@ static DownloadItem* delete_ditem(DownloadItem *ditem)
         ditem = items_tail = ditem->prev;
         ditem->next = NULL;
 
-        if (current_mode) {
-            for (; ditem; ditem = ditem->prev) {
-                if (ditem->mode == current_mode)
-                    break;
-            }
+        if (current_mode || sort_key) {
+            ditem = step_item(old, 1);
+            if (!ditem)
+                ditem = step_item(old, 0);
         }
 
-        free(old);
+        free_item(old);
     } else {
-        free(ditem);
+        free_item(ditem);
         items = ditem = items_tail = NULL;
         nb_ditems = 0;
     }
@@ -302,50 +4563,522 @@ static void write_helpwin()
     mvwaddstr(helpwin, i++, 0, " N - repeat last search backward ");
     mvwaddstr(helpwin, i++, 0, " UP/DOWN - select download ");
     mvwaddstr(helpwin, i++, 0, " LEFT/RIGHT - decrease/increase download speed ");
+    mvwaddstr(helpwin, i++, 0, " -/+ - decrease/increase download priority ");
+    mvwaddstr(helpwin, i++, 0, " o - sort by speed, ETA, progress, size, host, name or not at all ");
+    mvwaddstr(helpwin, i++, 0, " O - reverse sort order ");
     mvwaddstr(helpwin, i++, 0, " Q - quit ");
     wnoutrefresh(helpwin);
 }
 
+static const char *http_version_name(long version)
+{
+    switch (version) {
+    case CURL_HTTP_VERSION_1_0: return "1.0";
+    case CURL_HTTP_VERSION_1_1: return "1.1";
+    case CURL_HTTP_VERSION_2_0: return "2";
+    case CURL_HTTP_VERSION_3:   return "3";
+    }
+
+    return "none";
+}
+
+static void push_sample(History *history, curl_off_t rate)
+{
+    history->rate[history->pos] = rate;
+    history->pos = (history->pos + 1) % HISTORY_SIZE;
+    history->nb = MIN(history->nb + 1, HISTORY_SIZE);
+}
+
+static curl_off_t get_sample(const History *history, unsigned age)
+{
+    return history->rate[(history->pos + HISTORY_SIZE - 1 - age) % HISTORY_SIZE];
+}
+
+/* Once a second the bytes every started item got since the last sample
+ * are added to its history and to the session's, and the ones no longer
+ * active leave the list after that last sample. The session rate over
+ * the last RATE_WINDOW samples gives the ETA of what is still to come
+ * of the active items. */
+static void sample_history()
+{
+    time_t now = time(NULL);
+    curl_off_t total = 0, remaining = 0;
+    long elapsed;
+
+    if (now == history_time)
+        return;
+    elapsed = history_time ? now - history_time : 1;
+    history_time = now;
+
+    for (DownloadItem *item = sampled_items, *next; item; item = next) {
+        ItemHot *hot = item->hot;
+        curl_off_t bytes;
+
+        next = item->sample_next;
+        /* a restart starts over from less */
+        bytes = MAX(hot->done - item->sampled, 0);
+        item->sampled = hot->done;
+        push_sample(item->history, bytes / elapsed);
+        total += bytes;
+        if (hot->mode != MODE_ACTIVE)
+            unlink_sampled(item);
+        else if (hot->total_size > hot->done)
+            remaining += hot->total_size - hot->done;
+    }
+
+    if (session_history.nb >= RATE_WINDOW)
+        session_window -= get_sample(&session_history, RATE_WINDOW - 1);
+    push_sample(&session_history, total / elapsed);
+    session_window += total / elapsed;
+    session_rate = session_window / MIN(session_history.nb, RATE_WINDOW);
+    session_eta = session_rate ? remaining / session_rate : -1;
+}
+
+/* newest sample on the right, scaled to the highest one shown */
+static void write_sparkline(WINDOW *win, const History *history, int width)
+{
+    static const char *const blocks[] = {
+        " ", "\u2581", "\u2582", "\u2583", "\u2584", "\u2585", "\u2586", "\u2587", "\u2588"
+    };
+    static const char *const ascii[] = { " ", "_", ".", "-", ":", "=", "+", "*", "#" };
+    const char *const *levels = MB_CUR_MAX > 1 ? blocks : ascii;
+    int nb = MIN((int)history->nb, width);
+    curl_off_t max = 0;
+
+    for (int age = 0; age < nb; age++)
+        max = MAX(max, get_sample(history, age));
+
+    for (int age = nb - 1; age >= 0; age--) {
+        curl_off_t rate = get_sample(history, age);
+
+        waddstr(win, levels[rate ? 1 + rate * 7 / max : 0]);
+    }
+    wprintw(win, " %" CURL_FORMAT_CURL_OFF_T "KB/s max ", max / 1024);
+}
+
 static void write_infowin(DownloadItem *sitem)
 {
-    int i = 0;
+    unsigned long sock_updates = 0, sock_updates_avoided = 0;
+    int i = 0, nb_socks = 0;
 
     if (!sitem)
         return;
 
-    curl_easy_getinfo(sitem->handle, CURLINFO_EFFECTIVE_URL, &sitem->effective_url);
-    curl_easy_getinfo(sitem->handle, CURLINFO_RESPONSE_CODE, &sitem->rcode);
-    curl_easy_getinfo(sitem->handle, CURLINFO_SCHEME, &sitem->protocol);
-    curl_easy_getinfo(sitem->handle, CURLINFO_CONTENT_TYPE, &sitem->contenttype);
-    curl_easy_getinfo(sitem->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &sitem->contentlength);
-    curl_easy_getinfo(sitem->handle, CURLINFO_SIZE_DOWNLOAD_T, &sitem->download_size);
-    curl_easy_getinfo(sitem->handle, CURLINFO_PRIMARY_IP, &sitem->primary_ip);
-    curl_easy_getinfo(sitem->handle, CURLINFO_PRIMARY_PORT, &sitem->primary_port);
-
+    /* the transfer's details are published by its shard */
+    pthread_mutex_lock(&ui_lock);
     wattrset(infowin, COLOR_PAIR(7));
     mvwprintw(infowin, i++, 0, " Filename: %.*s ", COLS, sitem->outputfilename);
     mvwprintw(infowin, i++, 0, " URL: %.*s ", COLS, sitem->url);
     mvwprintw(infowin, i++, 0, " Effective URL: %.*s ", COLS, sitem->effective_url);
-    mvwprintw(infowin, i++, 0, " Current download speed: %ldB/s ", sitem->speed);
+    mvwprintw(infowin, i++, 0, " Current download speed: %ldB/s ", sitem->hot->speed);
     mvwprintw(infowin, i++, 0, " Max allowed download speed: %ldB/s ", sitem->max_speed);
     mvwprintw(infowin, i++, 0, " Response code: %ld ", sitem->rcode);
     mvwprintw(infowin, i++, 0, " Content-type: %s ", sitem->contenttype);
     mvwprintw(infowin, i++, 0, " Content-length: %ld ", sitem->contentlength);
     mvwprintw(infowin, i++, 0, " Download size:  %ld ", sitem->download_size);
     mvwprintw(infowin, i++, 0, " Download time: %ld ", sitem->start_time ? ((sitem->end_time ? sitem->end_time : time(NULL)) - sitem->start_time) : 0);
-    mvwprintw(infowin, i++, 0, " ETA: %ld ", sitem->eta);
+    mvwprintw(infowin, i++, 0, " Timing: DNS %.1fms, connect %.1fms, TLS %.1fms, request %.1fms ",
+              phase_time(sitem, TIMING_NAMELOOKUP) / 1000., phase_time(sitem, TIMING_CONNECT) / 1000.,
+              phase_time(sitem, TIMING_APPCONNECT) / 1000., phase_time(sitem, TIMING_PRETRANSFER) / 1000.);
+    mvwprintw(infowin, i++, 0, " First byte after: %.1fms, total: %.3fs, redirects: %ld ",
+              phase_time(sitem, TIMING_STARTTRANSFER) / 1000., phase_time(sitem, TIMING_TOTAL) / 1000000.,
+              sitem->redirects);
+    mvwprintw(infowin, i++, 0, " ETA: %ld ", sitem->hot->eta);
+    if (sitem->history) {
+        mvwprintw(infowin, i++, 0, " Speed history: ");
+        write_sparkline(infowin, sitem->history, COLS - 35);
+    }
+    mvwprintw(infowin, i++, 0, " Session speed: ");
+    write_sparkline(infowin, &session_history, COLS - 35);
     mvwprintw(infowin, i++, 0, " Primary IP: %s ", sitem->primary_ip);
     mvwprintw(infowin, i++, 0, " Primary port: %ld ", sitem->primary_port);
     mvwprintw(infowin, i++, 0, " Used Protocol: %s ", sitem->protocol);
+    mvwprintw(infowin, i++, 0, " HTTP version: %s ", http_version_name(sitem->http_version));
+    if (sitem->hot->mode == MODE_ACTIVE && sitem->conn_id >= 0)
+        mvwprintw(infowin, i++, 0, " Connection: #%ld ", (long)sitem->conn_id);
+    else
+        mvwprintw(infowin, i++, 0, " Connection: none ");
+    pthread_mutex_unlock(&ui_lock);
+    mvwprintw(infowin, i++, 0, " Priority: %d ", sitem->priority);
+    if (sitem->uplink)
+        mvwprintw(infowin, i++, 0, " Interface: %s ", uplinks[sitem->uplink - 1].name);
+    if (sitem->listing)
+        mvwprintw(infowin, i++, 0, " Listed: %u files ", sitem->nb_entries);
+    /* what the shards published last, they count without a lock */
+    pthread_mutex_lock(&queue_lock);
+    for (int j = 0; j < nb_shards && shards; j++) {
+        nb_socks += shards[j].nb_socks_seen;
+        sock_updates += shards[j].sock_updates_seen;
+        sock_updates_avoided += shards[j].sock_updates_avoided_seen;
+    }
+    mvwprintw(infowin, i++, 0, " Sockets: %d, event updates: %lu, unchanged: %lu ",
+              nb_socks, sock_updates, sock_updates_avoided);
+    if (nb_shards > 1 && shards) {
+        mvwprintw(infowin, i++, 0, " Transfer threads: %d, running:", nb_shards);
+        for (int j = 0; j < nb_shards; j++)
+            wprintw(infowin, " %d/%d", shards[j].running, shards[j].nb_queued);
+        wprintw(infowin, ", stolen:");
+        for (int j = 0; j < nb_shards; j++)
+            wprintw(infowin, " %lu", shards[j].nb_stolen);
+        wprintw(infowin, " ");
+    }
+    pthread_mutex_unlock(&queue_lock);
+    if (sitem->probe_state == PROBE_RUNNING) {
+        mvwprintw(infowin, i++, 0, " Pre-flight: running ");
+    } else if (sitem->probe) {
+        mvwprintw(infowin, i++, 0, " Pre-flight: %" CURL_FORMAT_CURL_OFF_T " bytes, %s ranges%s ",
+                  sitem->probe->size, sitem->probe->ranges ? "accepts" : "no",
+                  sitem->probe->changed ? ", changed" : "");
+        if (sitem->probe->location)
+            mvwprintw(infowin, i++, 0, " Redirected to: %s ", sitem->probe->location);
+    }
 
     wnoutrefresh(infowin);
 }
 
+/* Listings run on the transfer threads, while the download list belongs
+ * to the UI thread, or the first shard when headless. Found URLs are
+ * handed over through listed_urls and become items in add_listed(). */
+static ListedUrl *new_listed(const char *url, size_t len)
+{
+    ListedUrl *listed = calloc(1, sizeof(*listed));
+
+    if (!listed || !(listed->url = clonestring(url, len))) {
+        free(listed);
+        write_log(COLOR_PAIR(1), "Failed to allocate listed URL\n");
+        return NULL;
+    }
+    listed->priority = DEFAULT_PRIORITY;
+
+    return listed;
+}
+
+static void queue_listed(ListedUrl *listed)
+{
+    int wake;
+
+    pthread_mutex_lock(&listing_lock);
+    wake = !listed_urls;
+    if (listed_tail)
+        listed_tail->next = listed;
+    else
+        listed_urls = listed;
+    listed_tail = listed;
+    nb_listed++;
+    pthread_mutex_unlock(&listing_lock);
+
+    if (wake && headless)
+        wake_shard(&shards[0]);
+    else if (wake)
+        wakeup_ui();
+}
+
+static void push_listed(DownloadItem *from, const char *url, size_t len)
+{
+    ListedUrl *listed = new_listed(url, len);
+
+    if (!listed)
+        return;
+    if (from->listing == LISTING_INDEX)
+        listed->referer = clonestring(from->escape_url, strlen(from->escape_url));
+    listed->speed = from->max_speed;
+    listed->priority = from->priority;
+    from->nb_entries++;
+    queue_listed(listed);
+}
+
+/* files matched by an FTP wildcard are not transferred by the listing
+ * itself but queued as items of their own */
+static long list_chunk_bgn(const void *transfer_info, void *ptr, int remains)
+{
+    const struct curl_fileinfo *info = transfer_info;
+    DownloadItem *item = ptr;
+    char *escape, *url;
+    size_t dirlen;
+    (void)remains;
+
+    if (info->filetype != CURLFILETYPE_FILE && info->filetype != CURLFILETYPE_SYMLINK)
+        return CURL_CHUNK_BGN_FUNC_SKIP;
+
+    escape = curl_easy_escape(NULL, info->filename, 0);
+    dirlen = strrchr(item->url, '/') + 1 - item->url;
+    url = escape ? malloc(dirlen + strlen(escape) + 1) : NULL;
+    if (url) {
+        sprintf(url, "%.*s%s", (int)dirlen, item->url, escape);
+        push_listed(item, url, strlen(url));
+    }
+    free(url);
+    curl_free(escape);
+
+    return CURL_CHUNK_BGN_FUNC_SKIP;
+}
+
+static long list_chunk_end(void *ptr)
+{
+    (void)ptr;
+
+    return CURL_CHUNK_END_FUNC_OK;
+}
+
+/* only files directly in the listed directory are taken, links up,
+ * into subdirectories or to other sites are not followed */
+static void add_link(DownloadItem *item, const char *link, size_t len)
+{
+    const char *dir = item->escape_url;
+    size_t dirlen = strlen(dir);
+    char url[MAX_STRING_LEN];
+    char *unescape;
+    int n;
+
+    if (len > 2 && !strncmp(link, "./", 2)) {
+        link += 2;
+        len -= 2;
+    }
+    if (!len || memchr(link, '?', len) || memchr(link, '#', len))
+        return;
+
+    n = snprintf(url, sizeof(url), "%.*s", (int)len, link);
+    if (!strstr(url, "://") && link[0] == '/') {
+        const char *path = strchr(strstr(dir, "://") + 3, '/');
+
+        n = snprintf(url, sizeof(url), "%.*s%.*s", (int)(path - dir), dir, (int)len, link);
+    } else if (!strstr(url, "://")) {
+        n = snprintf(url, sizeof(url), "%s%.*s", dir, (int)len, link);
+    }
+    if (n <= (int)dirlen || n >= (int)sizeof(url) || strncmp(url, dir, dirlen) ||
+        strchr(url + dirlen, '/') || !strcmp(url + dirlen, ".."))
+        return;
+
+    if (item->pattern) {
+        int match;
+
+        unescape = curl_easy_unescape(NULL, url + dirlen, 0, NULL);
+        match = unescape && !fnmatch(item->pattern, unescape, 0);
+        curl_free(unescape);
+        if (!match)
+            return;
+    }
+
+    push_listed(item, url, n);
+}
+
+/* index pages arrive in pieces, an href cut by a piece boundary is kept
+ * in link_buf until the rest comes */
+static size_t list_links(DownloadItem *item, const char *ptr, size_t len)
+{
+    char *buf = realloc(item->link_buf, item->link_len + len);
+    const char *p, *end;
+
+    if (!buf)
+        return 0;
+    memcpy(buf + item->link_len, ptr, len);
+    item->link_buf = buf;
+    p = buf;
+    end = buf + item->link_len + len;
+
+    for (;;) {
+        const char *q, *link = NULL;
+        char quote = 0;
+
+        while (end - p >= 4 && strncasecmp(p, "href", 4))
+            p++;
+        if (end - p < 4)
+            break;
+
+        q = p + 4;
+        while (q < end && isspace((unsigned char)*q))
+            q++;
+        if (q < end && *q != '=') {
+            p = q;
+            continue;
+        }
+        if (q < end) {
+            q++;
+            while (q < end && isspace((unsigned char)*q))
+                q++;
+            if (q < end && (*q == '"' || *q == '\''))
+                quote = *q++;
+            link = q;
+            while (q < end && (quote ? *q != quote : !isspace((unsigned char)*q) && *q != '>'))
+                q++;
+        }
+        if (q >= end) {
+            if (end - p > MAX_LINK_LEN)
+                p = end;
+            break;
+        }
+
+        add_link(item, link, q - link);
+        p = q;
+    }
+
+    item->link_len = end - p;
+    memmove(item->link_buf, p, item->link_len);
+
+    return len;
+}
+
+static size_t write_map(DownloadItem *item, const char *ptr, size_t len)
+{
+    size_t written = 0;
+
+    while (written < len && item->map_pos < item->map_size) {
+        size_t n;
+
+        if (!item->map || item->map_pos >= item->map_start + (curl_off_t)item->map_len) {
+            if (map_window(item, item->map_pos)) {
+                drop_mapping(item, item->map_pos - written);
+                break;
+            }
+        }
+
+        n = MIN(len - written, item->map_start + item->map_len - item->map_pos);
+        memcpy(item->map + (item->map_pos - item->map_start), ptr + written, n);
+        item->map_pos += n;
+        written += n;
+    }
+
+    if (item->map_pos - item->map_synced >= MAP_SYNC_SIZE)
+        sync_output(item);
+
+    return written;
+}
+
 static size_t write_data(void *ptr, size_t size, size_t nmemb, void *ourptr)
 {
-    FILE *outfile = ourptr;
+    DownloadItem *item = ourptr;
+
+    if (trace_sampled())
+        trace_event(TRACE_WRITE, item->id, size * nmemb, 0);
+    if (item->uplink)
+        item->shard->uplink_bytes[item->uplink - 1] += size * nmemb;
+    if (item->delta)
+        return delta_write(item, ptr, size * nmemb);
+    if (item->listing)
+        return item->listing == LISTING_INDEX ? list_links(item, ptr, size * nmemb) : size * nmemb;
+    if (item->validate)
+        return size * nmemb;
+    if (map_output && !item->stream && item->map_state == MAPPING_UNKNOWN)
+        map_item(item);
+    if (item->map_state == MAPPING_ACTIVE) {
+        size_t written = write_map(item, ptr, size * nmemb);
+
+        /* else the whole chunk is written again below */
+        if (item->map_state == MAPPING_ACTIVE)
+            return decode_written(item, ptr, written);
+    }
+    if (writers_started)
+        return queue_write(item, ptr, size * nmemb);
+
+    if (fwrite(ptr, size, nmemb, item->outputfile) < nmemb) {
+        pthread_mutex_lock(&write_lock);
+        item->write_error = 1;
+        pthread_mutex_unlock(&write_lock);
+        return 0;
+    }
+    item->write_pos += size * nmemb;
+
+    return decode_written(item, ptr, size * nmemb) / size;
+}
+
+static void set_header_value(char **value, const char *buffer, size_t len)
+{
+    while (len > 0 && (*buffer == ' ' || *buffer == '\t')) {
+        buffer++;
+        len--;
+    }
+    while (len > 0 && (buffer[len - 1] == '\r' || buffer[len - 1] == '\n' || buffer[len - 1] == ' '))
+        len--;
+
+    free(*value);
+    *value = clonestring(buffer, len);
+}
+
+/* the stored copy changed or the server ignored the range, start over
+ * instead of appending to it */
+static void restart_output(DownloadItem *item)
+{
+    fflush(item->outputfile);
+    if (ftruncate(fileno(item->outputfile), 0))
+        write_log(COLOR_PAIR(1), "Failed to truncate %s\n", item->outputfilename);
+    fseek(item->outputfile, 0, SEEK_END);
+    item->write_pos = item->hot->downloaded = 0;
+    item->hot->done = item->hot->total_size = 0;
+    item_changed(item);
+    if (item->decoder)
+        decode_existing(item, 0);
+    write_log(COLOR_PAIR(3), "Downloading %s again from the start.\n", item->outputfilename);
+}
+
+/* validators seen by a probe are kept apart, the stored ones belong to
+ * what was downloaded already */
+static void probe_header(Probe *probe, const char *buffer, size_t len)
+{
+    if (len > 5 && !strncmp(buffer, "HTTP/", 5)) {
+        free(probe->etag);
+        free(probe->last_modified);
+        probe->etag = probe->last_modified = NULL;
+        probe->ranges = 0;
+    } else if (len > 5 && !strncasecmp(buffer, "ETag:", 5)) {
+        set_header_value(&probe->etag, buffer + 5, len - 5);
+    } else if (len > 14 && !strncasecmp(buffer, "Last-Modified:", 14)) {
+        set_header_value(&probe->last_modified, buffer + 14, len - 14);
+    } else if (len > 14 && !strncasecmp(buffer, "Accept-Ranges:", 14)) {
+        char *value = NULL;
+
+        set_header_value(&value, buffer + 14, len - 14);
+        probe->ranges = value && !strcasecmp(value, "bytes");
+        free(value);
+    }
+}
+
+static size_t header_data(char *buffer, size_t size, size_t nitems, void *userp)
+{
+    DownloadItem *item = userp;
+    size_t len = size * nitems;
+
+    if (item->probe_state == PROBE_RUNNING) {
+        probe_header(item->probe, buffer, len);
+        return len;
+    }
+
+    /* the empty line ending a response's headers */
+    if (len <= 2 && (buffer[0] == '\r' || buffer[0] == '\n'))
+        publish_info(item);
+
+    /* only the ranges of the new version carry its validators */
+    if (item->delta) {
+        delta_header(item, buffer, len);
+        if (item->delta->state != DELTA_FETCH || (len > 5 && !strncmp(buffer, "HTTP/", 5)))
+            return len;
+    }
+
+    /* keep validators of the final response only, a 304 confirms the
+     * stored ones */
+    if (len > 5 && !strncmp(buffer, "HTTP/", 5)) {
+        const char *code = memchr(buffer, ' ', len);
+        long rcode = code ? atol(code + 1) : 0;
+
+        if (rcode == 304)
+            return len;
+        free(item->etag);
+        free(item->last_modified);
+        item->etag = item->last_modified = NULL;
+
+        /* bodies of anything but the content asked for are dropped */
+        if (rcode == 200 && item->validate) {
+            restart_output(item);
+            item->validate = VALIDATE_NONE;
+        } else if (rcode == 206 && item->validate == VALIDATE_RANGE) {
+            item->validate = VALIDATE_NONE;
+        }
+    } else if (len > 5 && !strncasecmp(buffer, "ETag:", 5)) {
+        set_header_value(&item->etag, buffer + 5, len - 5);
+    } else if (len > 14 && !strncasecmp(buffer, "Last-Modified:", 14)) {
+        set_header_value(&item->last_modified, buffer + 14, len - 14);
+    }
 
-    return fwrite(ptr, size, nmemb, outfile);
+    return len;
 }
 
 static int progressf(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
@@ -354,11 +5087,32 @@ static int progressf(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_o
     long int stime = item->start_time ? item->start_time : start_time;
     long int curr_time = time(NULL);
     long int tdiff = curr_time - stime;
+    double progress = item->hot->progress;
+    long int speed = item->hot->speed;
+    long eta = item->hot->eta;
+    curl_off_t total_size = item->hot->total_size;
+
+    /* a delta update counts what was found and fetched of the new copy */
+    if (item->delta) {
+        Delta *delta = item->delta;
+
+        if (delta->length) {
+            item->hot->done = delta->found_bytes + delta->fetched;
+            item->hot->total_size = delta->length;
+            item->hot->progress = 100. * item->hot->done / delta->length;
+        }
+        item->hot->speed = tdiff ? delta->fetched / tdiff : 0;
+        item->hot->eta = -1;
+        if (item->hot->progress != progress || item->hot->speed != speed)
+            item_changed(item);
+        return 0;
+    }
 
+    item->download_size = dlnow;
     if (dltotal)
-        item->progress = 100. * (dlnow + item->downloaded)/(dltotal + item->downloaded);
+        item->hot->progress = 100. * (dlnow + item->hot->downloaded)/(dltotal + item->hot->downloaded);
     else
-        item->progress = 0;
+        item->hot->progress = 0;
 
     if (ultotal)
         item->uprogress = 100. * ulnow/ultotal;
@@ -366,14 +5120,24 @@ static int progressf(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_o
         item->uprogress = 0;
 
     if (tdiff != 0)
-        item->speed = dlnow / tdiff;
+        item->hot->speed = dlnow / tdiff;
     else
-        item->speed = 0;
+        item->hot->speed = 0;
 
-    if (item->speed)
-        item->eta = (dltotal - dlnow) / item->speed;
+    if (item->hot->speed)
+        item->hot->eta = (dltotal - dlnow) / item->hot->speed;
     else
-        item->eta = -1;
+        item->hot->eta = -1;
+
+    item->hot->done = item->hot->downloaded + dlnow;
+    if (dltotal)
+        item->hot->total_size = item->hot->downloaded + dltotal;
+    if (curr_time != item->saved_time)
+        session_progress(item);
+
+    if (item->hot->progress != progress || item->hot->speed != speed || item->hot->eta != eta ||
+        item->hot->total_size != total_size)
+        item_changed(item);
 
     return 0;
 }
@@ -382,10 +5146,10 @@ static int get_fg(DownloadItem *ditem)
 {
     int bold = 0;
 
-    if (ditem->mode == MODE_ACTIVE)
+    if (ditem->hot->mode == MODE_ACTIVE)
         bold = A_BOLD;
 
-    if (ditem->mode == MODE_INACTIVE) {
+    if (ditem->hot->mode == MODE_INACTIVE) {
         return ditem == sitem[current_mode] ? bold | A_REVERSE | COLOR_PAIR(5) : bold | A_REVERSE | COLOR_PAIR(4);
     } else {
         return ditem == sitem[current_mode] ? bold | A_REVERSE | COLOR_PAIR(3) : bold | A_REVERSE | COLOR_PAIR(2);
@@ -396,10 +5160,10 @@ static int get_bg(DownloadItem *ditem)
 {
     int bold = 0;
 
-    if (ditem->mode == MODE_ACTIVE)
+    if (ditem->hot->mode == MODE_ACTIVE)
         bold = A_BOLD;
 
-    if (ditem->mode == MODE_INACTIVE) {
+    if (ditem->hot->mode == MODE_INACTIVE) {
         return ditem == sitem[current_mode] ? bold | COLOR_PAIR(5) : bold | COLOR_PAIR(4);
     } else {
         return ditem == sitem[current_mode] ? bold | COLOR_PAIR(3) : bold | COLOR_PAIR(2);
@@ -409,9 +5173,26 @@ static int get_bg(DownloadItem *ditem)
 static void uninit()
 {
     DownloadItem *item = items_tail;
-
-    pthread_cancel(curl_thread);
-    pthread_cancel(curses_thread);
+    int own = 0;
+
+    /* uninit() may run on any thread, stop the other shards and wait
+     * for them to leave their event loops */
+    for (int i = 0; i < nb_shards && shards; i++) {
+        if (shards[i].started && !pthread_equal(shards[i].thread, pthread_self())) {
+            shards[i].stop = 1;
+            wake_shard(&shards[i]);
+        } else if (shards[i].started) {
+            own = 1;
+        }
+    }
+    pthread_mutex_lock(&queue_lock);
+    while (running_shards > own)
+        pthread_cond_wait(&shard_stopped, &queue_lock);
+    pthread_mutex_unlock(&queue_lock);
+    if (curses_started && !pthread_equal(curses_thread, pthread_self()))
+        pthread_cancel(curses_thread);
+    /* the last flush may still log a failure */
+    session_close();
 
     clear();
     refresh();
@@ -422,13 +5203,71 @@ static void uninit()
     delwin(statuswin);
     delwin(logwin);
     delwin(downloads);
+    if (screen)
+        delscreen(screen);
+    screen = NULL;
+    if (nullout)
+        fclose(nullout);
+    if (nullin)
+        fclose(nullin);
+    nullout = nullin = NULL;
+
+    write_latency();
 
     for (;item;)
         item = delete_ditem(item);
-
-    curl_multi_cleanup(mhandle);
-    mhandle = NULL;
+    stop_writers();
+    trace_close();
+    free(url_table);
+    url_table = NULL;
+    url_table_size = nb_urls = 0;
+    for (ListedUrl *next; listed_urls; listed_urls = next) {
+        next = listed_urls->next;
+        free(listed_urls->url);
+        free(listed_urls->referer);
+        free(listed_urls);
+    }
+    listed_tail = NULL;
+    nb_listed = 0;
+    free_search_index();
+    free_hot();
+    free_pool(&history_pool);
+
+    if (dnsbase)
+        evdns_base_free(dnsbase, 0);
+    dnsbase = NULL;
+    if (watch_event)
+        event_free(watch_event);
+    watch_event = NULL;
+    if (watch_fd >= 0)
+        close(watch_fd);
+    watch_fd = -1;
+    for (int i = 0; i < nb_shards && shards; i++) {
+        Shard *shard = &shards[i];
+
+        if (shard->multi)
+            curl_multi_cleanup(shard->multi);
+        free_socks(shard);
+        if (shard->timer)
+            event_free(shard->timer);
+        if (shard->wake)
+            event_free(shard->wake);
+        for (int j = 0; j < 2; j++) {
+            if (shard->pipe[j] >= 0)
+                close(shard->pipe[j]);
+        }
+        if (shard->base)
+            event_base_free(shard->base);
+        free(shard->uplink_bytes);
+        free(shard->uplink_seen);
+    }
+    free(shards);
+    for (int i = 0; i < nb_uplinks; i++)
+        free(uplinks[i].name);
+    nb_uplinks = 0;
+    shards = NULL;
     curl_global_cleanup();
+    free_hosts();
     items = NULL;
     items_tail = NULL;
     free(last_search);
@@ -436,10 +5275,11 @@ static void uninit()
     free(string);
     string = NULL;
 
-    event_free(timerevent);
-    timerevent = NULL;
-    event_base_free(eventbase);
-    eventbase = NULL;
+    for (int i = 0; i < 2; i++) {
+        if (ui_pipe[i] >= 0)
+            close(ui_pipe[i]);
+        ui_pipe[i] = -1;
+    }
 }
 
 static void error(int sig, const char *error_msg)
@@ -451,25 +5291,170 @@ static void error(int sig, const char *error_msg)
     exit(sig);
 }
 
+static void leave_shard(Shard *shard)
+{
+    pthread_mutex_lock(&queue_lock);
+    detach_requested(shard);
+    shard->left = 1;
+    running_shards--;
+    pthread_cond_broadcast(&shard_stopped);
+    pthread_mutex_unlock(&queue_lock);
+}
+
 static void finish(int sig)
 {
+    /* the first thread to finish tears everything down, the others
+     * leave without touching it */
+    if (pthread_mutex_trylock(&finish_lock)) {
+        for (int i = 0; i < nb_shards && shards; i++) {
+            if (shards[i].started && pthread_equal(shards[i].thread, pthread_self()))
+                leave_shard(&shards[i]);
+        }
+        pthread_exit(NULL);
+    }
+
     uninit();
 
     exit(sig);
 }
 
+static int is_unreserved(char c)
+{
+    return isalnum((unsigned char)c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/* A URL with escapes in it is taken as escaped already, otherwise its
+ * last component is escaped the way curl_easy_escape would. */
+static int escape_item_url(DownloadItem *item)
+{
+    const char *url = item->url;
+    const char *lpath = strrchr(url, '/');
+    size_t len;
+    char *out;
+
+    if (item->escape_url)
+        return 0;
+
+    if (!lpath) {
+        write_status(A_REVERSE | COLOR_PAIR(1), "Invalid URL");
+        return 1;
+    }
+
+    if (has_escapes(url)) {
+        item->escape_url = item_string(item, url, strlen(url));
+        if (!item->escape_url) {
+            write_status(A_REVERSE | COLOR_PAIR(1), "Failed to duplicate url");
+            return 1;
+        }
+        return 0;
+    }
+
+    lpath++;
+    len = lpath - url;
+    for (const char *s = lpath; *s; s++)
+        len += is_unreserved(*s) ? 1 : 3;
+
+    item->escape_url = out = item_alloc(item, len + 1);
+    if (!item->escape_url) {
+        write_status(A_REVERSE | COLOR_PAIR(1), "Failed to allocate escape URL");
+        return 1;
+    }
+
+    memcpy(out, url, lpath - url);
+    out += lpath - url;
+    for (const char *s = lpath; *s; s++) {
+        if (is_unreserved(*s))
+            *out++ = *s;
+        else
+            out += sprintf(out, "%%%02X", (unsigned char)*s);
+    }
+    *out = '\0';
+
+    return 0;
+}
+
+/* a URL naming a directory, or with a wildcard in its last component,
+ * is listed instead of downloaded */
+static int is_listing(const char *url)
+{
+    const char *scheme = strstr(url, "://");
+    const char *lpath = strrchr(url, '/');
+    const char *star, *query;
+
+    if (!scheme || !lpath || lpath < scheme + 3)
+        return 0;
+
+    star = strchr(lpath, '*');
+    query = strchr(lpath, '?');
+
+    return !lpath[1] || (star && (!query || star < query));
+}
+
+static int init_listing(DownloadItem *item, const char *outname)
+{
+    const char *url = item->url;
+    const char *lpath = strrchr(url, '/') + 1;
+    size_t dirlen = lpath - url;
+    char *unescape = NULL;
+
+    /* FTP wildcards are matched by libcurl from the URL, index pages
+     * are fetched as the directory and their links matched here */
+    if (!strncasecmp(url, "ftp://", 6) || !strncasecmp(url, "ftps://", 7)) {
+        item->listing = LISTING_FTP;
+        item->escape_url = item_alloc(item, strlen(url) + 2);
+        if (item->escape_url)
+            sprintf(item->escape_url, "%s%s", url, *lpath ? "" : "*");
+    } else {
+        item->listing = LISTING_INDEX;
+        item->escape_url = item_string(item, url, dirlen);
+    }
+    if (!item->escape_url)
+        return 1;
+
+    if (*lpath) {
+        unescape = item_string(item, lpath, strlen(lpath));
+        if (!unescape)
+            return 1;
+        unescape_string(unescape);
+        if (item->listing == LISTING_INDEX)
+            item->pattern = unescape;
+    }
+
+    /* shown as the pattern, or the directory name for a whole directory */
+    if (outname) {
+        item->outputfilename = item_string(item, outname, strlen(outname));
+    } else if (unescape) {
+        item->outputfilename = unescape;
+    } else {
+        const char *name = lpath - 1;
+
+        while (name > url && name[-1] != '/')
+            name--;
+        item->outputfilename = item_string(item, name, lpath - name);
+    }
+
+    return !item->outputfilename || (*lpath && item->listing == LISTING_INDEX && !item->pattern);
+}
+
+/* an output of - given with -o or -O is standard output and one starting
+ * with | a command the download is piped into; names taken from URLs or
+ * listings are files whatever they look like */
+static int output_stream(const char *name)
+{
+    if (!strcmp(name, "-"))
+        return STREAM_STDOUT;
+    if (name[0] == '|')
+        return STREAM_PIPE;
+
+    return STREAM_NONE;
+}
+
 static int create_handle(int overwritefile, const char *newurl,
-                         const char *referer, const char *outname,
-                         curl_off_t speed)
+                         const char *referer, const char *outname, int stream,
+                         curl_off_t speed, int priority)
 {
     DownloadItem *item;
-    FILE *outputfile = NULL;
-    const char *ofilename;
-    const char *lpath;
-    char *unescape;
-    CURL *handle;
-    CURLcode rc;
-    int urllen, escape_url_size, i;
+    int urllen;
 
     string_pos = 0;
     urllen = strlen(newurl);
@@ -478,15 +5463,44 @@ static int create_handle(int overwritefile, const char *newurl,
         return 1;
     }
 
-    for (item = items; item; item = item->next) {
-        if (item->url && !strcmp(newurl, item->url)) {
-            write_status(A_REVERSE | COLOR_PAIR(1), "URL already in use");
-            return 1;
+    if ((item = find_url(newurl))) {
+        /* giving a finished URL again checks it for changes, taking
+         * what was given along with it this time */
+        if (item->hot->mode == MODE_FINISHED) {
+            char *string;
+
+            if (outname && strcmp(outname, item->outputfilename))
+                write_log(COLOR_PAIR(1), "%s keeps its output %s, ignoring %s.\n",
+                          newurl, item->outputfilename, outname);
+            /* fetched again from the start */
+            if (overwritefile && !item->listing && !item->stream) {
+                close_output(item);
+                item->overwrite = 1;
+            }
+            if (referer && (string = item_string(item, referer, strlen(referer)))) {
+                item->referer = string;
+                curl_easy_setopt(item->handle, CURLOPT_REFERER, item->referer);
+            }
+            if (speed) {
+                item->max_speed = speed;
+                curl_easy_setopt(item->handle, CURLOPT_MAX_RECV_SPEED_LARGE, item->max_speed);
+            }
+            if (priority != DEFAULT_PRIORITY) {
+                item->priority = priority;
+                curl_easy_setopt(item->handle, CURLOPT_STREAM_WEIGHT, (long)item->priority);
+            }
+            set_mode(item, MODE_PAUSED);
+            session_item(item);
+            queue_probe(item);
+            queue_prefetch(item);
+            return 0;
         }
+        write_status(A_REVERSE | COLOR_PAIR(1), "URL already in use");
+        return 1;
     }
 
     if (items == NULL) {
-        items = calloc(1, sizeof(DownloadItem));
+        items = new_item();
         if (!items) {
             write_status(A_REVERSE | COLOR_PAIR(1), "Failed to allocate DownloadItem");
             return 1;
@@ -497,7 +5511,7 @@ static int create_handle(int overwritefile, const char *newurl,
         DownloadItem *prev;
 
         item = items_tail;
-        item->next = calloc(1, sizeof(DownloadItem));
+        item->next = new_item();
         if (!item->next) {
             write_status(A_REVERSE | COLOR_PAIR(1), "Failed to allocate DownloadItem");
             return 1;
@@ -509,170 +5523,473 @@ static int create_handle(int overwritefile, const char *newurl,
         nb_ditems++;
     }
 
-    item->url = clonestring(newurl, urllen);
-    if (!item->url) {
+    item->id = next_item_id++;
+    set_mode(item, MODE_PAUSED);
+
+    item->url = item_string(item, newurl, urllen);
+    if (!item->url || insert_url(item)) {
         write_status(A_REVERSE | COLOR_PAIR(1), "Failed to copy URL");
         delete_ditem(item);
         return 1;
     }
 
-    item->handle = handle = curl_easy_init();
-    if (!handle) {
-        write_status(A_REVERSE | COLOR_PAIR(1), "Failed to create curl easy handle");
-        delete_ditem(item);
-        return 1;
-    }
+    /* the escaped URL is only needed once started, skip the work when
+     * the output name is known already */
+    if (is_listing(newurl)) {
+        if (init_listing(item, outname)) {
+            write_status(A_REVERSE | COLOR_PAIR(1), "Failed to set up listing");
+            delete_ditem(item);
+            return 1;
+        }
+    } else if (outname) {
+        if (!strchr(newurl, '/')) {
+            write_status(A_REVERSE | COLOR_PAIR(1), "Invalid URL");
+            delete_ditem(item);
+            return 1;
+        }
+        item->outputfilename = item_string(item, outname, strlen(outname));
+    } else {
+        const char *lpath = last_component(newurl);
 
-    unescape = curl_easy_unescape(handle, newurl, urllen, NULL);
-    if (!unescape) {
-        write_status(A_REVERSE | COLOR_PAIR(1), "Failed to unescape URL");
-        delete_ditem(item);
-        return 1;
+        if (escape_item_url(item)) {
+            delete_ditem(item);
+            return 1;
+        }
+        item->outputfilename = item_string(item, lpath, strlen(lpath));
+        if (item->outputfilename)
+            unescape_string(item->outputfilename);
     }
+    item->max_speed = speed;
+    item->priority = priority;
+    item->overwrite = overwritefile;
+    item->stream = item->listing ? STREAM_NONE : stream;
 
-    lpath = strrchr(unescape, '/');
-    if (!lpath) {
-        curl_free(unescape);
-        write_status(A_REVERSE | COLOR_PAIR(1), "Invalid URL");
+    if (!item->outputfilename) {
+        write_status(A_REVERSE | COLOR_PAIR(1), "Failed to duplicate output filename");
         delete_ditem(item);
         return 1;
     }
 
-    lpath += 1;
-    if (!strcmp(unescape, newurl)) {
-        char *escape = curl_easy_escape(handle, lpath, 0);
-        if (!escape) {
-            curl_free(unescape);
-            write_status(A_REVERSE | COLOR_PAIR(1), "Failed to escape URL");
-            delete_ditem(item);
-            return 1;
-        }
-        escape_url_size = strlen(escape) + strlen(newurl);
-        item->escape_url = calloc(escape_url_size, sizeof(*item->escape_url));
-        if (!item->escape_url) {
-            curl_free(unescape);
-            write_status(A_REVERSE | COLOR_PAIR(1), "Failed to allocate escape URL");
+    if (item->stream == STREAM_STDOUT) {
+        if (stdout_item) {
+            write_log(COLOR_PAIR(1), "Standard output is taken by %s, not adding %s.\n",
+                      stdout_item->url, newurl);
             delete_ditem(item);
             return 1;
         }
+        stdout_item = item;
+    }
 
-        for (i = urllen - 1; i >= 0; i--) {
-            if (newurl[i] == '/')
-                break;
-        }
-        snprintf(item->escape_url, escape_url_size, "%.*s/%s", i, newurl, escape);
-        curl_free(escape);
-    } else {
-        item->escape_url = clonestring(newurl, urllen);
-        if (!item->escape_url) {
-            curl_free(unescape);
-            write_status(A_REVERSE | COLOR_PAIR(1), "Failed to duplicate url");
+    if (referer) {
+        item->referer = item_string(item, referer, strlen(referer));
+        if (!item->referer) {
+            write_status(A_REVERSE | COLOR_PAIR(1), "Failed to duplicate referer");
             delete_ditem(item);
             return 1;
         }
     }
 
-    ofilename = outname ? outname : lpath;
-    item->outputfilename = clonestring(ofilename, strlen(ofilename));
-    item->max_speed = speed;
-    curl_free(unescape);
+    index_item(item);
+    session_item(item);
+    if (sort_key)
+        sort_mark(item);
+    queue_probe(item);
+    queue_prefetch(item);
+
+    return 0;
+}
 
-    if (!item->outputfilename) {
-        write_status(A_REVERSE | COLOR_PAIR(1), "Failed to duplicate output filename");
-        delete_ditem(item);
+/* the easy handle is made when first needed, by a probe or a start */
+static int init_handle(DownloadItem *item)
+{
+    CURL *handle;
+    CURLcode rc;
+
+    if (item->handle)
+        return 0;
+
+    if (escape_item_url(item))
         return 1;
-    }
 
-    if (!overwritefile)
-        item->outputfile = outputfile = fopen(item->outputfilename, "rb+");
-    if (!outputfile)
-        item->outputfile = outputfile = fopen(item->outputfilename, "wb");
-    if (!outputfile) {
-        write_status(A_REVERSE | COLOR_PAIR(1), "Failed to open file: %s", item->outputfilename);
-        delete_ditem(item);
+    item->handle = handle = curl_easy_init();
+    if (!handle) {
+        write_log(COLOR_PAIR(1), "Failed to create curl easy handle for %s\n", item->outputfilename);
         return 1;
     }
 
+    if (!item->host)
+        item->host = get_host(item->url);
+
     rc = curl_easy_setopt(handle, CURLOPT_URL, item->escape_url);
     check_erc("url:", rc);
     curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_data);
+    curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, header_data);
+    curl_easy_setopt(handle, CURLOPT_HEADERDATA, item);
     curl_easy_setopt(handle, CURLOPT_PRIVATE, item);
     curl_easy_setopt(handle, CURLOPT_XFERINFODATA, item);
     curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, progressf);
-    curl_easy_setopt(handle, CURLOPT_WRITEDATA, outputfile);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, item);
     curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
     curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
     curl_easy_setopt(handle, CURLOPT_AUTOREFERER, 1L);
     curl_easy_setopt(handle, CURLOPT_MAX_RECV_SPEED_LARGE, item->max_speed);
-    if (referer) {
-        rc = curl_easy_setopt(handle, CURLOPT_REFERER, referer);
+    curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, http_version);
+    /* waiting on a connection only pays off when it can multiplex */
+    if (http_version >= CURL_HTTP_VERSION_2_0)
+        curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(handle, CURLOPT_STREAM_WEIGHT, (long)item->priority);
+    if (item->referer) {
+        rc = curl_easy_setopt(handle, CURLOPT_REFERER, item->referer);
         check_erc("referer:", rc);
     }
-
-    if (!overwritefile) {
-        curl_off_t from;
-        fseek(outputfile, 0, SEEK_END);
-        from = item->downloaded = ftell(outputfile);
-        rc = curl_easy_setopt(handle, CURLOPT_RESUME_FROM_LARGE, from);
-        check_erc("resume:", rc);
+    if (item->listing == LISTING_FTP) {
+        rc = curl_easy_setopt(handle, CURLOPT_WILDCARDMATCH, 1L);
+        check_erc("wildcard:", rc);
+        curl_easy_setopt(handle, CURLOPT_CHUNK_BGN_FUNCTION, list_chunk_bgn);
+        curl_easy_setopt(handle, CURLOPT_CHUNK_END_FUNCTION, list_chunk_end);
+        curl_easy_setopt(handle, CURLOPT_CHUNK_DATA, item);
     }
-    item->mode = MODE_PAUSED;
-    paused_downloads++;
 
     return 0;
 }
 
-static void write_downloads()
+/* the output file is only created once the item is started and the easy
+ * handle once it is started or probed, so queueing a large list stays
+ * cheap */
+static int open_item(DownloadItem *item)
 {
-    DownloadItem *item = items;
-    int line, cline = -1, offset;
-
-    wmove(downloads, 0, 0);
-
-    item = items;
-    for (line = 0; item; item = item->next) {
-        double progress = item->progress;
-        char speedstr[128] = { 0 };
-        char progstr[8] = { 0 };
-        int speed = item->speed;
-        char *namestr = item->outputfilename;
-        int j, pos = progress * COLS / 100;
-        int fg = get_fg(item);
-        int bg = get_bg(item);
-        int namestrlen, k, l;
-        int speedstrlen;
-        int progstrlen;
-
-        if (current_mode && item->mode != current_mode) {
-            continue;
+    if (item->stream && !item->outputfile) {
+        if (item->stream == STREAM_STDOUT && (!headless || isatty(STDOUT_FILENO))) {
+            write_log(COLOR_PAIR(1), "Not writing %s to the terminal.\n", item->url);
+            return 1;
+        }
+        if (item->stream == STREAM_PIPE)
+            item->outputfile = popen(item->outputfilename + 1, "w");
+        else
+            item->outputfile = fdopen(dup(STDOUT_FILENO), "wb");
+        if (!item->outputfile) {
+            write_log(COLOR_PAIR(1), "Failed to open output: %s\n", item->outputfilename);
+            return 1;
+        }
+        /* a new reader gets it all */
+        item->write_pos = 0;
+    } else if (!item->listing && !item->stream) {
+        if (!item->outputfile && !item->overwrite)
+            item->outputfile = fopen(item->outputfilename, "rb+");
+        if (!item->outputfile)
+            item->outputfile = fopen(item->outputfilename, "wb+");
+        if (!item->outputfile) {
+            write_log(COLOR_PAIR(1), "Failed to open file: %s\n", item->outputfilename);
+            return 1;
+        }
+        /* do not truncate again when restarted, nor when restored; the
+         * decoded copy is overwritten along with it */
+        if (item->overwrite) {
+            item->overwrite = 0;
+            item->decode_owned = item->decode;
+            session_item(item);
         }
+    }
+
+    return init_handle(item);
+}
+
+typedef struct SessionEntry {
+    const unsigned char *item;
+    const unsigned char *progress;
+} SessionEntry;
+
+static const char *get_string(const unsigned char **p, const unsigned char *end)
+{
+    uint32_t len;
+    const char *string;
+
+    if (end - *p < 4)
+        return NULL;
+    memcpy(&len, *p, 4);
+    *p += 4;
+    if (!len || (size_t)(end - *p) < len || (*p)[len - 1])
+        return NULL;
+    string = (const char *)*p;
+    *p += len;
+
+    return string;
+}
+
+/* the fields from priority on, shared by item and progress records */
+static void get_progress(const unsigned char *p, int *priority,
+                         curl_off_t *speed, curl_off_t *done, curl_off_t *size)
+{
+    uint16_t u16;
+    int64_t i64[3];
+
+    memcpy(&u16, p, 2);
+    memcpy(i64, p + 2, sizeof(i64));
+    *priority = MIN(MAX(MIN_PRIORITY, u16), MAX_PRIORITY);
+    *speed = i64[0];
+    *done = i64[1];
+    *size = i64[2];
+}
+
+static void restore_item(unsigned id, const unsigned char *p, const unsigned char *end,
+                         const unsigned char *progress)
+{
+    const char *url, *outname, *referer, *etag, *last_modified;
+    curl_off_t speed, done, size;
+    int mode, overwrite, decode, stream, owned, priority;
+    DownloadItem *item;
+
+    overwrite = p[1] & 1;
+    decode = p[1] >> 1 & 1;
+    stream = p[1] >> 2 & 1;
+    owned = p[1] >> 3 & 1;
+    if (progress) {
+        mode = progress[0];
+        get_progress(progress + 1, &priority, &speed, &done, &size);
+    } else {
+        mode = p[0];
+        get_progress(p + 2, &priority, &speed, &done, &size);
+    }
+    p += 2 + 2 + 3 * 8;
+
+    url = get_string(&p, end);
+    outname = get_string(&p, end);
+    referer = get_string(&p, end);
+    etag = get_string(&p, end);
+    last_modified = get_string(&p, end);
+    if (!url || !outname || find_url(url) ||
+        create_handle(overwrite, url, referer, outname, stream ? output_stream(outname) : STREAM_NONE,
+                      speed, priority))
+        return;
+
+    item = items_tail;
+    item->id = id;
+    item->decode = decode;
+    item->decode_owned = owned;
+    item->hot->done = done;
+    item->hot->total_size = size;
+    if (etag)
+        item->etag = clonestring(etag, strlen(etag));
+    if (last_modified)
+        item->last_modified = clonestring(last_modified, strlen(last_modified));
+    if (size > 0)
+        item->hot->progress = 100. * done / size;
+
+    /* downloads are restored paused, unless finished or halted */
+    if (mode == MODE_FINISHED || mode == MODE_INACTIVE) {
+        if (mode == MODE_FINISHED)
+            item->hot->progress = 100.;
+        set_mode(item, mode);
+    }
+}
+
+static int session_open(const char *filename)
+{
+    SessionEntry *entries = NULL;
+    unsigned nb_entries = 0, nb_records = 0, nb_live = 0;
+    const unsigned char *map = NULL, *p, *end;
+    DownloadItem *given = items_tail;
+    unsigned char *header;
+    DownloadItem *item;
+    struct stat st;
+    off_t pos = 0;
+    int fd;
+
+    if (session_fd >= 0) {
+        write_log(COLOR_PAIR(1), "Session file already opened\n");
+        return -1;
+    }
 
-        if (item == sitem[current_mode]) {
-            cline = line;
+    fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0 || fstat(fd, &st)) {
+        write_log(COLOR_PAIR(1), "Failed to open session file %s\n", filename);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED || st.st_size < (off_t)strlen(SESSION_MAGIC) ||
+            memcmp(map, SESSION_MAGIC, strlen(SESSION_MAGIC))) {
+            write_log(COLOR_PAIR(1), "Invalid session file %s\n", filename);
+            if (map != MAP_FAILED)
+                munmap((void *)map, st.st_size);
+            close(fd);
+            return -1;
         }
+        posix_madvise((void *)map, st.st_size, POSIX_MADV_SEQUENTIAL);
 
-        snprintf((char *)&progstr, sizeof(progstr), "%3.2f%%", progress);
-        snprintf((char *)&speedstr, sizeof(speedstr), "%dKB/s", speed / 1024);
-        namestrlen = strlen(namestr);
-        speedstrlen = strlen(speedstr);
-        progstrlen = strlen(progstr);
-        for (j = 0, k = 0, l = 0; j < COLS; j++) {
-            if (j < pos)
-                wattrset(downloads, fg);
-            else
-                wattrset(downloads, bg);
-            if (j < namestrlen)
-                mvwaddch(downloads, line, j, namestr[j]);
-            else if (j >= COLS/2 && l < speedstrlen)
-                mvwaddch(downloads, line, j, speedstr[l++]);
-            else if (j >= COLS - progstrlen && k < progstrlen)
-                mvwaddch(downloads, line, j, progstr[k++]);
-            else
-                mvwaddch(downloads, line, j, ' ');
+        pos = strlen(SESSION_MAGIC);
+        end = map + st.st_size;
+        for (p = map + pos; end - p >= SESSION_HEADER; p += pos) {
+            uint32_t size, id;
+            int type = p[4];
+
+            memcpy(&size, p, 4);
+            memcpy(&id, p + 5, 4);
+            if (size < SESSION_HEADER || size > (size_t)(end - p))
+                break;
+            pos = size;
+
+            if (id >= nb_entries) {
+                unsigned n = MAX(id + 1, nb_entries * 2);
+                SessionEntry *e = realloc(entries, n * sizeof(*e));
+
+                if (!e)
+                    break;
+                memset(e + nb_entries, 0, (n - nb_entries) * sizeof(*e));
+                entries = e;
+                nb_entries = n;
+            }
+
+            if (type == SESSION_ITEM && size >= SESSION_HEADER + 4 + 3 * 8) {
+                entries[id].item = p;
+                entries[id].progress = NULL;
+            } else if (type == SESSION_PROGRESS && size >= SESSION_HEADER + 3 + 3 * 8) {
+                entries[id].progress = p;
+            } else if (type == SESSION_DELETE) {
+                entries[id].item = entries[id].progress = NULL;
+            }
+            nb_records++;
+            next_item_id = MAX(next_item_id, id + 1);
+        }
+        pos = p - map;
+
+        /* size the URL table once instead of growing it while restoring */
+        for (unsigned id = 0; id < nb_entries; id++)
+            nb_live += !!entries[id].item;
+        reserve_urls(nb_urls + nb_live);
+        nb_live = 0;
+        for (unsigned id = 0; id < nb_entries; id++) {
+            const unsigned char *record = entries[id].item;
+            uint32_t size;
+
+            if (!record)
+                continue;
+            memcpy(&size, record, 4);
+            restore_item(id, record + SESSION_HEADER, record + size,
+                         entries[id].progress ? entries[id].progress + SESSION_HEADER : NULL);
+            nb_live++;
+        }
+
+        free(entries);
+        munmap((void *)map, st.st_size);
+
+        /* drop a record torn by a crash, so appends stay aligned */
+        if (pos < st.st_size && ftruncate(fd, pos))
+            write_log(COLOR_PAIR(1), "Failed to truncate session file %s\n", filename);
+    }
+
+    /* renumber items given before the session file after the stored ones */
+    for (item = given ? items : NULL; item; item = item->next) {
+        item->id = next_item_id++;
+        if (item == given)
+            break;
+    }
+
+    session_fd = fd;
+
+    if (!st.st_size || nb_records > 2 * nb_live + 1024) {
+        /* start over with a compact snapshot of the current list */
+        char *tmpname = malloc(strlen(filename) + 5);
+        int tmpfd = -1;
+
+        if (tmpname) {
+            sprintf(tmpname, "%s.new", filename);
+            tmpfd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        }
+        if (tmpfd >= 0) {
+            session_fd = tmpfd;
+            header = session_reserve(strlen(SESSION_MAGIC));
+            if (header)
+                memcpy(header, SESSION_MAGIC, strlen(SESSION_MAGIC));
+            for (item = items; item; item = item->next)
+                session_item(item);
+            if (write_all(tmpfd, session_buf, session_len) || fdatasync(tmpfd) ||
+                rename(tmpname, filename)) {
+                write_log(COLOR_PAIR(1), "Failed to write session file %s\n", filename);
+                close(tmpfd);
+                unlink(tmpname);
+                session_fd = fd;
+            } else {
+                close(fd);
+            }
+            session_len = 0;
+        }
+        free(tmpname);
+    } else {
+        /* items given before the session file were not recorded yet */
+        for (item = given ? items : NULL; item; item = item->next) {
+            session_item(item);
+            if (item == given)
+                break;
         }
+    }
+
+    if (pthread_create(&session_thread, NULL, do_session, NULL)) {
+        write_log(COLOR_PAIR(1), "Failed to start session writer\n");
+        close(session_fd);
+        session_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
 
-        line++;
+static void write_item(DownloadItem *item, int line)
+{
+    double progress = item->hot->progress;
+    char speedstr[128] = { 0 };
+    char progstr[8] = { 0 };
+    int speed = item->hot->speed;
+    char *namestr = item->outputfilename;
+    int j, pos = progress * COLS / 100;
+    int fg = get_fg(item);
+    int bg = get_bg(item);
+    const char *match = last_search ? strstr(namestr, last_search) : NULL;
+    int matchlen = last_search ? strlen(last_search) : 0;
+    int namestrlen, k, l;
+    int speedstrlen;
+    int progstrlen;
+
+    snprintf((char *)&progstr, sizeof(progstr), "%3.2f%%", progress);
+    snprintf((char *)&speedstr, sizeof(speedstr), "%dKB/s", speed / 1024);
+    namestrlen = strlen(namestr);
+    speedstrlen = strlen(speedstr);
+    progstrlen = strlen(progstr);
+    for (j = 0, k = 0, l = 0; j < COLS; j++) {
+        int attr = j < pos ? fg : bg;
+
+        /* underline every occurrence of the search in the name */
+        if (match && namestr + j >= match + matchlen)
+            match = matchlen ? strstr(match + matchlen, last_search) : NULL;
+        if (match && namestr + j >= match && j < namestrlen)
+            attr |= A_UNDERLINE;
+        wattrset(downloads, attr);
+        if (j < namestrlen)
+            mvwaddch(downloads, line, j, namestr[j]);
+        else if (j >= COLS/2 && l < speedstrlen)
+            mvwaddch(downloads, line, j, speedstr[l++]);
+        else if (j >= COLS - progstrlen && k < progstrlen)
+            mvwaddch(downloads, line, j, progstr[k++]);
+        else
+            mvwaddch(downloads, line, j, ' ');
     }
+}
+
+/* Only the rows on screen are drawn. The selected line and the first
+ * row shown are found from the hot records in display order, or from
+ * the tree of a sorted view, the rest of an item is only read when its
+ * row is drawn. */
+static void write_downloads()
+{
+    int line = 0, cline = -1, offset;
+    DownloadItem *item;
+
+    if (sitem[current_mode] &&
+        (!current_mode || sitem[current_mode]->hot->mode == current_mode))
+        cline = view_rank(sitem[current_mode]);
 
     if (cline >= 0) {
         offset = MAX(cline - (LINES - 2), 0);
@@ -680,9 +5997,14 @@ static void write_downloads()
     } else {
         offset = current_page * (LINES - 1);
     }
+    view_offset = offset;
+
+    for (item = view_select(offset); item && line < LINES; item = step_item(item, 0))
+        write_item(item, line++);
+    wmove(downloads, line, 0);
     wclrtobot(downloads);
 
-    pnoutrefresh(downloads, offset, 0, 0, 0, LINES-1, COLS);
+    pnoutrefresh(downloads, 0, 0, 0, 0, LINES-1, COLS);
 }
 
 static void write_logwin()
@@ -711,52 +6033,322 @@ static void write_statuswin(int downloading)
     wattrset(statuswin, COLOR_PAIR(7));
     wprintw(statuswin, ":%d ", finished_downloads);
     wprintw(statuswin, "N:%d", nb_ditems);
+    if (sort_key)
+        wprintw(statuswin, " O:%s%s", sort_reverse ? "-" : "", sort_name(sort_key));
     if (start_time != INT_MIN && downloading)
         wprintw(statuswin, " T:%ld", time(NULL) - start_time);
+    if (downloading) {
+        wprintw(statuswin, " R:%" CURL_FORMAT_CURL_OFF_T "KB/s", session_rate / 1024);
+        if (session_eta >= 0)
+            wprintw(statuswin, " E:%ld", session_eta);
+    }
     wprintw(statuswin, "] ");
+    if (nb_uplinks && shards) {
+        pthread_mutex_lock(&queue_lock);
+        update_uplinks();
+        for (int i = 0; i < nb_uplinks; i++)
+            wprintw(statuswin, "%s:%" CURL_FORMAT_CURL_OFF_T "KB/s/%d ", uplinks[i].name,
+                    uplinks[i].rate / 1024, uplinks[i].running);
+        pthread_mutex_unlock(&queue_lock);
+    }
     wclrtoeol(statuswin);
     mvwprintw(statuswin, 0, COLS-12, " Help (F1) ");
     wnoutrefresh(statuswin);
 }
 
-static void add_handle(DownloadItem *ditem)
+/* An existing output is checked against the validators of the response
+ * it came from: a complete one is only fetched again if it changed, a
+ * partial one resumed only if unchanged, else it is fetched whole. */
+static void set_validation(DownloadItem *item, curl_off_t from)
+{
+    const char *validator = item->etag && strncmp(item->etag, "W/", 2) ? item->etag : item->last_modified;
+    char header[1024];
+
+    curl_slist_free_all(item->validators);
+    item->validators = NULL;
+    item->validate = VALIDATE_NONE;
+    curl_easy_setopt(item->handle, CURLOPT_RANGE, NULL);
+    curl_easy_setopt(item->handle, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)0);
+
+    if (from > 0 && !item->stream && item->hot->total_size > 0 && from >= item->hot->total_size &&
+        (item->etag || item->last_modified)) {
+        if (item->etag && snprintf(header, sizeof(header), "If-None-Match: %s", item->etag) < (int)sizeof(header))
+            item->validators = curl_slist_append(item->validators, header);
+        if (item->last_modified && snprintf(header, sizeof(header), "If-Modified-Since: %s",
+                                            item->last_modified) < (int)sizeof(header))
+            item->validators = curl_slist_append(item->validators, header);
+        item->validate = VALIDATE_FULL;
+    } else if (from > 0 && !item->stream && validator &&
+               snprintf(header, sizeof(header), "If-Range: %s", validator) < (int)sizeof(header)) {
+        item->validators = curl_slist_append(item->validators, header);
+        snprintf(header, sizeof(header), "%" CURL_FORMAT_CURL_OFF_T "-", from);
+        curl_easy_setopt(item->handle, CURLOPT_RANGE, header);
+        item->validate = VALIDATE_RANGE;
+    } else {
+        curl_easy_setopt(item->handle, CURLOPT_RESUME_FROM_LARGE, from);
+    }
+    curl_easy_setopt(item->handle, CURLOPT_HTTPHEADER, item->validators);
+}
+
+static void remove_handle(DownloadItem *ditem)
+{
+    trace_event(TRACE_REMOVE, ditem->id, ditem->hot->done, 0);
+    free_delta(ditem);
+    detach_item(ditem);
+    unmap_item(ditem);
+    drop_write_pause(ditem);
+    ditem->end_time = time(NULL);
+    if (ditem->probe_state == PROBE_RUNNING)
+        cancel_probe(ditem);
+}
+
+static void finish_item(DownloadItem *ditem)
+{
+    publish_info(ditem);
+    remove_handle(ditem);
+    set_mode(ditem, MODE_FINISHED);
+    ditem->hot->progress = 100.;
+    item_changed(ditem);
+    pthread_mutex_lock(&queue_lock);
+    record_timing(ditem);
+    pthread_mutex_unlock(&queue_lock);
+    trace_event(TRACE_STATE, ditem->id, ditem->hot->mode, 0);
+    session_item(ditem);
+}
+
+/* an item that can not be completed is left inactive with what it got,
+ * to be looked at and restarted by hand */
+static void fail_item(DownloadItem *ditem)
+{
+    remove_handle(ditem);
+    set_mode(ditem, MODE_INACTIVE);
+    item_changed(ditem);
+    trace_event(TRACE_STATE, ditem->id, ditem->hot->mode, 0);
+    session_progress(ditem);
+}
+
+static int add_handle(DownloadItem *ditem)
 {
-    CURLMcode rc;
     curl_off_t from;
-    int still_running;
 
-    fseek(ditem->outputfile, 0, SEEK_END);
-    from = ditem->downloaded = ftell(ditem->outputfile);
-    curl_easy_setopt(ditem->handle, CURLOPT_RESUME_FROM_LARGE, from);
+    /* started while its probe runs, added once that is done */
+    if (ditem->probe_state == PROBE_RUNNING)
+        return 0;
+
+    if (open_item(ditem)) {
+        set_mode(ditem, MODE_INACTIVE);
+        session_progress(ditem);
+        trace_event(TRACE_STATE, ditem->id, ditem->hot->mode, 0);
+        return 1;
+    }
+
+    if (ditem->listing) {
+        /* a listing is always read again from the start */
+        from = ditem->hot->downloaded = 0;
+        ditem->link_len = 0;
+        ditem->nb_entries = 0;
+    } else if (ditem->stream) {
+        /* a stream can not be rewound, it goes on from what its reader
+         * was given and fails if the server can not do that */
+        flush_writes(ditem);
+        from = ditem->hot->downloaded = ditem->write_pos;
+    } else {
+        flush_writes(ditem);
+        fseek(ditem->outputfile, 0, SEEK_END);
+        from = ditem->hot->downloaded = ftell(ditem->outputfile);
+        /* a mapped download interrupted by a crash leaves a full size
+         * file, the session file knows how far it got */
+        if (map_output && ditem->hot->total_size == from && ditem->hot->done < from &&
+            !ftruncate(fileno(ditem->outputfile), ditem->hot->done)) {
+            fseek(ditem->outputfile, 0, SEEK_END);
+            from = ditem->hot->downloaded = ftell(ditem->outputfile);
+        }
+    }
+    /* a probe tells a complete copy and a server that can not resume
+     * apart before a request fails on them */
+    if (ditem->probe && ditem->probe->size > 0 && from > 0 && !ditem->listing && !ditem->stream &&
+        !ditem->probe->changed) {
+        curl_off_t size = ditem->probe->size;
+
+        if (from == size) {
+            free_probe(ditem);
+            ditem->hot->done = ditem->hot->total_size = from;
+            finish_item(ditem);
+            write_log(COLOR_PAIR(7), "%s is complete already.\n", ditem->outputfilename);
+            return 0;
+        }
+        if (!ditem->probe->ranges || from > size) {
+            restart_output(ditem);
+            ditem->hot->total_size = size;
+            from = 0;
+        }
+    }
+    /* only good for this start, a later one may find it changed */
+    free_probe(ditem);
+    ditem->write_pos = from;
+    ditem->sampled = from;
+    if (!ditem->history) {
+        if (!history_pool.size)
+            init_pool(&history_pool, sizeof(History));
+        ditem->history = pool_alloc(&history_pool);
+    }
+    if (ditem->history && !ditem->sampling) {
+        ditem->sample_next = sampled_items;
+        if (sampled_items)
+            sampled_items->sample_prev = ditem;
+        sampled_items = ditem;
+        ditem->sampling = 1;
+    }
+    if (ditem->decode && !ditem->listing && !ditem->stream &&
+        !ditem->decoder && open_decoder(ditem))
+        write_log(COLOR_PAIR(1), "Failed to set up decoding of %s\n", ditem->outputfilename);
+    if (ditem->decoder)
+        decode_existing(ditem, from);
+    if (ditem->listing || ditem->stream || ditem->decoder || !delta_mode || from <= 0 || ditem->no_delta ||
+        delta_start(ditem))
+        set_validation(ditem, from);
+    if (!use_prefetch(ditem))
+        queue_prefetch(ditem);
     ditem->start_time = time(NULL);
     ditem->end_time = 0;
-    rc = curl_multi_add_handle(mhandle, ditem->handle);
-    check_mrc("add:", rc);
-    curl_multi_socket_action(mhandle, CURL_SOCKET_TIMEOUT, 0, &still_running);
+    trace_event(TRACE_ADD, ditem->id, from, 0);
+    queue_item(ditem);
+    session_progress(ditem);
+
+    return 0;
 }
 
-static void remove_handle(DownloadItem *ditem)
+/* With -e paused items are first asked for their size, range support
+ * and validators with a HEAD request, up to preflight at a time. A probe
+ * runs through the shards on the item's own handle like a transfer, and
+ * what it found is taken over by the thread owning the download list. */
+static int probe_wanted(DownloadItem *item)
 {
-    CURLMcode rc;
-    rc = curl_multi_remove_handle(mhandle, ditem->handle);
-    check_mrc("remove:", rc);
-    ditem->end_time = time(NULL);
+    return preflight && item->probe_state == PROBE_NONE && item->hot->mode == MODE_PAUSED &&
+           !item->listing && !item->stream;
 }
 
-static void set_timeouts(int check)
+/* with auto start an item waits for its probe, one started while the
+ * probe ran is added now */
+static void start_probed(DownloadItem *item)
 {
-    if (check) {
-        wtimeout(downloads, 100);
-        wtimeout(openwin, 100);
-    } else {
-        wtimeout(downloads, -1);
-        wtimeout(openwin, -1);
+    if (item->hot->mode == MODE_PAUSED && auto_start) {
+        set_mode(item, MODE_ACTIVE);
+    } else if (item->hot->mode != MODE_ACTIVE) {
+        return;
+    }
+    add_handle(item);
+}
+
+static void start_probes()
+{
+    DownloadItem *item;
+
+    while (nb_probing < preflight && (item = probe_queue)) {
+        unqueue_probe(item);
+        if (!probe_wanted(item))
+            continue;
+
+        item->probe = calloc(1, sizeof(*item->probe));
+        if (!item->probe || init_handle(item)) {
+            free_probe(item);
+            item->probe_state = PROBE_DONE;
+            start_probed(item);
+            continue;
+        }
+        item->probe->size = -1;
+        item->probe->ranges = strncasecmp(item->url, "http", 4) != 0;
+        curl_easy_setopt(item->handle, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(item->handle, CURLOPT_NOPROGRESS, 1L);
+        curl_easy_setopt(item->handle, CURLOPT_HTTPHEADER, NULL);
+        curl_easy_setopt(item->handle, CURLOPT_RANGE, NULL);
+        curl_easy_setopt(item->handle, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)0);
+        use_prefetch(item);
+        item->probe_state = PROBE_RUNNING;
+        nb_probing++;
+        queue_item(item);
+    }
+}
+
+/* Runs on the shard thread. */
+static void probe_done(DownloadItem *item, CURLcode result, long rcode)
+{
+    Probe *probe = item->probe;
+    char *url = NULL;
+    int wake;
+
+    detach_item(item);
+    if (result == CURLE_OK && rcode < 400) {
+        curl_easy_getinfo(item->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &probe->size);
+        curl_easy_getinfo(item->handle, CURLINFO_EFFECTIVE_URL, &url);
+        if (url && strcmp(url, item->escape_url))
+            probe->location = clonestring(url, strlen(url));
+    } else if (result != CURLE_OK) {
+        write_log(COLOR_PAIR(3), "Pre-flight of %s failed: %s\n", item->url, curl_easy_strerror(result));
+    }
+    curl_easy_setopt(item->handle, CURLOPT_NOBODY, 0L);
+    curl_easy_setopt(item->handle, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(item->handle, CURLOPT_NOPROGRESS, 0L);
+
+    pthread_mutex_lock(&listing_lock);
+    wake = !probed_items;
+    item->probe_next = probed_items;
+    probed_items = item;
+    pthread_mutex_unlock(&listing_lock);
+
+    if (wake && headless)
+        wake_shard(&shards[0]);
+    else if (wake)
+        wakeup_ui();
+}
+
+/* runs on the thread owning the download list */
+static void apply_probes()
+{
+    DownloadItem *item = NULL, *next;
+
+    if (!preflight)
+        return;
+
+    if (probed_items) {
+        pthread_mutex_lock(&listing_lock);
+        item = probed_items;
+        probed_items = NULL;
+        pthread_mutex_unlock(&listing_lock);
+    }
+
+    for (; item; item = next) {
+        Probe *probe = item->probe;
+
+        next = item->probe_next;
+        item->probe_state = PROBE_DONE;
+        nb_probing--;
+
+        /* stored validators belong to the stored copy, differing ones
+         * mean it changed on the server since */
+        if (!item->etag && !item->last_modified) {
+            item->etag = probe->etag;
+            item->last_modified = probe->last_modified;
+            probe->etag = probe->last_modified = NULL;
+        } else {
+            probe->changed = (item->etag && probe->etag && strcmp(item->etag, probe->etag)) ||
+                             (item->last_modified && probe->last_modified &&
+                              strcmp(item->last_modified, probe->last_modified));
+        }
+        if (probe->size >= 0 && item->hot->total_size <= 0) {
+            item->hot->total_size = probe->size;
+            item_changed(item);
+            session_progress(item);
+        }
+        start_probed(item);
     }
+
+    start_probes();
 }
 
 static void init_windows()
 {
-    downloads = newpad(4096, COLS);
+    downloads = newpad(LINES, COLS);
     if (!downloads) {
         error(-1, "Failed to create downloads window.\n");
     }
@@ -789,6 +6381,10 @@ static void init_windows()
     keypad(downloads,  TRUE);
     keypad(openwin,    TRUE);
 
+    /* input is waited for in wait_input() */
+    wtimeout(downloads, 0);
+    wtimeout(openwin,   0);
+
     leaveok(downloads, TRUE);
     leaveok(helpwin,   TRUE);
     leaveok(infowin,   TRUE);
@@ -805,9 +6401,10 @@ static void auto_startall()
         return;
 
     for (item = items; item; item = item->next) {
-        item->mode = MODE_ACTIVE;
+        if (item->hot->mode != MODE_PAUSED || probe_wanted(item))
+            continue;
+        set_mode(item, MODE_ACTIVE);
         add_handle(item);
-        active_downloads++;
     }
 }
 
@@ -823,14 +6420,239 @@ static int parse_file(char *filename)
 
         if (len > 0 && string[len-1] == '\n')
             string[len-1] = '\0';
-        create_handle(0, string, NULL, NULL, 0);
+        create_handle(0, string, NULL, NULL, STREAM_NONE, 0, DEFAULT_PRIORITY);
+    }
+
+    fclose(file);
+
+    return 0;
+}
+
+/* a comma separated list of interfaces or local addresses */
+static void parse_uplinks(const char *list)
+{
+    while (*list) {
+        size_t len = strcspn(list, ",");
+
+        if (len && nb_uplinks < MAX_UPLINKS) {
+            uplinks[nb_uplinks].name = clonestring(list, len);
+            if (uplinks[nb_uplinks].name)
+                nb_uplinks++;
+        }
+        list += len + !!list[len];
+    }
+}
+
+/* With -N a long running NCDM takes new URLs from manifests, files of
+ * URLs one per line as with -i. Lines appended to a watched file are read
+ * on from where the last read stopped. Files written or moved into a
+ * watched directory are read whole, then renamed with a .done suffix.
+ * inotify events are handled on the first shard, and the URLs handed
+ * over to the download list like listed files. */
+static void add_watch(const char *path)
+{
+    if (nb_watches < MAX_WATCHES) {
+        watches[nb_watches].path = path;
+        watches[nb_watches].wd = -1;
+        watches[nb_watches].parent_wd = -1;
+        nb_watches++;
+    }
+}
+
+/* Queues the URLs of a manifest after *offset. Unless whole, a last line
+ * still being written is left for the next read. Returns the number of
+ * URLs queued. */
+static int read_manifest(const char *path, off_t *offset, int whole)
+{
+    char line[MAX_STRING_LEN];
+    FILE *file = fopen(path, "r");
+    struct stat st;
+    int n = 0;
+
+    if (!file) {
+        write_log(COLOR_PAIR(1), "Failed to open manifest %s\n", path);
+        return 0;
+    }
+
+    /* truncated, started over */
+    if (!fstat(fileno(file), &st) && st.st_size < *offset)
+        *offset = 0;
+    if (fseeko(file, *offset, SEEK_SET)) {
+        fclose(file);
+        return 0;
     }
 
+    while (fgets(line, sizeof(line), file) != NULL) {
+        size_t len = strlen(line);
+        ListedUrl *listed;
+
+        if (line[len-1] != '\n' && feof(file) && !whole)
+            break;
+        *offset = ftello(file);
+        while (len > 0 && isspace((unsigned char)line[len-1]))
+            len--;
+        if (len && (listed = new_listed(line, len))) {
+            listed->manifest = 1;
+            queue_listed(listed);
+            n++;
+        }
+    }
     fclose(file);
 
+    return n;
+}
+
+static void take_manifest(Watch *watch, const char *name)
+{
+    char path[MAX_STRING_LEN], done[MAX_STRING_LEN + 5];
+    size_t len = strlen(name);
+    struct stat st;
+    off_t offset = 0;
+    int n;
+
+    if (name[0] == '.' || (len >= 5 && !strcmp(name + len - 5, ".done")))
+        return;
+    snprintf(path, sizeof(path), "%s/%s", watch->path, name);
+    if (stat(path, &st) || !S_ISREG(st.st_mode))
+        return;
+
+    n = read_manifest(path, &offset, 1);
+    snprintf(done, sizeof(done), "%s.done", path);
+    if (rename(path, done))
+        write_log(COLOR_PAIR(1), "Failed to rename manifest %s: %s\n", path, strerror(errno));
+    else
+        write_log(COLOR_PAIR(7), "Queued %d URLs from %s.\n", n, path);
+}
+
+/* the directory may be watched for other paths too, so its events are
+ * only ever added to */
+static int wait_watch(Watch *watch)
+{
+    char dir[MAX_STRING_LEN];
+    const char *slash = strrchr(watch->path, '/');
+
+    if (!slash)
+        snprintf(dir, sizeof(dir), ".");
+    else if (slash == watch->path)
+        snprintf(dir, sizeof(dir), "/");
+    else
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - watch->path), watch->path);
+    watch->name = slash ? slash + 1 : watch->path;
+    watch->parent_wd = inotify_add_watch(watch_fd, dir, IN_CREATE | IN_MOVED_TO | IN_MASK_ADD);
+
+    return watch->parent_wd < 0 ? -1 : 0;
+}
+
+/* a directory is watched for new manifests and the ones already there
+ * are taken, a file is read from its start */
+static int start_watch(Watch *watch)
+{
+    struct stat st;
+
+    watch->parent_wd = -1;
+    if (stat(watch->path, &st)) {
+        /* created in between, or waited for */
+        if (errno != ENOENT || wait_watch(watch))
+            return -1;
+        if (stat(watch->path, &st)) {
+            write_log(COLOR_PAIR(3), "Waiting for %s to appear.\n", watch->path);
+            return 0;
+        }
+        watch->parent_wd = -1;
+    }
+    watch->dir = S_ISDIR(st.st_mode);
+    watch->offset = 0;
+    watch->wd = inotify_add_watch(watch_fd, watch->path, IN_MASK_ADD | (watch->dir ?
+                                  IN_CLOSE_WRITE | IN_MOVED_TO : WATCH_EVENTS));
+    if (watch->wd < 0)
+        return -1;
+
+    if (watch->dir) {
+        DIR *dir = opendir(watch->path);
+        struct dirent *entry;
+
+        while (dir && (entry = readdir(dir)) != NULL)
+            take_manifest(watch, entry->d_name);
+        if (dir)
+            closedir(dir);
+    } else {
+        read_manifest(watch->path, &watch->offset, 0);
+    }
+
     return 0;
 }
 
+static void count_watches()
+{
+    running_watches = 0;
+    for (int i = 0; i < nb_watches; i++)
+        running_watches += watches[i].wd >= 0 || watches[i].parent_wd >= 0;
+}
+
+static void watch_cb(int fd, short kind, void *userp)
+{
+    union {
+        struct inotify_event event;
+        char data[4096];
+    } buf;
+    ssize_t len;
+    (void)kind;
+    (void)userp;
+
+    while ((len = read(fd, &buf, sizeof(buf))) > 0) {
+        for (char *p = buf.data; p < buf.data + len;) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+
+            p += sizeof(*event) + event->len;
+            /* one directory may serve several watches */
+            for (int i = 0; i < nb_watches; i++) {
+                Watch *watch = &watches[i];
+
+                if (watch->parent_wd == event->wd && event->len &&
+                    (event->mask & (IN_CREATE | IN_MOVED_TO)) && !strcmp(event->name, watch->name)) {
+                    if (start_watch(watch))
+                        write_log(COLOR_PAIR(1), "Failed to watch %s: %s\n", watch->path, strerror(errno));
+                } else if (watch->wd != event->wd) {
+                    continue;
+                } else if (watch->dir) {
+                    if (event->len && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+                        take_manifest(watch, event->name);
+                } else if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+                    /* replaced by a new file, which is read whole */
+                    inotify_rm_watch(fd, watch->wd);
+                    watch->wd = -1;
+                    if (start_watch(watch))
+                        write_log(COLOR_PAIR(1), "Stopped watching %s\n", watch->path);
+                } else if (event->mask & (IN_MODIFY | IN_CLOSE_WRITE)) {
+                    read_manifest(watch->path, &watch->offset, 0);
+                }
+            }
+        }
+    }
+    count_watches();
+}
+
+static void init_watches()
+{
+    if (!nb_watches)
+        return;
+
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd >= 0)
+        watch_event = event_new(shards[0].base, watch_fd, EV_READ | EV_PERSIST, watch_cb, NULL);
+    if (!watch_event || event_add(watch_event, NULL)) {
+        write_log(COLOR_PAIR(1), "Failed to watch manifests: %s\n", strerror(errno));
+        nb_watches = 0;
+        return;
+    }
+
+    for (int i = 0; i < nb_watches; i++) {
+        if (start_watch(&watches[i]))
+            write_log(COLOR_PAIR(1), "Failed to watch %s: %s\n", watches[i].path, strerror(errno));
+    }
+    count_watches();
+}
+
 static int parse_parameters(int argc, char *argv[],
                             long *max_total_connections,
                             long *max_host_connections)
@@ -838,8 +6660,11 @@ static int parse_parameters(int argc, char *argv[],
     const char *referer = NULL;
     const char *output = NULL;
     long max = 0, maxh = 0, speed = 0;
+    int priority = DEFAULT_PRIORITY;
     int overwritefile = 0;
+    int decode = 0;
     int i, param = 0;
+    DownloadItem *item;
 
     for (i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-R")) {
@@ -862,6 +6687,42 @@ static int parse_parameters(int argc, char *argv[],
             param = PARAM_AUTOEXIT;
         } else if (!strcmp(argv[i], "-x")) {
             param = PARAM_AUTOSTART;
+        } else if (!strcmp(argv[i], "-P")) {
+            param = PARAM_PREFETCH;
+        } else if (!strcmp(argv[i], "-V")) {
+            param = PARAM_HTTPVER;
+        } else if (!strcmp(argv[i], "-m")) {
+            param = PARAM_MAXSTREAMS;
+        } else if (!strcmp(argv[i], "-p")) {
+            param = PARAM_PRIORITY;
+        } else if (!strcmp(argv[i], "-f")) {
+            param = PARAM_SESSION;
+        } else if (!strcmp(argv[i], "-w")) {
+            param = PARAM_MAPOUTPUT;
+        } else if (!strcmp(argv[i], "-W")) {
+            param = PARAM_WRITERS;
+        } else if (!strcmp(argv[i], "-F")) {
+            param = PARAM_MAXFPS;
+        } else if (!strcmp(argv[i], "-T")) {
+            param = PARAM_SHARDS;
+        } else if (!strcmp(argv[i], "-B")) {
+            param = PARAM_BALANCE;
+        } else if (!strcmp(argv[i], "-L")) {
+            param = PARAM_LATENCY;
+        } else if (!strcmp(argv[i], "-t")) {
+            param = PARAM_TRACE;
+        } else if (!strcmp(argv[i], "-z")) {
+            param = PARAM_DELTA;
+        } else if (!strcmp(argv[i], "-d")) {
+            param = PARAM_DECODE;
+        } else if (!strcmp(argv[i], "-I")) {
+            param = PARAM_INTERFACES;
+        } else if (!strcmp(argv[i], "-N")) {
+            param = PARAM_WATCH;
+        } else if (!strcmp(argv[i], "-e")) {
+            param = PARAM_PREFLIGHT;
+        } else if (!strcmp(argv[i], "-b")) {
+            param = PARAM_HEADLESS;
         } else {
             if (param == PARAM_REFERER) {
                 referer = argv[i];
@@ -879,169 +6740,905 @@ static int parse_parameters(int argc, char *argv[],
                 auto_exit = !!atol(argv[i]);
             } else if (param == PARAM_AUTOSTART) {
                 auto_start = !!atol(argv[i]);
+            } else if (param == PARAM_PREFETCH) {
+                dns_prefetch = MAX(0, atol(argv[i]));
+            } else if (param == PARAM_HTTPVER) {
+                if (!strcmp(argv[i], "1.1"))
+                    http_version = CURL_HTTP_VERSION_1_1;
+                else if (!strcmp(argv[i], "2"))
+                    http_version = CURL_HTTP_VERSION_2TLS;
+                else if (!strcmp(argv[i], "2p"))
+                    http_version = CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+                else if (!strcmp(argv[i], "3"))
+                    http_version = CURL_HTTP_VERSION_3;
+                else
+                    http_version = CURL_HTTP_VERSION_NONE;
+            } else if (param == PARAM_MAXSTREAMS) {
+                max_streams = MAX(0, atol(argv[i]));
+            } else if (param == PARAM_SESSION) {
+                session_open(argv[i]);
+            } else if (param == PARAM_MAPOUTPUT) {
+                map_output = !!atol(argv[i]);
+            } else if (param == PARAM_WRITERS) {
+                nb_writers = MIN(MAX(0, atol(argv[i])), MAX_WRITERS);
+            } else if (param == PARAM_MAXFPS) {
+                max_fps = MIN(MAX(1, atol(argv[i])), 1000);
+            } else if (param == PARAM_SHARDS) {
+                nb_shards = MIN(MAX(1, atol(argv[i])), MAX_SHARDS);
+            } else if (param == PARAM_BALANCE) {
+                balance_load = !!atol(argv[i]);
+            } else if (param == PARAM_LATENCY) {
+                latency_filename = argv[i];
+            } else if (param == PARAM_TRACE) {
+                trace_filename = argv[i];
+            } else if (param == PARAM_DELTA) {
+                delta_mode = !!atol(argv[i]);
+            } else if (param == PARAM_DECODE) {
+                decode = !!atol(argv[i]);
+            } else if (param == PARAM_INTERFACES) {
+                parse_uplinks(argv[i]);
+            } else if (param == PARAM_WATCH) {
+                add_watch(argv[i]);
+            } else if (param == PARAM_PREFLIGHT) {
+                preflight = MAX(0, atol(argv[i]));
+            } else if (param == PARAM_PRIORITY) {
+                priority = MIN(MAX(MIN_PRIORITY, atol(argv[i])), MAX_PRIORITY);
+            } else if (param == PARAM_HEADLESS) {
+                /* taken by parse_headless already */
             } else {
-                create_handle(overwritefile, argv[i], referer, output, speed);
+                /* a finished URL given again is re-queued, not appended */
+                if (!create_handle(overwritefile, argv[i], referer, output,
+                                   output ? output_stream(output) : STREAM_NONE, speed, priority) && decode &&
+                    (item = find_url(argv[i]))) {
+                    item->decode = 1;
+                    session_item(item);
+                }
                 referer = output = NULL;
                 overwritefile = 0;
+                decode = 0;
                 speed = 0;
+                priority = DEFAULT_PRIORITY;
             }
             param = 0;
         }
     }
 
-    *max_total_connections = max;
-    *max_host_connections = maxh;
+    *max_total_connections = max;
+    *max_host_connections = maxh;
+
+    return i;
+}
+
+/* -b is needed before the screen is created, so it is picked out of the
+ * parameters ahead of the rest; every switch takes a value */
+static void parse_headless(int argc, char *argv[])
+{
+    for (int i = 1; i < argc - 1; i++) {
+        if (argv[i][0] != '-' || !argv[i][1] || argv[i][2])
+            continue;
+        if (argv[i][1] == 'b')
+            headless = !!atol(argv[i + 1]);
+        i++;
+    }
+}
+
+/* runs on the thread owning the download list, listed files start
+ * right away as their listing was running */
+static void add_listed()
+{
+    ListedUrl *listed, *next;
+    unsigned n = 0;
+
+    pthread_mutex_lock(&listing_lock);
+    listed = listed_urls;
+    listed_urls = listed_tail = NULL;
+    pthread_mutex_unlock(&listing_lock);
+
+    for (; listed; listed = next) {
+        DownloadItem *item = find_url(listed->url);
+
+        next = listed->next;
+        /* manifests only add what is not in the list yet, started like
+         * the URLs given on the command line */
+        if (listed->manifest) {
+            if (item || create_handle(0, listed->url, NULL, NULL, STREAM_NONE, 0, DEFAULT_PRIORITY))
+                item = NULL;
+            else
+                item = auto_start && !preflight ? items_tail : NULL;
+        /* listing again adds what is new and checks what finished */
+        } else if (!item)
+            item = create_handle(0, listed->url, listed->referer, NULL, STREAM_NONE,
+                                 listed->speed, listed->priority) ? NULL : items_tail;
+        else if (item->hot->mode != MODE_FINISHED ||
+                 create_handle(0, listed->url, listed->referer, NULL, STREAM_NONE,
+                               listed->speed, listed->priority))
+            item = NULL;
+        if (item) {
+            set_mode(item, MODE_ACTIVE);
+            add_handle(item);
+        }
+        free(listed->url);
+        free(listed->referer);
+        free(listed);
+        n++;
+    }
+
+    /* counted until added, so nothing exits in between */
+    pthread_mutex_lock(&listing_lock);
+    nb_listed -= n;
+    pthread_mutex_unlock(&listing_lock);
+}
 
-    return i;
+/* without the UI nobody restarts a failed item, so it counts as done
+ * and makes the exit status 1 */
+static void check_auto_exit()
+{
+    int done, failed;
+
+    pthread_mutex_lock(&queue_lock);
+    failed = inactive_downloads;
+    done = finished_downloads + (headless ? failed : 0);
+    pthread_mutex_unlock(&queue_lock);
+
+    if (auto_exit && (done > 0) && (done == nb_ditems) && !nb_listed && !running_watches)
+        finish(headless && failed);
+}
+
+static void update_downloading()
+{
+    int running = 0;
+
+    for (int i = 0; i < nb_shards; i++)
+        running += shards[i].still_running;
+    downloading = running > 0;
+}
+
+/* Runs on the shard thread. Once the control file was read the remote
+ * copy is known to differ in places, so a failing update fetches it all
+ * instead of trusting the old copy as a prefix. */
+static void delta_fallback(DownloadItem *item, const char *why)
+{
+    int changed = item->delta->state != DELTA_CONTROL;
+    curl_off_t from;
+
+    write_log(COLOR_PAIR(3), "No delta update of %s: %s, downloading it normally.\n",
+              item->outputfilename, why);
+    free_delta(item);
+    item->no_delta = 1;
+    curl_easy_setopt(item->handle, CURLOPT_URL, item->escape_url);
+    if (changed)
+        restart_output(item);
+    fseek(item->outputfile, 0, SEEK_END);
+    from = item->hot->downloaded = ftell(item->outputfile);
+    item->write_pos = from;
+    set_validation(item, from);
+    use_prefetch(item);
+    queue_item(item);
+}
+
+static void delta_fetch(DownloadItem *item)
+{
+    Delta *delta = item->delta;
+    char range[DELTA_MAX_RANGES * 48];
+    size_t len = 0;
+
+    for (int n = 0; n < DELTA_MAX_RANGES && delta->next_range < delta->nb_ranges; n++) {
+        curl_off_t *r = &delta->ranges[2 * delta->next_range++];
+
+        len += snprintf(range + len, sizeof(range) - len, "%s%" CURL_FORMAT_CURL_OFF_T "-%"
+                        CURL_FORMAT_CURL_OFF_T, n ? "," : "", r[0], r[1] - 1);
+    }
+    delta->full = 0;
+    curl_easy_setopt(item->handle, CURLOPT_URL, item->escape_url);
+    curl_easy_setopt(item->handle, CURLOPT_RANGE, range);
+    use_prefetch(item);
+    queue_item(item);
+}
+
+static void delta_finish(DownloadItem *item)
+{
+    Delta *delta = item->delta;
+    curl_off_t fetched = delta->fetched, length = delta->length;
+
+    close(delta->fd);
+    delta->fd = -1;
+    if (rename(delta->tmpname, item->outputfilename)) {
+        delta_fallback(item, "failed to replace the old copy");
+        return;
+    }
+    free(delta->tmpname);
+    delta->tmpname = NULL;
+    free_delta(item);
+
+    fclose(item->outputfile);
+    item->outputfile = fopen(item->outputfilename, "rb+");
+    item->hot->downloaded = item->hot->done = item->hot->total_size = item->write_pos = length;
+    if (!item->outputfile) {
+        write_log(COLOR_PAIR(1), "Failed to open updated %s\n", item->outputfilename);
+        fail_item(item);
+        return;
+    }
+    finish_item(item);
+    write_log(COLOR_PAIR(7), "Updated %s, fetched %" CURL_FORMAT_CURL_OFF_T " of %"
+              CURL_FORMAT_CURL_OFF_T " bytes.\n", item->outputfilename, fetched, length);
+}
+
+static void delta_done(DownloadItem *item, CURLcode result, long rcode)
+{
+    Delta *delta = item->delta;
+    char why[256];
+
+    detach_item(item);
+    if (result != CURLE_OK) {
+        snprintf(why, sizeof(why), "%s", curl_easy_strerror(result));
+        delta_fallback(item, why);
+    } else if (delta->state == DELTA_CONTROL) {
+        if (rcode != 200)
+            delta_fallback(item, "no control file");
+        else if (parse_control(delta))
+            delta_fallback(item, "bad control file");
+        else if (start_delta_thread(item, DELTA_SCAN))
+            delta_fallback(item, "failed to start scan");
+    } else if (rcode != 200 && rcode != 206) {
+        snprintf(why, sizeof(why), "server answered %ld", rcode);
+        delta_fallback(item, why);
+    } else if (!delta->full && delta->next_range < delta->nb_ranges) {
+        delta_fetch(item);
+    } else if (start_delta_thread(item, DELTA_VERIFY)) {
+        delta_fallback(item, "failed to start check");
+    }
+}
+
+/* picks up items whose scan or check finished */
+static void delta_ready(Shard *shard)
+{
+    DownloadItem *item, *next;
+
+    pthread_mutex_lock(&queue_lock);
+    item = shard->delta_ready;
+    shard->delta_ready = NULL;
+    pthread_mutex_unlock(&queue_lock);
+
+    for (; item; item = next) {
+        Delta *delta = item->delta;
+
+        next = delta->ready_next;
+        pthread_join(delta->thread, NULL);
+        delta->thread_started = 0;
+        if (delta->error) {
+            delta_fallback(item, delta->state == DELTA_SCAN ? "failed to scan the old copy" : "checksum mismatch");
+        } else if (delta->state == DELTA_SCAN) {
+            /* the block sums are only needed to check the result when
+             * there is no SHA-1 for it */
+            if (delta->has_sha1) {
+                free(delta->control);
+                delta->control = NULL;
+                delta->sums = NULL;
+            }
+            free(delta->rsums);
+            free(delta->heads);
+            free(delta->chain);
+            free(delta->filter);
+            delta->rsums = delta->heads = delta->chain = NULL;
+            delta->filter = NULL;
+            write_log(COLOR_PAIR(7), "Found %" CURL_FORMAT_CURL_OFF_T " of %" CURL_FORMAT_CURL_OFF_T
+                      " bytes of %s in the old copy.\n", delta->found_bytes, delta->length,
+                      item->outputfilename);
+            delta->state = DELTA_FETCH;
+            if (delta->nb_ranges)
+                delta_fetch(item);
+            else if (start_delta_thread(item, DELTA_VERIFY))
+                delta_fallback(item, "failed to start check");
+        } else {
+            delta_finish(item);
+        }
+    }
 }
 
-static void check_multi_info()
+static void check_multi_info(Shard *shard)
 {
     char *eff_url;
     CURLMsg *msg;
     int msgs_left;
     DownloadItem *ditem;
     CURL *easy;
+    long rcode;
+    int unchanged, write_failed;
 
-    while ((msg = curl_multi_info_read(mhandle, &msgs_left))) {
+    while ((msg = curl_multi_info_read(shard->multi, &msgs_left))) {
         if (msg->msg == CURLMSG_DONE) {
             easy = msg->easy_handle;
             curl_easy_getinfo(easy, CURLINFO_PRIVATE, &ditem);
             curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &eff_url);
-            remove_handle(ditem);
-            ditem->mode = MODE_FINISHED;
-            ditem->progress = 100.;
-            finished_downloads++;
-            active_downloads--;
-            write_log(COLOR_PAIR(7), "Finished downloading %s.\n", ditem->outputfilename);
+            curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &rcode);
+            if (ditem->probe_state == PROBE_RUNNING) {
+                probe_done(ditem, msg->data.result, rcode);
+                continue;
+            }
+            if (ditem->delta) {
+                delta_done(ditem, msg->data.result, rcode);
+                continue;
+            }
+            /* still validating means no content came, the copy is current */
+            unchanged = ditem->validate && (rcode == 304 || rcode == 416);
+            ditem->validate = VALIDATE_NONE;
+            /* done before the item counts as finished, which may exit;
+             * what did not reach the disk leaves it failed */
+            if (ditem->stream)
+                write_failed = close_output(ditem);
+            else
+                write_failed = !ditem->listing && flush_writes(ditem);
+            if (write_failed) {
+                write_log(COLOR_PAIR(1), "Failed to write %s\n", ditem->outputfilename);
+                fail_item(ditem);
+                continue;
+            }
+            if (ditem->decoder && finish_decoder(ditem)) {
+                fail_item(ditem);
+                continue;
+            }
+            finish_item(ditem);
+            if (ditem->listing)
+                write_log(COLOR_PAIR(7), "Listed %u files from %s.\n", ditem->nb_entries, ditem->url);
+            else if (unchanged)
+                write_log(COLOR_PAIR(7), "%s not modified.\n", ditem->outputfilename);
+            else
+                write_log(COLOR_PAIR(7), "Finished downloading %s.\n", ditem->outputfilename);
         }
     }
 
-    if (auto_exit && (finished_downloads > 0) && (finished_downloads == nb_ditems))
-        finish(0);
+    delta_ready(shard);
+
+    /* the resolver lives on the first shard, so does the download list
+     * when headless */
+    if (shard == &shards[0] && headless) {
+        add_listed();
+        apply_probes();
+    }
+    if (shard == &shards[0])
+        prefetch_dns();
+
+    start_queued(shard);
+
+    check_auto_exit();
 }
 
 static void timer_cb(int fd, short kind, void *userp)
 {
+    uint64_t start = trace_now();
+    Shard *shard = userp;
     CURLMcode rc;
     (void)fd;
     (void)kind;
-    (void)userp;
 
-    rc = curl_multi_socket_action(mhandle, CURL_SOCKET_TIMEOUT, 0, &still_running);
+    rc = curl_multi_socket_action(shard->multi, CURL_SOCKET_TIMEOUT, 0, &shard->still_running);
     check_mrc("timer_cb:", rc);
-    check_multi_info();
-    downloading = still_running > 0;
+    check_multi_info(shard);
+    update_downloading();
+    trace_event(TRACE_TIMER, 0, shard->still_running, start);
+}
+
+static void wakeup_cb(int fd, short kind, void *userp)
+{
+    Shard *shard = userp;
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock(&queue_lock);
+    detach_requested(shard);
+    pthread_mutex_unlock(&queue_lock);
+
+    if (shard->stop) {
+        event_base_loopbreak(shard->base);
+        return;
+    }
+
+    resume_writes(shard);
+    timer_cb(fd, kind, userp);
 }
 
-static int multi_timer_cb(CURLM *multi, long timeout_ms, void *unused)
+static int multi_timer_cb(CURLM *multi, long timeout_ms, void *userp)
 {
+    Shard *shard = userp;
     (void)multi;
-    (void)unused;
 
-    if (timeout_ms > 0) {
+    if (timeout_ms >= 0) {
         struct timeval timeout;
 
         timeout.tv_sec = timeout_ms/1000;
         timeout.tv_usec = (timeout_ms%1000)*1000;
 
-        evtimer_add(timerevent, &timeout);
-    } else if (timeout_ms == 0) {
-        check_multi_info();
+        evtimer_add(shard->timer, &timeout);
+    } else {
+        evtimer_del(shard->timer);
     }
 
     return 0;
 }
 
-static void remove_sock(SockInfo *f)
+/* Socket slots are indexed by fd and never freed while running, so
+ * their events are reassigned in place instead of reallocated. */
+static SockInfo *get_sock(Shard *shard, curl_socket_t s)
+{
+    if (s >= shard->sock_table_size) {
+        int size = MAX(s + 1, shard->sock_table_size * 2);
+        SockInfo **table = realloc(shard->sock_table, size * sizeof(*table));
+
+        if (!table)
+            return NULL;
+        memset(table + shard->sock_table_size, 0, (size - shard->sock_table_size) * sizeof(*table));
+        shard->sock_table = table;
+        shard->sock_table_size = size;
+    }
+
+    if (!shard->sock_table[s])
+        shard->sock_table[s] = pool_alloc(&shard->sock_pool);
+
+    return shard->sock_table[s];
+}
+
+static void remove_sock(Shard *shard, SockInfo *f)
 {
     if (f) {
         if (f->evset)
-            event_free(f->ev);
-        free(f);
+            event_del(&f->ev);
+        f->evset = 0;
+        shard->nb_socks--;
     }
 }
 
 static void event_cb(int fd, short kind, void *userp)
 {
+    uint64_t start = trace_now();
+    Shard *shard = userp;
     CURLMcode rc;
-    (void)userp;
 
     int action = (kind & EV_READ ? CURL_CSELECT_IN : 0) | (kind & EV_WRITE ? CURL_CSELECT_OUT : 0);
 
-    rc = curl_multi_socket_action(mhandle, fd, action, &still_running);
+    rc = curl_multi_socket_action(shard->multi, fd, action, &shard->still_running);
     check_mrc("event_cb:", rc);
 
-    check_multi_info();
-    downloading = still_running > 0;
-    if (still_running <= 0) {
-        if (evtimer_pending(timerevent, NULL)) {
-            evtimer_del(timerevent);
+    check_multi_info(shard);
+    update_downloading();
+    /* items started by check_multi_info() are not counted yet */
+    if (shard->still_running <= 0 && !shard->running) {
+        if (evtimer_pending(shard->timer, NULL)) {
+            evtimer_del(shard->timer);
         }
     }
+    trace_event(TRACE_SOCKET_EVENT, fd, action, start);
 }
 
-static void set_sock(SockInfo *f, curl_socket_t s, CURL *e, int act)
+static void set_sock(Shard *shard, SockInfo *f, curl_socket_t s, CURL *e, int act)
 {
     int kind = (act&CURL_POLL_IN?EV_READ:0)|(act&CURL_POLL_OUT?EV_WRITE:0)|EV_PERSIST;
 
-    f->sockfd = s;
-    f->action = act;
     f->easy = e;
+    if (f->evset && f->sockfd == s && f->action == act) {
+        shard->sock_updates_avoided++;
+        return;
+    }
+
     if (f->evset)
-        event_free(f->ev);
-    f->ev = event_new(eventbase, f->sockfd, kind, event_cb, NULL);
+        event_del(&f->ev);
+    f->sockfd = s;
+    f->action = act;
+    event_assign(&f->ev, shard->base, f->sockfd, kind, event_cb, shard);
     f->evset = 1;
-    event_add(f->ev, NULL);
+    event_add(&f->ev, NULL);
+    shard->sock_updates++;
 }
 
-static void add_sock(curl_socket_t s, CURL *easy, int action)
+static void add_sock(Shard *shard, curl_socket_t s, CURL *easy, int action)
 {
-    SockInfo *fdp = calloc(1, sizeof(SockInfo));
+    SockInfo *fdp = get_sock(shard, s);
 
-    set_sock(fdp, s, easy, action);
-    curl_multi_assign(mhandle, s, fdp);
+    if (!fdp) {
+        write_log(COLOR_PAIR(1), "Failed to allocate socket slot\n");
+        return;
+    }
+    shard->nb_socks++;
+    set_sock(shard, fdp, s, easy, action);
+    curl_multi_assign(shard->multi, s, fdp);
 }
 
 static int sock_cb(CURL *e, curl_socket_t s, int what, void *cbp, void *sockp)
 {
     SockInfo *fdp = (SockInfo*)sockp;
-    (void)cbp;
+    Shard *shard = cbp;
+
+    trace_event(TRACE_SOCKET, s, what, 0);
 
     if (what == CURL_POLL_REMOVE) {
-        remove_sock(fdp);
+        remove_sock(shard, fdp);
     } else {
         if (!fdp) {
-            add_sock(s, e, what);
+            add_sock(shard, s, e, what);
         } else {
-            set_sock(fdp, s, e, what);
+            set_sock(shard, fdp, s, e, what);
         }
     }
 
     return 0;
 }
 
-static void *do_curl(void *unused)
+static void *do_shard(void *arg)
 {
-    (void)unused;
+    Shard *shard = arg;
 
-    for (;;) {
-        event_base_loop(eventbase, 0);
-        sleep(1);
-    }
+    trace_register(TRACE_TRANSFER_THREAD, shard - shards);
+
+    /* shards without items of their own steal from the start */
+    start_queued(shard);
+
+    /* the persistent wakeup event keeps the loop running while idle */
+    event_base_dispatch(shard->base);
+    leave_shard(shard);
 
     return NULL;
 }
 
+static int init_shards(long max_total_connections, long max_host_connections)
+{
+    long max_total = (max_total_connections + nb_shards - 1) / nb_shards;
+
+    shards = calloc(nb_shards, sizeof(*shards));
+    if (!shards)
+        return -1;
+
+    for (int i = 0; i < nb_shards; i++) {
+        Shard *shard = &shards[i];
+
+        shard->pipe[0] = shard->pipe[1] = -1;
+        init_pool(&shard->sock_pool, sizeof(SockInfo));
+        shard->multi = curl_multi_init();
+        shard->base = event_base_new();
+        shard->uplink_bytes = calloc(MAX(nb_uplinks, 1), sizeof(*shard->uplink_bytes));
+        shard->uplink_seen = calloc(MAX(nb_uplinks, 1), sizeof(*shard->uplink_seen));
+        if (!shard->multi || !shard->base || !shard->uplink_bytes || !shard->uplink_seen ||
+            pipe(shard->pipe))
+            return -1;
+        fcntl(shard->pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(shard->pipe[1], F_SETFL, O_NONBLOCK);
+        shard->timer = evtimer_new(shard->base, timer_cb, shard);
+        shard->wake = event_new(shard->base, shard->pipe[0], EV_READ | EV_PERSIST, wakeup_cb, shard);
+        if (!shard->timer || !shard->wake || event_add(shard->wake, NULL))
+            return -1;
+
+        curl_multi_setopt(shard->multi, CURLMOPT_SOCKETFUNCTION, sock_cb);
+        curl_multi_setopt(shard->multi, CURLMOPT_SOCKETDATA, shard);
+        curl_multi_setopt(shard->multi, CURLMOPT_TIMERFUNCTION, multi_timer_cb);
+        curl_multi_setopt(shard->multi, CURLMOPT_TIMERDATA, shard);
+        curl_multi_setopt(shard->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, max_total);
+        curl_multi_setopt(shard->multi, CURLMOPT_MAX_HOST_CONNECTIONS, max_host_connections);
+        curl_multi_setopt(shard->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        if (max_streams > 0)
+            curl_multi_setopt(shard->multi, CURLMOPT_MAX_CONCURRENT_STREAMS, max_streams);
+    }
+
+    /* with a connection limit a shard only takes what it can run, so the
+     * rest stays queued where idle shards can steal it */
+    if (nb_shards > 1 && max_total > 0) {
+        long streams = 1;
+
+        if (http_version >= CURL_HTTP_VERSION_2_0)
+            streams = max_streams > 0 ? max_streams : 100;
+        shard_capacity = max_total * streams;
+    }
+
+    return 0;
+}
+
+static int handle_key(int c, int *overwritefile)
+{
+    update_sort();
+
+    if (c == '1') {
+        current_mode = MODE_ALL;
+    } else if (c == '2') {
+        current_mode = MODE_INACTIVE;
+    } else if (c == '3') {
+        current_mode = MODE_PAUSED;
+    } else if (c == '4') {
+        current_mode = MODE_ACTIVE;
+    } else if (c == '5') {
+        current_mode = MODE_FINISHED;
+    } else if (c == KEY_F(1) || c == '?') {
+        help_active = !help_active;
+    } else if (c == 'i') {
+        info_active = !info_active;
+    } else if (c == 'l') {
+        log_active = !log_active;
+    } else if (c == 'A' || c == 'a') {
+        *overwritefile = c == 'A';
+
+        return ENTERING_URL;
+    } else if (c == 'o') {
+        set_sort((sort_key + 1) % NB_SORTS, sort_reverse);
+    } else if (c == 'O') {
+        set_sort(sort_key, !sort_reverse);
+    } else if (c == 'Q') {
+        finish(0);
+    } else if (c == 'S') {
+        downloading = !downloading;
+        if (downloading && items) {
+            start_time = time(NULL);
+
+            for (unsigned i = 0; i < nb_order; i++) {
+                DownloadItem *item;
+
+                if (item_order[i] == NO_SLOT || slot_hot(item_order[i])->mode != MODE_PAUSED)
+                    continue;
+                item = slot_item(item_order[i]);
+                set_mode(item, MODE_ACTIVE);
+                add_handle(item);
+            }
+        } else if (items) {
+            for (unsigned i = 0; i < nb_order; i++) {
+                DownloadItem *item;
+
+                if (item_order[i] == NO_SLOT || slot_hot(item_order[i])->mode != MODE_ACTIVE)
+                    continue;
+                item = slot_item(item_order[i]);
+                set_mode(item, MODE_PAUSED);
+                remove_handle(item);
+                session_progress(item);
+                queue_probe(item);
+            }
+        }
+    } else if (c == 'h') {
+        if (sitem[current_mode] && sitem[current_mode]->hot->mode == MODE_INACTIVE) {
+            set_mode(sitem[current_mode], MODE_PAUSED);
+            session_progress(sitem[current_mode]);
+            queue_probe(sitem[current_mode]);
+        }
+    } else if (c == 'D') {
+        if (sitem[current_mode] && (!current_mode || (sitem[current_mode]->hot->mode == current_mode))) {
+            sitem[current_mode] = delete_ditem(sitem[current_mode]);
+        }
+    } else if (c == 'R') {
+        if (sitem[current_mode])
+            return ENTERING_REFERER;
+    } else if (c == '/') {
+        search_origin = sitem[current_mode];
+        search_found = 1;
+        return ENTERING_SEARCH;
+    } else if (c == 'n') {
+        if (last_search) {
+            DownloadItem *nsitem = search_view(last_search, step_item(sitem[current_mode], 0), 0);
+
+            if (nsitem)
+                sitem[current_mode] = nsitem;
+        }
+    } else if (c == 'N') {
+        if (last_search) {
+            DownloadItem *nsitem = search_view(last_search, step_item(sitem[current_mode], 1), 1);
+
+            if (nsitem)
+                sitem[current_mode] = nsitem;
+        }
+    } else if (c == 'H') {
+        if (sitem[current_mode] && sitem[current_mode]->hot->mode != MODE_INACTIVE) {
+            if (sitem[current_mode]->hot->mode == MODE_ACTIVE)
+                remove_handle(sitem[current_mode]);
+            set_mode(sitem[current_mode], MODE_INACTIVE);
+            session_progress(sitem[current_mode]);
+        }
+    } else if (c == 'p') {
+        if (sitem[current_mode] && (sitem[current_mode]->hot->mode == MODE_ACTIVE ||
+                                    sitem[current_mode]->hot->mode == MODE_PAUSED)) {
+            if (sitem[current_mode]->hot->mode == MODE_ACTIVE) {
+                remove_handle(sitem[current_mode]);
+                set_mode(sitem[current_mode], MODE_PAUSED);
+                session_progress(sitem[current_mode]);
+                queue_probe(sitem[current_mode]);
+            } else {
+                set_mode(sitem[current_mode], MODE_ACTIVE);
+                downloading = 1;
+                add_handle(sitem[current_mode]);
+                if (start_time == INT_MIN)
+                    start_time = sitem[current_mode]->start_time;
+            }
+
+            if (current_mode && sitem[current_mode]->hot->mode != current_mode) {
+                DownloadItem *temp = sitem[current_mode];
+
+                sitem[current_mode] = step_item(temp, 0);
+                if (!sitem[current_mode])
+                    sitem[current_mode] = step_item(temp, 1);
+            }
+
+        }
+    } else if (c == KEY_DOWN || c == KEY_UP) {
+        DownloadItem *item = NULL;
+
+        if (sitem[current_mode])
+            item = step_item(sitem[current_mode], c == KEY_UP);
+        if (item)
+            sitem[current_mode] = item;
+
+        if (!sitem[current_mode])
+            sitem[current_mode] = step_item(NULL, 0);
+    } else if (c == KEY_NPAGE || c == KEY_PPAGE) {
+        if (!sitem[current_mode]) {
+            current_page += c == KEY_NPAGE ? 1 : -1;
+            current_page = MAX(0, MIN(current_page, nb_ditems / (LINES-1)));
+        } else {
+            DownloadItem *item = sitem[current_mode];
+
+            for (int i = 0; i < LINES && (item = step_item(item, c == KEY_PPAGE)); i++)
+                sitem[current_mode] = item;
+        }
+    } else if (c == KEY_RIGHT) {
+        if (sitem[current_mode]) {
+            sitem[current_mode]->max_speed += 1024;
+            curl_easy_setopt(sitem[current_mode]->handle, CURLOPT_MAX_RECV_SPEED_LARGE,
+                             sitem[current_mode]->max_speed);
+            session_progress(sitem[current_mode]);
+        }
+    } else if (c == KEY_LEFT) {
+        if (sitem[current_mode]) {
+            sitem[current_mode]->max_speed = MAX(0, sitem[current_mode]->max_speed - 1024);
+            curl_easy_setopt(sitem[current_mode]->handle, CURLOPT_MAX_RECV_SPEED_LARGE,
+                             sitem[current_mode]->max_speed);
+            session_progress(sitem[current_mode]);
+        }
+    } else if (c == '+') {
+        if (sitem[current_mode]) {
+            sitem[current_mode]->priority = MIN(MAX_PRIORITY, sitem[current_mode]->priority + 1);
+            curl_easy_setopt(sitem[current_mode]->handle, CURLOPT_STREAM_WEIGHT,
+                             (long)sitem[current_mode]->priority);
+            session_progress(sitem[current_mode]);
+        }
+    } else if (c == '-') {
+        if (sitem[current_mode]) {
+            sitem[current_mode]->priority = MAX(MIN_PRIORITY, sitem[current_mode]->priority - 1);
+            curl_easy_setopt(sitem[current_mode]->handle, CURLOPT_STREAM_WEIGHT,
+                             (long)sitem[current_mode]->priority);
+            session_progress(sitem[current_mode]);
+        }
+    } else if (c == KEY_HOME || c == KEY_END) {
+        if (sitem[current_mode])
+            sitem[current_mode] = step_item(NULL, c == KEY_END);
+    } else if (c == KEY_RESIZE) {
+        delwin(openwin);
+        delwin(infowin);
+        delwin(helpwin);
+        delwin(statuswin);
+        delwin(logwin);
+        delwin(downloads);
+        clear();
+        refresh();
+        endwin();
+
+        init_windows();
+
+        help_active = 0;
+        current_page = 0;
+    } else if (c == KEY_MOUSE) {
+        MEVENT mouse_event;
+        int y;
+
+        if (getmouse(&mouse_event) == OK && (y = view_offset + mouse_event.y) >= 0) {
+            DownloadItem *item = view_select(y);
+
+            if (item)
+                sitem[current_mode] = item;
+        }
+    }
+
+    return 0;
+}
+
+/* search as you type, from the item selected when the search began */
+static void search_live()
+{
+    DownloadItem *found = NULL;
+
+    free(last_search);
+    last_search = string[0] ? clonestring(string, strlen(string)) : NULL;
+    if (last_search)
+        found = search_view(last_search, search_origin ? search_origin : step_item(NULL, 0), 0);
+
+    search_found = found || !last_search;
+    sitem[current_mode] = found ? found : search_origin;
+}
+
+static void render_frame()
+{
+    uint64_t start = trace_now();
+
+    clock_gettime(CLOCK_MONOTONIC, &last_frame);
+    ui_dirty = 0;
+
+    if (downloading)
+        sample_history();
+    apply_probes();
+    update_sort();
+
+    write_downloads();
+    write_statuswin(downloading);
+
+    if (info_active)
+        write_infowin(sitem[current_mode]);
+
+    if (log_active)
+        write_logwin();
+
+    if (help_active)
+        write_helpwin();
+
+    doupdate();
+    trace_event(TRACE_FRAME, 0, nb_ditems, start);
+}
+
+/* Sleep until a key is pressed or the curl thread reported a change.
+ * Returns 0 when a frame is due, redraws caused by transfers are capped
+ * at max_fps frames a second. */
+static int wait_input()
+{
+    struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { ui_pipe[0], POLLIN, 0 } };
+    long frame_ms = 1000 / max_fps;
+
+    for (;;) {
+        /* a frame a second at least keeps the history going */
+        int timeout = downloading ? 1000 : -1;
+        int ret;
+
+        if (ui_dirty) {
+            struct timespec now;
+            long elapsed;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = (now.tv_sec - last_frame.tv_sec) * 1000 +
+                      (now.tv_nsec - last_frame.tv_nsec) / 1000000;
+            if (elapsed >= frame_ms)
+                return 0;
+            timeout = frame_ms - elapsed;
+        }
+
+        /* interrupted by a resize, let ncurses report it */
+        ret = poll(fds, 2, timeout);
+        if (ret < 0 || fds[0].revents)
+            return 1;
+        if (!ret)
+            return 0;
+
+        if (fds[1].revents) {
+            char buf[64];
+
+            while (read(ui_pipe[0], buf, sizeof(buf)) > 0)
+                ;
+            pthread_mutex_lock(&ui_lock);
+            ui_pending = 0;
+            pthread_mutex_unlock(&ui_lock);
+            ui_dirty = 1;
+        }
+    }
+}
+
 static void *do_ncurses(void *unused)
 {
     int active_input = 0;
     int overwritefile = 0;
     (void)unused;
 
+    trace_register(TRACE_UI_THREAD, 0);
+
     for (;;) {
         int c;
 
+        if (!wait_input()) {
+            if (nb_listed) {
+                add_listed();
+                check_auto_exit();
+            }
+            render_frame();
+            continue;
+        }
+
         if (active_input) {
             int skip_y, skip_x;
 
@@ -1054,27 +7651,29 @@ static void *do_ncurses(void *unused)
                 mvwaddstr(openwin, 0, 0, "Search: ");
             getyx(openwin, skip_y, skip_x);
 
+            /* past the cursor cell, which the next clear starts from */
+            if (active_input == ENTERING_SEARCH && !search_found)
+                mvwaddstr(openwin, skip_y, skip_x + strlen(string) + 1, "[no match]");
+
             c = wgetch(openwin);
             if (c == KEY_ENTER || c == '\n' || c == '\r') {
-                if (active_input == ENTERING_URL && create_handle(overwritefile, string, NULL, NULL, 0)) {
+                if (active_input == ENTERING_URL &&
+                    create_handle(overwritefile, string, NULL, NULL, STREAM_NONE, 0, DEFAULT_PRIORITY)) {
                     active_input = 0;
                     doupdate();
                     continue;
                 } else if (active_input == ENTERING_REFERER) {
-                    if (sitem[current_mode])
-                        curl_easy_setopt(sitem[current_mode]->handle, CURLOPT_REFERER, string);
-                } else if (active_input == ENTERING_SEARCH) {
-                    DownloadItem *nsitem = items;
-
-                    for (;nsitem; nsitem = nsitem->next) {
-                        if ((nsitem->mode == current_mode || !current_mode) &&
-                            strstr(nsitem->outputfilename, string)) {
-                            sitem[current_mode] = nsitem;
-                            break;
-                        }
+                    if (sitem[current_mode]) {
+                        DownloadItem *item = sitem[current_mode];
+
+                        /* the old one stays in the item's strings */
+                        item->referer = item_string(item, string, strlen(string));
+                        curl_easy_setopt(item->handle, CURLOPT_REFERER, item->referer);
+                        session_item(item);
                     }
-                    free(last_search);
-                    last_search = clonestring(string, strlen(string));
+                } else if (active_input == ENTERING_SEARCH) {
+                    /* the match was already selected while typing */
+                    search_origin = NULL;
                 }
                 string_pos = 0;
                 string[0] = '\0';
@@ -1092,328 +7691,20 @@ static void *do_ncurses(void *unused)
                     string[string_pos] = 0;
                 }
             }
+            if (active_input == ENTERING_SEARCH)
+                search_live();
             mvwaddstr(openwin, skip_y, skip_x, string + MAX((signed)strlen(string) + skip_x - COLS, 0));
+            wclrtoeol(openwin);
             mvwchgat(openwin, skip_y, MIN(skip_x + (signed)strlen(string), COLS-1), 1, A_BLINK | A_REVERSE, 2, NULL);
         } else if (!active_input) {
             c = wgetch(downloads);
 
-            if (c == '1') {
-                current_mode = MODE_ALL;
-            } else if (c == '2') {
-                current_mode = MODE_INACTIVE;
-            } else if (c == '3') {
-                current_mode = MODE_PAUSED;
-            } else if (c == '4') {
-                current_mode = MODE_ACTIVE;
-            } else if (c == '5') {
-                current_mode = MODE_FINISHED;
-            } else if (c == KEY_F(1) || c == '?') {
-                help_active = !help_active;
-            } else if (c == 'i') {
-                info_active = !info_active;
-            } else if (c == 'l') {
-                log_active = !log_active;
-            } else if (c == 'A' || c == 'a') {
-                overwritefile = c == 'A';
-
-                if (!active_input) {
-                    active_input = ENTERING_URL;
-                    continue;
-                }
-            } else if (c == 'Q') {
-                finish(0);
-            } else if (c == 'S') {
-                downloading = !downloading;
-                if (downloading && items) {
-                    DownloadItem *item = items;
-
-                    wtimeout(downloads, 100);
-                    wtimeout(openwin, 100);
-                    start_time = time(NULL);
-
-                    for (;item;) {
-                        if (item->mode == MODE_PAUSED) {
-                            item->mode = MODE_ACTIVE;
-                            add_handle(item);
-                            active_downloads++;
-                            paused_downloads--;
-                        }
-                        item = item->next;
-                    }
-                } else if (items) {
-                    DownloadItem *item = items;
-                    for (;item;) {
-                        if (item->mode == MODE_ACTIVE) {
-                            item->mode = MODE_PAUSED;
-                            paused_downloads++;
-                            active_downloads--;
-                            remove_handle(item);
-                        }
-                        item = item->next;
-                    }
-
-                    wtimeout(downloads, -1);
-                    wtimeout(openwin, -1);
-                }
-            } else if (c == 'h') {
-                if (sitem[current_mode] && sitem[current_mode]->mode == MODE_INACTIVE) {
-                    sitem[current_mode]->mode = MODE_PAUSED;
-                    inactive_downloads--;
-                    paused_downloads++;
-                }
-            } else if (c == 'D') {
-                if (sitem[current_mode] && (!current_mode || (sitem[current_mode]->mode == current_mode))) {
-                    sitem[current_mode] = delete_ditem(sitem[current_mode]);
-                }
-            } else if (c == 'R') {
-                if (sitem[current_mode]) {
-                    if (!active_input) {
-                        active_input = ENTERING_REFERER;
-                        continue;
-                    }
-                }
-            } else if (c == '/') {
-                if (!active_input) {
-                    active_input = ENTERING_SEARCH;
-                    continue;
-                }
-            } else if (c == 'n') {
-                if (last_search) {
-                    DownloadItem *nsitem = sitem[current_mode] ? sitem[current_mode]->next : items;
-
-                    for (;nsitem; nsitem = nsitem->next) {
-                        if ((nsitem->mode == current_mode || !current_mode) &&
-                            strstr(nsitem->outputfilename, last_search)) {
-                            sitem[current_mode] = nsitem;
-                            break;
-                        }
-                    }
-                }
-            } else if (c == 'N') {
-                if (last_search) {
-                    DownloadItem *nsitem = sitem[current_mode] ? sitem[current_mode]->prev : items_tail;
-
-                    for (;nsitem; nsitem = nsitem->prev) {
-                        if ((nsitem->mode == current_mode || !current_mode) &&
-                            strstr(nsitem->outputfilename, last_search)) {
-                            sitem[current_mode] = nsitem;
-                            break;
-                        }
-                    }
-                }
-            } else if (c == 'H') {
-                if (sitem[current_mode] && sitem[current_mode]->mode != MODE_INACTIVE) {
-                    if (sitem[current_mode]->mode == MODE_ACTIVE) {
-                        active_downloads--;
-                        remove_handle(sitem[current_mode]);
-                    } else if (sitem[current_mode]->mode == MODE_FINISHED) {
-                        finished_downloads--;
-                    } else if (sitem[current_mode]->mode == MODE_PAUSED) {
-                        paused_downloads--;
-                    }
-                    sitem[current_mode]->mode = MODE_INACTIVE;
-                    inactive_downloads++;
-                }
-            } else if (c == 'p') {
-                if (sitem[current_mode] && (sitem[current_mode]->mode == MODE_ACTIVE ||
-                                            sitem[current_mode]->mode == MODE_PAUSED)) {
-                    if (sitem[current_mode]->mode == MODE_ACTIVE) {
-                        remove_handle(sitem[current_mode]);
-                        paused_downloads++;
-                        active_downloads--;
-                        sitem[current_mode]->mode = MODE_PAUSED;
-                    } else {
-                        sitem[current_mode]->mode = MODE_ACTIVE;
-                        wtimeout(downloads, 100);
-                        wtimeout(openwin, 100);
-                        downloading = 1;
-                        paused_downloads--;
-                        active_downloads++;
-                        add_handle(sitem[current_mode]);
-                        if (start_time == INT_MIN)
-                            start_time = sitem[current_mode]->start_time;
-                    }
-
-                    if (current_mode) {
-                        DownloadItem *temp = sitem[current_mode];
-
-                        for (; sitem[current_mode]; sitem[current_mode] = sitem[current_mode]->next) {
-                            if (sitem[current_mode]->mode == current_mode)
-                                break;
-                        }
-
-                        if (!sitem[current_mode]) {
-                            sitem[current_mode] = temp;
-
-                            for (; sitem[current_mode]; sitem[current_mode] = sitem[current_mode]->prev) {
-                                if (sitem[current_mode]->mode == current_mode)
-                                    break;
-                            }
-                        }
-                    }
-
-                }
-            } else if (c == KEY_DOWN) {
-                if (sitem[current_mode] && sitem[current_mode]->next) {
-                    DownloadItem *item = sitem[current_mode]->next;
-
-                    if (current_mode) {
-                        for (;item; item = item->next) {
-                            if (item->mode == current_mode)
-                                break;
-                        }
-                    }
-                    if (item && (item->mode == current_mode || !current_mode))
-                        sitem[current_mode] = item;
-                }
-
-                if (!sitem[current_mode]) {
-                    DownloadItem *item = items;
-
-                    if (current_mode) {
-                        for (;item; item = item->next) {
-                            if (item->mode == current_mode)
-                                break;
-                        }
-                    }
-
-                    sitem[current_mode] = item;
-                }
-            } else if (c == KEY_UP) {
-                if (sitem[current_mode] && sitem[current_mode]->prev) {
-                    DownloadItem *item = sitem[current_mode]->prev;
-
-                    if (current_mode) {
-                        for (;item; item = item->prev) {
-                            if (item->mode == current_mode)
-                                break;
-                        }
-                    }
-                    if (item && (item->mode == current_mode || !current_mode))
-                        sitem[current_mode] = item;
-                }
-
-                if (!sitem[current_mode]) {
-                    DownloadItem *item = items;
-
-                    if (current_mode) {
-                        for (;item; item = item->prev) {
-                            if (item->mode == current_mode)
-                                break;
-                        }
-                    }
-
-                    sitem[current_mode] = item;
-                }
-            } else if (c == KEY_NPAGE) {
-                if (!sitem[current_mode]) {
-                    current_page++;
-                    current_page = MIN(current_page, nb_ditems / (LINES-1));
-                } else {
-                    if (sitem[current_mode]->next) {
-                        int i;
-
-                        sitem[current_mode] = sitem[current_mode]->next;
-                        for (i = 0; i < LINES-1; i++) {
-                            if (!sitem[current_mode]->next)
-                                break;
-                            sitem[current_mode] = sitem[current_mode]->next;
-                        }
-                    }
-                }
-            } else if (c == KEY_PPAGE) {
-                if (!sitem[current_mode]) {
-                    current_page--;
-                    current_page = MAX(0, current_page);
-                } else {
-                    if (sitem[current_mode]->prev) {
-                        int i;
-
-                        sitem[current_mode] = sitem[current_mode]->prev;
-                        for (i = 0; i < LINES-1; i++) {
-                            if (!sitem[current_mode]->prev)
-                                break;
-                            sitem[current_mode] = sitem[current_mode]->prev;
-                        }
-                    }
-                }
-            } else if (c == KEY_RIGHT) {
-                if (sitem[current_mode]) {
-                    sitem[current_mode]->max_speed += 1024;
-                    curl_easy_setopt(sitem[current_mode]->handle, CURLOPT_MAX_RECV_SPEED_LARGE,
-                                     sitem[current_mode]->max_speed);
-                }
-            } else if (c == KEY_LEFT) {
-                if (sitem[current_mode]) {
-                    sitem[current_mode]->max_speed = MAX(0, sitem[current_mode]->max_speed - 1024);
-                    curl_easy_setopt(sitem[current_mode]->handle, CURLOPT_MAX_RECV_SPEED_LARGE,
-                                     sitem[current_mode]->max_speed);
-                }
-            } else if (c == KEY_HOME) {
-                if (sitem[current_mode]) {
-                    DownloadItem *item = items;
-                    for (;item; item = item->next) {
-                        if (item->mode == current_mode || !current_mode)
-                            break;
-                    }
-                    sitem[current_mode] = item;
-                }
-            } else if (c == KEY_END) {
-                if (sitem[current_mode]) {
-                    DownloadItem *item = items_tail;
-                    for (;item; item = item->prev) {
-                        if (item->mode == current_mode || !current_mode)
-                            break;
-                    }
-                    sitem[current_mode] = item;
-                }
-            } else if (c == KEY_RESIZE) {
-                delwin(openwin);
-                delwin(infowin);
-                delwin(helpwin);
-                delwin(statuswin);
-                delwin(logwin);
-                delwin(downloads);
-                clear();
-                refresh();
-                endwin();
-
-                init_windows();
-                set_timeouts(downloading);
-
-                help_active = 0;
-                active_input = 0;
-                current_page = 0;
-            } else if (c == KEY_MOUSE) {
-                MEVENT mouse_event;
-                int y;
-
-                if (getmouse(&mouse_event) == OK) {
-                    sitem[current_mode] = items;
-                    for (y = 0; sitem[current_mode]->next; y++) {
-                        if (y == ((current_page * (LINES - 1)) + mouse_event.y))
-                            break;
-                        sitem[current_mode] = sitem[current_mode]->next;
-                    }
-                }
-            }
+            active_input = handle_key(c, &overwritefile);
+            if (active_input)
+                continue;
         }
 
-        write_downloads();
-        write_statuswin(downloading);
-
-        set_timeouts(downloading);
-
-        if (info_active)
-            write_infowin(sitem[current_mode]);
-
-        if (log_active)
-            write_logwin();
-
-        if (help_active)
-            write_helpwin();
-
-        doupdate();
+        render_frame();
     }
     return NULL;
 }
@@ -1424,33 +7715,36 @@ int main(int argc, char *argv[])
     long max_host_connections = 0;
 
     signal(SIGINT, finish);
+    /* only for drawing, numbers are still parsed and printed the C way */
+    setlocale(LC_CTYPE, "");
+    /* a stream whose reader went away fails its writes instead */
+    signal(SIGPIPE, SIG_IGN);
 
-    mhandle = curl_multi_init();
-    if (!mhandle) {
-        error(-1, "Failed to create curl multi handle.\n");
-    }
-
-    eventbase = event_base_new();
-    if (!eventbase) {
-        error(-1, "Failed to create new event base.\n");
-    }
-
-    timerevent = evtimer_new(eventbase, timer_cb, NULL);
-    if (!timerevent) {
-        error(-1, "Failed to create new event timer.\n");
+    if (pipe(ui_pipe)) {
+        error(-1, "Failed to create wakeup pipe.\n");
     }
+    for (int i = 0; i < 2; i++)
+        fcntl(ui_pipe[i], F_SETFL, O_NONBLOCK);
 
     string = calloc(MAX_STRING_LEN, sizeof(*string));
     if (!string) {
         error(-1, "Failed to allocate string storage.\n");
     }
 
-    curl_multi_setopt(mhandle, CURLMOPT_SOCKETFUNCTION, sock_cb);
-    curl_multi_setopt(mhandle, CURLMOPT_SOCKETDATA, NULL);
-    curl_multi_setopt(mhandle, CURLMOPT_TIMERFUNCTION, multi_timer_cb);
-    curl_multi_setopt(mhandle, CURLMOPT_TIMERDATA, NULL);
-
-    initscr();
+    /* headless renders into /dev/null, starts everything at once and
+     * exits when all is downloaded, unless -x or -X say otherwise */
+    parse_headless(argc, argv);
+    if (headless) {
+        auto_start = auto_exit = 1;
+        nullout = fopen("/dev/null", "w");
+        nullin = fopen("/dev/null", "r");
+        if (!nullout || !nullin || !(screen = newterm("vt100", nullout, nullin))) {
+            fprintf(stderr, "Failed to create headless screen.\n");
+            exit(-1);
+        }
+    } else {
+        initscr();
+    }
     nonl();
     cbreak();
     noecho();
@@ -1476,21 +7770,55 @@ int main(int argc, char *argv[])
     if (parse_parameters(argc, argv, &max_total_connections, &max_host_connections))
         write_downloads();
 
-    curl_multi_setopt(mhandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, max_total_connections);
-    curl_multi_setopt(mhandle, CURLMOPT_MAX_HOST_CONNECTIONS, max_host_connections);
+    trace_open();
+
+    if (init_shards(max_total_connections, max_host_connections)) {
+        error(-1, "Failed to create transfer threads.\n");
+    }
+
+    if (dns_prefetch > 0) {
+        dnsbase = evdns_base_new(shards[0].base, EVDNS_BASE_INITIALIZE_NAMESERVERS |
+                                            EVDNS_BASE_DISABLE_WHEN_INACTIVE);
+        if (!dnsbase)
+            write_log(COLOR_PAIR(1), "Failed to create DNS resolver, prefetch disabled.\n");
+        /* the items given so far were added before the resolver */
+        for (DownloadItem *item = items; item; item = item->next) {
+            if (item->hot->mode == MODE_PAUSED)
+                queue_prefetch(item);
+        }
+        prefetch_dns();
+    }
+
+    start_writers();
+
+    init_watches();
+
+    if (headless && auto_exit && finished_downloads + inactive_downloads == nb_ditems && !running_watches)
+        finish(inactive_downloads > 0);
 
     auto_startall();
+    apply_probes();
 
     write_statuswin(downloading);
     doupdate();
 
-    set_timeouts(downloading);
-
-    pthread_create(&curses_thread, NULL, do_ncurses, NULL);
-    pthread_create(&curl_thread, NULL, do_curl, NULL);
+    if (!headless)
+        curses_started = !pthread_create(&curses_thread, NULL, do_ncurses, NULL);
+    pthread_mutex_lock(&queue_lock);
+    for (int i = 0; i < nb_shards; i++) {
+        shards[i].started = !pthread_create(&shards[i].thread, NULL, do_shard, &shards[i]);
+        running_shards += shards[i].started;
+    }
+    pthread_mutex_unlock(&queue_lock);
 
-    pthread_join(curses_thread, NULL);
-    pthread_join(curl_thread, NULL);
+    if (!headless)
+        pthread_join(curses_thread, NULL);
+    for (int i = 0; i < nb_shards; i++) {
+        if (shards[i].started)
+            pthread_join(shards[i].thread, NULL);
+    }
 
     finish(0);
+
+    return 0;
 }